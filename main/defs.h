@@ -1,6 +1,7 @@
 #ifndef DEFS_H_INCLUDED
 #define DEFS_H_INCLUDED
 
+#include <stdatomic.h>
 #include <stdlib.h>
 
 #include "driver/gpio.h"
@@ -10,26 +11,180 @@
 #include "freertos/event_groups.h"
 #include "freertos/queue.h"
 #include "freertos/semphr.h"
+#include "freertos/task.h"
 
 #include "lego_encoder.h"
+#include "lego_mailbox.h"
+#include "lego_map.h"
+#include "lego_metrics.h"
+#include "lego_nes.h"
+#include "lego_pid.h"
+#include "lego_range.h"
+#include "lego_ring.h"
+#include "lego_sched.h"
+#include "lego_trace.h"
+#include "lego_window.h"
 
 //
 // Defines
 //
-#define RX_DONE_BIT 1 << 0
-#define GPIO_BTN_DOWN_BIT 1 << 1
-#define GPIO_BTN_UP_BIT 1 << 2
 #define WIFI_STARTED_BIT 1 << 3
 #define WIFI_CONNECTED_BIT 1 << 4
 #define WIFI_DISCONNECTED_BIT 1 << 5
 #define IP_GOT_IP_BIT 1 << 6
-#define MQTT_CONNECTED_BIT 1 << 7
 #define LEGO_PKT_FLUSH_BIT 1 << 8
 #define LEGO_PKT_CONT_BIT 1 << 9
+#define LEGO_TX_DONE_BIT 1 << 10
+#define IR_READY_BIT 1 << 11
+#define MQTT_UP_BIT 1 << 12
+#define MQTT_DOWN_BIT 1 << 13
+#define MQTT_FLUSH_BIT 1 << 14
+#define MQTT_RETRY_BIT 1 << 15
+#define NES_POLL_BIT 1 << 16
 
+// Task placement. With IR_TASK_PINNING the IR tasks and the RMT interrupts
+// run on IR_CORE, away from Wi-Fi, lwIP and MQTT on NET_CORE (pinned in
+// sdkconfig). 0 leaves the tasks unpinned and the interrupts on the core of
+// app_main, as before, for comparison with jitter_bench.h.
+#define IR_TASK_PINNING 1
+#define IR_CORE 1
+#define NET_CORE 0
+#define TASK_CORE(core) (IR_TASK_PINNING ? (core) : tskNO_AFFINITY)
+// Priorities by latency class. The Wi-Fi driver (23) and lwIP (18) only
+// share NET_CORE with PRIO_NET and below.
+// Frame timing on the LED, button holds, receiving
+#define PRIO_IR 20
+// Sensors and input devices feeding the IR pipeline
+#define PRIO_SENSOR 12
+// Connection upkeep
+#define PRIO_NET 5
+// Reports and dumps
+#define PRIO_BACKGROUND 1
+
+// Local buttons, see input_pins. Off unless some are wired: GPIO0 is the
+// boot button.
+#define INPUT_ENABLED 0
+// Button scan period, how long a level must hold to count and when a held
+// button becomes a long press
+#define INPUT_SCAN_MS 5
+#define INPUT_DEBOUNCE_MS 20
+#define INPUT_LONG_PRESS_MS 800
+
+// HC-SR04 distance sensor and the controller that drives with it, off
+// unless one is wired
+#define HC_SR04_ENABLED 0
 #define HC_SR04_TRIG_GPIO GPIO_NUM_2
 #define HC_SR04_ECHO_GPIO GPIO_NUM_14
+// The sensor gives up on an echo after ~38 ms, the next ping goes out then
+#define HC_SR04_ECHO_TIMEOUT_MS 40
+// Publish every sample to esp/1/range, can be toggled over esp/1/range/stream
+#define HC_SR04_STREAM false
+// Samples per esp/1/range message
+#define HC_SR04_STREAM_BATCH 8
+// Distance controller, see lego_pid.h. The gains are in speed steps per mm,
+// mm·s and mm/s, tuned with tools/pid_sim.c. A setpoint of 0 turns it off,
+// esp/1/range/setpoint changes it.
+#define RANGE_SETPOINT_MM 300
+#define RANGE_PID_KP 0.07
+#define RANGE_PID_KI 0.01
+#define RANGE_PID_KD 0.004
+#define RANGE_PID_DEADBAND_MM 5
+#define RANGE_PID_HYSTERESIS 0.2
+#define RANGE_PID_MAX_STEP 7
+// Copies of each speed change, the receiver acts on the first one it gets
+#define RANGE_DRIVE_REPEAT 2
 #define IR_TRX_LED_GPIO GPIO_NUM_15
+// IR receiver, off unless one is wired: an open input picks up noise and the
+// board's own frames. Input only pin.
+#define IR_RX_ENABLED 0
+#define IR_RX_GPIO GPIO_NUM_34
+
+// Number of RMT transactions kept queued, so the next batch is already
+// waiting when the current one finishes
+#define IR_TX_PIPELINE_DEPTH 4
+// Packets per RMT transaction. The channel interleaving is decided when a
+// transaction is staged, so this bounds how far ahead of the air it runs.
+#define IR_TX_BATCH_PACKETS 8
+// RMT memory of the TX channel without DMA. The ESP32 has 512 symbols for
+// all channels and the RX channel takes IR_RX_BUFFER_SYMBOLS of them. A hold
+// loop has to fit whole: up to 4 frames with their gaps.
+#define IR_TX_MEM_SYMBOLS 256
+// Stream long sequences over DMA instead of refilling RMT memory from the
+// ISR. Needs SOC_RMT_SUPPORT_DMA, which the original ESP32 lacks.
+#define IR_TX_WITH_DMA 0
+// Idle time after the stop bit of every frame. It used to be a fixed 30 ms.
+#define IR_TX_MIN_GAP_US 2000
+// Space repeated packets on a channel with the PF retransmit windows, so
+// they don't collide forever with a remote or another transmitter on the
+// same channel. Other channels' frames fill the windows.
+#define IR_TX_RETRANSMIT_WINDOWS true
+// Longest wait for the queued frames to go out in jitter_bench.h
+#define IR_TX_DRAIN_TIMEOUT_MS 10000
+// Joystick updates closer together than this are merged, only the newest
+// one is sent
+#define IR_BUTTON_COALESCE_MS 20
+// How often the latency percentiles go out on esp/1/metrics
+#define LEGO_METRICS_PERIOD_MS 10000
+// Reports from lego_controller waiting to be published, room for a whole
+// window of done acks (LEGO_WINDOW_SIZE) and the stats that come with them
+#define LEGO_REPORT_QUEUE_LEN 24
+// How often the trace ring is drained to esp/1/trace, and records per
+// message. Records beyond LEGO_TRACE_SIZE in between are lost.
+#define LEGO_TRACE_PERIOD_MS 1000
+#define LEGO_TRACE_CHUNK 128
+// How often stack, heap, CPU and queue figures go out on esp/1/telemetry
+#define TELEMETRY_PERIOD_MS 10000
+// Stack headroom in bytes below which a task is logged as too small
+#define TELEMETRY_STACK_MIN_FREE 512
+// Reconnect backoff after the broker goes away, doubling from MIN to MAX,
+// and how long an attempt may take before the next one
+#define MQTT_BACKOFF_MIN_MS 500
+#define MQTT_BACKOFF_MAX_MS 30000
+#define MQTT_CONNECT_TIMEOUT_MS 20000
+// The same for the access point, where an attempt already takes seconds
+#define WIFI_BACKOFF_MIN_MS 1000
+#define WIFI_BACKOFF_MAX_MS 30000
+#define WIFI_CONNECT_TIMEOUT_MS 30000
+// Pad on the NES lines, reads per second (up to 1000) and the clock, slow
+// enough for a 4021 at 3.3 V. Off unless one is wired.
+#define NES_ENABLED 0
+#define NES_PAD LEGO_NES_PAD_NES
+#define NES_POLL_HZ 120
+#define NES_SPI_HZ 200000
+#define NES_SPI_HOST SPI2_HOST
+// Pad lines, through the GPIO matrix. MOSI drives the latch.
+#define NES_CLK_GPIO GPIO_NUM_13
+#define NES_LATCH_GPIO GPIO_NUM_26
+#define NES_MISO_GPIO GPIO_NUM_27
+// Symbols per rmt_receive(). The original ESP32 can't receive more than the
+// channel memory in one go, a frame is LEGO_FRAME_SYMBOLS.
+#define IR_RX_BUFFER_SYMBOLS 64
+// Silence that ends a receive, longer than any space inside a frame
+#define IR_RX_IDLE_US 1500
+// Decoded packets waiting for a reader
+#define IR_RX_QUEUE_LEN 32
+// How often ir_rx checks that the receiver is still armed
+#define IR_RX_CHECK_MS 1000
+
+// Every pin a peripheral drives or reads and whether it is built in, the
+// flash LED and the red LED first. Two on one pin fail the build.
+#define WIRED_PINS(X)                                                                              \
+	X(GPIO_NUM_4, true)                                                                            \
+	X(GPIO_NUM_33, true)                                                                           \
+	X(IR_TRX_LED_GPIO, true)                                                                       \
+	X(IR_RX_GPIO, IR_RX_ENABLED)                                                                   \
+	X(HC_SR04_TRIG_GPIO, HC_SR04_ENABLED)                                                          \
+	X(HC_SR04_ECHO_GPIO, HC_SR04_ENABLED)                                                          \
+	X(NES_CLK_GPIO, NES_ENABLED)                                                                   \
+	X(NES_LATCH_GPIO, NES_ENABLED)                                                                 \
+	X(NES_MISO_GPIO, NES_ENABLED)
+
+#define WIRED_PIN_BIT(pin, on) ((on) ? (uint64_t)1 << (pin) : 0)
+#define WIRED_PIN_SUM(pin, on) +WIRED_PIN_BIT(pin, on)
+#define WIRED_PIN_OR(pin, on) | WIRED_PIN_BIT(pin, on)
+// Pins taken by WIRED_PINS
+#define WIRED_PINS_MASK (0 WIRED_PINS(WIRED_PIN_OR))
+_Static_assert((0 WIRED_PINS(WIRED_PIN_SUM)) == WIRED_PINS_MASK, "Two WIRED_PINS on one GPIO");
 
 #define MQTT_URI "mqtt://192.168.0.110:1883"
 
@@ -55,39 +210,87 @@
 			}                                                                                      \
 		}                                                                                          \
 		ESP_LOGI(                                                                                  \
-			tag ":packet", "Lego Packet 0x%04x: single_key=%d channel=%u keys=%s", pkt_raw,        \
-			(pkt).single_key, (pkt).channel + 1, key_str);                                         \
+			tag ":packet", "Lego Packet 0x%04x: toggle=%d escape=%d channel=%u mode=%u keys=%s",   \
+			pkt_raw, (pkt).toggle, (pkt).escape, (pkt).channel + 1, (pkt).mode, key_str);          \
 	} while (false);
 
+#define LEGO_TRACE(event, payload) lego_trace(&lego_trace_log, LEGO_TRACE_##event, payload)
+
+// Startup milestones, reported in esp/1/telemetry as us since boot
+#define BOOT_PHASES(X)                                                                             \
+	X(APP_MAIN, "app_main")                                                                        \
+	/* The RMT channels are enabled */                                                             \
+	X(IR_READY, "ir_ready")                                                                        \
+	/* lego_controller and the local inputs are running */                                         \
+	X(IR_STARTED, "ir_started")                                                                    \
+	/* The first IR transaction is off the LED */                                                  \
+	X(FIRST_FRAME, "first_frame")                                                                  \
+	X(WIFI_STARTED, "wifi_started")                                                                \
+	X(WIFI_CONNECTED, "wifi_connected")                                                            \
+	X(GOT_IP, "got_ip")                                                                            \
+	X(MQTT_CONNECTED, "mqtt_connected")
+
+#define BOOT_PHASE_ENUM(id, name) BOOT_##id,
+enum boot_phase { BOOT_PHASES(BOOT_PHASE_ENUM) BOOT_PHASE_COUNT };
+#undef BOOT_PHASE_ENUM
+
 //
 // Globals
 //
 struct lego_state {
 	uint8_t channel;
-	lego_packet_t packets[128];
-	uint32_t npackets;
-	enum lego_key pressed_button;
-	bool pressed_button_end_sent;
+	// Per-channel queues, filled by the MQTT task, drained by lego_controller
+	lego_sched_t sched;
+	// Joystick keys from lego/button, written by the MQTT task
+	lego_mailbox_t buttons;
+	// Keys of every channel mapped from the pad, written by nes_map
+	lego_mailbox_t pad;
+	// Speed step of the distance controller as int8_t, written by hs_sr04
+	lego_mailbox_t drive;
+	// Numbered batches not yet acked as done
+	lego_window_t window;
 } lego_state = {0};
 
 static EventGroupHandle_t egroup = NULL;
 
-static esp_timer_handle_t gpio_glitch_timer_handle = NULL;
+// Command path latencies, see lego_metrics.h
+static lego_metrics_t lego_metrics = {0};
+static uint32_t lego_metrics_clock(void) {
+	return esp_timer_get_time();
+}
+
+// Hot path events, see lego_trace.h
+static lego_trace_t lego_trace_log = {0};
+
+// 0 until reached, see BOOT_PHASES
+static _Atomic uint32_t boot_us[BOOT_PHASE_COUNT] = {0};
+
+// Only the first time counts. Safe from an ISR.
+static inline void boot_mark(enum boot_phase phase) {
+	uint32_t unset = 0;
+	atomic_compare_exchange_strong(&boot_us[phase], &unset, (uint32_t)esp_timer_get_time() | 1);
+}
+
+// Buttons for input.h, active low, and the keys they hold on
+// lego_state.channel, the same as esp/1/lego/button
+static const gpio_num_t input_pins[] = {GPIO_NUM_0};
+static const uint8_t input_keys[] = {LEGO_LF};
 
-static esp_timer_handle_t nes_timer_handle[2] = {0};
-static int8_t nes_state = 0;
-static gpio_num_t nes_clk = GPIO_NUM_13;
-static gpio_num_t nes_latch = GPIO_NUM_15;
-static gpio_num_t nes_miso = GPIO_NUM_14;
-static uint8_t nes_buttons = 0;
+// lego_nes_event_t, on every change
 static QueueHandle_t nes_button_queue = NULL;
 
-static lego_packet_t packets[8] = {0};
 static mcpwm_cap_timer_handle_t hc_sr04_mcpwm_capture_timer_handle = NULL;
 static mcpwm_cap_channel_handle_t hc_sr04_mcpwm_capture_channel_handle = NULL;
 static esp_timer_handle_t hc_sr04_trig_timer_handle = NULL;
 static uint32_t capture_positive = 0;
-static uint32_t distance_mm = 0;
-static SemaphoreHandle_t hc_sr04_sem = NULL;
+// See lego_range_scale(), set before the capture channel is enabled
+static uint32_t hc_sr04_scale = 0;
+// Written by the capture ISR, drained by hs_sr04
+static lego_range_ring_t hc_sr04_ring = {0};
+static TaskHandle_t hc_sr04_task = NULL;
+// Filtered, written by hs_sr04
+static _Atomic uint32_t distance_mm = 0;
+static _Atomic bool hc_sr04_stream = HC_SR04_STREAM;
+static _Atomic uint32_t range_setpoint_mm = RANGE_SETPOINT_MM;
 
 #endif
@@ -0,0 +1,117 @@
+#ifndef INPUT_H_INCLUDED
+#define INPUT_H_INCLUDED
+
+#include "driver/gpio.h"
+#include "esp_log.h"
+#include "esp_timer.h"
+
+#include "freertos/FreeRTOS.h"
+#include "freertos/queue.h"
+
+#include "defs.h"
+#include "lego_input.h"
+
+// Buttons on input_pins, active low with pull-ups, see lego_input.h. The
+// edge ISR only stamps the pin, one esp_timer scans all of them every
+// INPUT_SCAN_MS and sends the events to input_queue. The ESP32 has no
+// per-pin glitch filter, so debouncing is left to the scan. input_task_fn()
+// turns presses into input_keys for lego_controller.
+
+static lego_input_t inputs = {0};
+static esp_timer_handle_t input_scan_timer = NULL;
+// lego_input_event_t
+static QueueHandle_t input_queue = NULL;
+// Events input_queue had no room for
+static uint32_t input_dropped = 0;
+
+_Static_assert(
+	sizeof(input_pins) / sizeof(input_pins[0]) <= LEGO_INPUT_MAX, "Too many input_pins");
+_Static_assert(sizeof(input_pins) / sizeof(input_pins[0]) == sizeof(input_keys), "A key per pin");
+
+static void input_isr_handler(void *arg) {
+	lego_input_edge(&inputs, (uintptr_t)arg, esp_timer_get_time());
+}
+
+static void input_scan_callback(void *arg) {
+	uint32_t pressed = 0;
+	for (uint8_t i = 0; i < inputs.npins; i++) {
+		pressed |= (uint32_t)!gpio_get_level(input_pins[i]) << i;
+	}
+	lego_input_event_t events[2 * LEGO_INPUT_MAX];
+	const uint32_t n = lego_input_scan(
+		&inputs, pressed, esp_timer_get_time(), events, sizeof(events) / sizeof(events[0]));
+	for (uint32_t i = 0; i < n; i++) {
+		if (xQueueSend(input_queue, &events[i], 0) != pdTRUE) {
+			input_dropped++;
+		}
+	}
+}
+
+static void configure_inputs(void) {
+	const uint8_t npins = sizeof(input_pins) / sizeof(input_pins[0]);
+	lego_input_init(&inputs, npins, INPUT_SCAN_MS, INPUT_DEBOUNCE_MS, INPUT_LONG_PRESS_MS);
+	input_queue = xQueueCreate(16, sizeof(lego_input_event_t));
+	assert(input_queue != NULL);
+
+	uint64_t mask = 0;
+	for (uint8_t i = 0; i < npins; i++) {
+		mask |= (uint64_t)1 << input_pins[i];
+	}
+	// Not known at compile time, see WIRED_PINS
+	assert((mask & WIRED_PINS_MASK) == 0);
+	const gpio_config_t gpio_cfg = {
+		.pin_bit_mask = mask,
+		.mode = GPIO_MODE_INPUT,
+		.pull_up_en = GPIO_PULLUP_ENABLE,
+		.intr_type = GPIO_INTR_ANYEDGE,
+	};
+	ESP_ERROR_CHECK(gpio_config(&gpio_cfg));
+	ESP_ERROR_CHECK(gpio_install_isr_service(ESP_INTR_FLAG_EDGE));
+	for (uint8_t i = 0; i < npins; i++) {
+		ESP_ERROR_CHECK(
+			gpio_isr_handler_add(input_pins[i], input_isr_handler, (void *)(uintptr_t)i));
+	}
+
+	const esp_timer_create_args_t timer_cfg = {
+		.callback = input_scan_callback,
+		.name = "input_scan",
+	};
+	ESP_ERROR_CHECK(esp_timer_create(&timer_cfg, &input_scan_timer));
+	ESP_ERROR_CHECK(esp_timer_start_periodic(input_scan_timer, INPUT_SCAN_MS * 1000));
+}
+
+static void input_task_fn(void *arg) {
+	static const char *kinds[] = {
+		[LEGO_INPUT_PRESS] = "press",
+		[LEGO_INPUT_RELEASE] = "release",
+		[LEGO_INPUT_LONG_PRESS] = "long_press",
+	};
+	lego_input_event_t event;
+	// Inputs that are down, and their keys
+	uint32_t down = 0;
+	uint8_t keys = 0;
+	for (;;) {
+		xQueueReceive(input_queue, &event, portMAX_DELAY);
+		ESP_LOGI(
+			"lego:button", "GPIO%d %s at %lu us", input_pins[event.input], kinds[event.kind],
+			event.stamp_us);
+		if (event.kind == LEGO_INPUT_PRESS) {
+			down |= (uint32_t)1 << event.input;
+		} else if (event.kind == LEGO_INPUT_RELEASE) {
+			down &= ~((uint32_t)1 << event.input);
+		}
+		uint8_t pressed = 0;
+		for (uint8_t i = 0; i < inputs.npins; i++) {
+			pressed |= (down >> i) & 1 ? input_keys[i] : 0;
+		}
+		if (pressed == keys) {
+			continue;
+		}
+		keys = pressed;
+		// Stamped with the edge, so the latency figures include the debounce
+		lego_mailbox_post(&lego_state.buttons, keys, event.stamp_us);
+		xEventGroupSetBits(egroup, LEGO_PKT_CONT_BIT);
+	}
+}
+
+#endif
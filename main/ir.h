@@ -9,37 +9,268 @@
 #include "freertos/event_groups.h"
 #include "freertos/semphr.h"
 
+#include "soc/soc_caps.h"
+
+#include <stdatomic.h>
+
 #include "defs.h"
+#include "lego_decoder.h"
 #include "lego_encoder.h"
 #include "networking.h"
 
 static rmt_channel_handle_t rx_chan = NULL;
 static rmt_channel_handle_t tx_chan = NULL;
-static rmt_symbol_word_t rx_data[1024] = {0};
-static uint32_t rx_data_len = 0;
 static lego_encoder_t lego_encoder = {0};
 
+// Ping-pong receive buffers: rmt_rx_done_callback() re-arms the receiver on
+// one while the other is being decoded. A receive lasts at least
+// IR_RX_IDLE_US, far longer than decoding a buffer.
+static rmt_symbol_word_t rx_buffers[2][IR_RX_BUFFER_SYMBOLS] = {0};
+static uint8_t rx_next = 0;
+static const rmt_receive_config_t rx_config = {
+	.signal_range_min_ns = 1250,
+	.signal_range_max_ns = IR_RX_IDLE_US * 1000,
+};
+typedef struct {
+	rmt_symbol_word_t *symbols;
+	size_t num_symbols;
+	// Time of the last edge
+	int64_t end_us;
+} ir_rx_chunk_t;
+// Filled buffers, from rmt_rx_done_callback() to ir_rx_task_fn()
+static QueueHandle_t rx_chunk_queue = NULL;
+// Re-arms that failed in rmt_rx_done_callback(), ir_rx_task_fn() tries again
+static _Atomic uint32_t ir_rx_stopped = 0;
+// Decoded packets as lego_rx_packet_t
+static QueueHandle_t lego_rx_queue = NULL;
+static lego_decoder_t lego_decoder = {0};
+
+// RMT transactions in flight. lego_tx_submit() counts them in,
+// rmt_tx_done_callback() counts them out. Packets taken from the channel
+// queues are staged in the slot of their transaction until it is done.
+static struct {
+	lego_packet_t staged[IR_TX_PIPELINE_DEPTH][IR_TX_BATCH_PACKETS];
+	// MQTT ingest time of the oldest command starting in each slot, 0 if none
+	uint32_t ingest_us[IR_TX_PIPELINE_DEPTH];
+	_Atomic uint32_t submitted;
+	_Atomic uint32_t completed;
+} lego_tx = {0};
+
+// When set, rmt_tx_done_callback() logs its times here until `max`, for
+// jitter_bench.h
+static struct {
+	uint32_t *done_us;
+	uint32_t max;
+	_Atomic uint32_t count;
+} ir_tx_done_log = {0};
+
 static bool rmt_rx_done_callback(
 	rmt_channel_handle_t rx_chan, const rmt_rx_done_event_data_t *edata, void *user_ctx) {
 	BaseType_t woken = false;
-	rx_data_len = edata->num_symbols;
-	xEventGroupSetBitsFromISR(egroup, RX_DONE_BIT, &woken);
+	// The receive ended after IR_RX_IDLE_US of silence, or with a full buffer
+	// in which case the timestamps come out slightly early
+	const ir_rx_chunk_t chunk = {
+		.symbols = edata->received_symbols,
+		.num_symbols = edata->num_symbols,
+		.end_us = esp_timer_get_time() - IR_RX_IDLE_US,
+	};
+	xQueueSendFromISR(rx_chunk_queue, &chunk, &woken);
+	// Re-armed right here, the receiver is deaf until then
+	rx_next ^= 1;
+	const esp_err_t err =
+		rmt_receive(rx_chan, rx_buffers[rx_next], IR_RX_BUFFER_SYMBOLS, &rx_config);
+	if (err != ESP_OK) {
+		LEGO_TRACE(RX_STOPPED, atomic_fetch_add(&ir_rx_stopped, 1) + 1);
+	}
+	return woken == pdTRUE;
+}
+
+static bool rmt_tx_done_callback(
+	rmt_channel_handle_t tx_chan, const rmt_tx_done_event_data_t *edata, void *user_ctx) {
+	BaseType_t woken = false;
+	// The encoder still holds the timestamps of this transaction, the next
+	// one is started after the callback
+	const uint32_t done_us = esp_timer_get_time();
+	const uint32_t encode_us = lego_encoder.tx_encode_start_us;
+	const uint32_t rmt_start_us = lego_encoder.tx_rmt_start_us;
+	lego_metrics_record(&lego_metrics, LEGO_STAGE_ENCODE, rmt_start_us - encode_us);
+	lego_metrics_record(&lego_metrics, LEGO_STAGE_AIR, done_us - rmt_start_us);
+	const uint32_t completed =
+		atomic_fetch_add_explicit(&lego_tx.completed, 1, memory_order_release);
+	if (completed == 0) {
+		boot_mark(BOOT_FIRST_FRAME);
+	}
+	LEGO_TRACE(TX_DONE, completed + 1);
+	static uint32_t clamped = 0;
+	if (lego_encoder.timing.clamped != clamped) {
+		clamped = lego_encoder.timing.clamped;
+		LEGO_TRACE(TX_GAP_CLAMPED, clamped);
+	}
+	if (ir_tx_done_log.done_us != NULL) {
+		const uint32_t n = atomic_load_explicit(&ir_tx_done_log.count, memory_order_relaxed);
+		if (n < ir_tx_done_log.max) {
+			ir_tx_done_log.done_us[n] = done_us;
+			atomic_store_explicit(&ir_tx_done_log.count, n + 1, memory_order_release);
+		}
+	}
+	const uint32_t ingest_us = lego_tx.ingest_us[completed % IR_TX_PIPELINE_DEPTH];
+	if (ingest_us != 0) {
+		lego_metrics_record(&lego_metrics, LEGO_STAGE_QUEUE, encode_us - ingest_us);
+		lego_metrics_record(
+			&lego_metrics, LEGO_STAGE_FIRST_EDGE,
+			rmt_start_us + lego_encoder.tx_first_gap_us - ingest_us);
+	}
+	xEventGroupSetBitsFromISR(egroup, LEGO_TX_DONE_BIT, &woken);
 	return woken == pdTRUE;
 }
 
+static uint32_t lego_tx_inflight(void) {
+	return atomic_load_explicit(&lego_tx.submitted, memory_order_relaxed) -
+		   atomic_load_explicit(&lego_tx.completed, memory_order_acquire);
+}
+
+// The scheduler's timing model only sees the packets it hands out and those
+// accounted for with lego_sched_account(). Once the pipeline is empty the
+// encoder is idle and its timing is exact, so the model starts over from it.
+static void lego_tx_resync(void) {
+	if (lego_tx_inflight() == 0) {
+		lego_sched_resync(&lego_state.sched, &lego_encoder.timing, esp_timer_get_time());
+	}
+}
+
+// Staging buffer of the next transaction, only valid while the pipeline has
+// room
+static lego_packet_t *lego_tx_next_slot(void) {
+	const uint32_t submitted = atomic_load_explicit(&lego_tx.submitted, memory_order_relaxed);
+	return lego_tx.staged[submitted % IR_TX_PIPELINE_DEPTH];
+}
+
+// Queue a transaction without waiting for it. Blocks only while the pipeline
+// is full. `ingest_us` is the MQTT ingest time of its oldest new command, or 0.
+static void lego_tx_submit(lego_packet_t *pkts, uint32_t npackets, uint32_t ingest_us) {
+	const rmt_transmit_config_t tx_config = {
+		.loop_count = 0,
+	};
+	while (lego_tx_inflight() >= IR_TX_PIPELINE_DEPTH) {
+		xEventGroupWaitBits(egroup, LEGO_TX_DONE_BIT, true, false, portMAX_DELAY);
+	}
+	// Counted before the transaction can possibly complete
+	const uint32_t submitted =
+		atomic_fetch_add_explicit(&lego_tx.submitted, 1, memory_order_release);
+	lego_tx.ingest_us[submitted % IR_TX_PIPELINE_DEPTH] = ingest_us;
+	LEGO_TRACE(TX_SUBMIT, npackets);
+	for (uint32_t i = 0; i < npackets; i++) {
+		LEGO_TRACE(TX_PACKET, lego_packet_raw(&pkts[i]));
+	}
+	ESP_ERROR_CHECK(rmt_transmit(
+		tx_chan, &lego_encoder.base, pkts, sizeof(lego_packet_t) * npackets, &tx_config));
+}
+
+// Same, for packets the caller doesn't keep: the RMT reads them while it
+// transmits, so they are copied to the transaction's staging slot first
+static void lego_tx_send(const lego_packet_t *pkts, uint32_t npackets) {
+	assert(npackets <= IR_TX_BATCH_PACKETS);
+	while (lego_tx_inflight() >= IR_TX_PIPELINE_DEPTH) {
+		xEventGroupWaitBits(egroup, LEGO_TX_DONE_BIT, true, false, portMAX_DELAY);
+	}
+	lego_tx_resync();
+	lego_sched_account(&lego_state.sched, pkts, npackets);
+	lego_packet_t *staged = lego_tx_next_slot();
+	memcpy(staged, pkts, sizeof(lego_packet_t) * npackets);
+	lego_tx_submit(staged, npackets, 0);
+}
+
+// Both outputs of lego_state.channel at `speed` steps, 0 brakes. Single
+// output PWM has no timeout on the receiver, unlike combo PWM, so a speed is
+// only sent when it changes.
+static void lego_tx_drive(int8_t speed) {
+	static bool toggle = false;
+	const uint8_t step = speed != 0 ? lego_pwm_step(speed) : LEGO_PWM_BRAKE;
+	// A new toggle tells the receiver this isn't a repeat of the last speed
+	toggle = !toggle;
+	lego_packet_t pkts[2 * RANGE_DRIVE_REPEAT];
+	for (uint32_t i = 0; i < RANGE_DRIVE_REPEAT; i++) {
+		pkts[2 * i] = lego_packet_pwm(lego_state.channel, false, step, toggle);
+		pkts[2 * i + 1] = lego_packet_pwm(lego_state.channel, true, step, toggle);
+	}
+	lego_tx_send(pkts, 2 * RANGE_DRIVE_REPEAT);
+}
+
+// Held keys are 4 bits per channel as from lego_map_apply(). Their frames,
+// one per channel, are programmed once and looped by the RMT hardware.
+
+// Stops the frames of `from` looping, right away, possibly mid-frame. The
+// channels not in `to` get stop packets.
+static void lego_tx_release(uint16_t from, uint16_t to) {
+	if (from == 0) {
+		return;
+	}
+	// Drops the looping transaction without an on_trans_done, so it was never
+	// counted in lego_tx
+	ESP_ERROR_CHECK(rmt_disable(tx_chan));
+	ESP_ERROR_CHECK(rmt_encoder_reset(&lego_encoder.base));
+	ESP_ERROR_CHECK(rmt_enable(tx_chan));
+	lego_packet_t stops[8];
+	uint32_t nstops = 0;
+	for (uint8_t ch = 0; ch < 4; ch++) {
+		if (lego_map_channel_keys(from, ch) != 0 && lego_map_channel_keys(to, ch) == 0) {
+			stops[nstops++] = LEGO_STOP_PACKET(ch);
+			stops[nstops++] = LEGO_STOP_PACKET(ch);
+		}
+	}
+	if (nstops > 0) {
+		lego_tx_send(stops, nstops);
+	}
+}
+
+// Starts looping the frames of `keys`. A loop can't be queued behind the
+// pipeline, it would never drain, so until the pipeline is empty this
+// returns false and is tried again on LEGO_TX_DONE_BIT.
+static bool lego_tx_hold(uint16_t keys) {
+	static lego_packet_t hold_pkts[4];
+	const rmt_transmit_config_t loop_config = {
+		.loop_count = -1,
+	};
+	if (lego_tx_inflight() > 0) {
+		return false;
+	}
+	LEGO_TRACE(TX_HOLD, keys);
+	uint32_t nheld = 0;
+	for (uint8_t ch = 0; ch < 4; ch++) {
+		const enum lego_key channel_keys = lego_map_channel_keys(keys, ch);
+		if (channel_keys != 0) {
+			hold_pkts[nheld++] = (lego_packet_t){.key = channel_keys, .channel = ch};
+		}
+	}
+	// One pass, how long it loops is picked up by the next resync
+	lego_tx_resync();
+	lego_sched_account(&lego_state.sched, hold_pkts, nheld);
+	ESP_ERROR_CHECK(rmt_transmit(
+		tx_chan, &lego_encoder.base, hold_pkts, sizeof(lego_packet_t) * nheld, &loop_config));
+	return true;
+}
+
 static void configure_ir_tx(void) {
+#if IR_TX_WITH_DMA && !SOC_RMT_SUPPORT_DMA
+#error "RMT DMA backend is not available on this target"
+#endif
 	const rmt_tx_channel_config_t tx_chan_cfg = {
 		.clk_src = RMT_CLK_SRC_DEFAULT,
 		.resolution_hz = 1e6,
-		.mem_block_symbols = 512,
-		.trans_queue_depth = 4,
+		.mem_block_symbols = IR_TX_WITH_DMA ? 1024 : IR_TX_MEM_SYMBOLS,
+		.trans_queue_depth = IR_TX_PIPELINE_DEPTH,
 		.gpio_num = IR_TRX_LED_GPIO,
-		.flags.with_dma = false,
+		.flags.with_dma = IR_TX_WITH_DMA,
 		.flags.invert_out = false,
 	};
 	ESP_ERROR_CHECK(rmt_new_tx_channel(&tx_chan_cfg, &tx_chan));
 	assert(tx_chan != NULL);
 
+	const rmt_tx_event_callbacks_t callbacks = {
+		.on_trans_done = rmt_tx_done_callback,
+	};
+	ESP_ERROR_CHECK(rmt_tx_register_event_callbacks(tx_chan, &callbacks, NULL));
+
 	const rmt_carrier_config_t tx_carrier_cfg = {
 		.duty_cycle = 0.33,
 		.frequency_hz = 38000,
@@ -48,175 +279,20 @@ static void configure_ir_tx(void) {
 	};
 	ESP_ERROR_CHECK(rmt_apply_carrier(tx_chan, &tx_carrier_cfg));
 
-	ESP_ERROR_CHECK(lego_encoder_new(&lego_encoder));
-}
-
-static void ir_tx_task_fn(void *arg) {
-	bool is_pressed = false;
-	bool end_sent = true;
-	BaseType_t bits = 0;
-	rmt_transmit_config_t tx_config = {.loop_count = 0};
-	// uint8_t nes_buttons = 0;
-	uint32_t npackets = 0;
-	uint8_t lego_chan = 1;
-	uint32_t distance_mm_copy = 0;
-
-	for (;;) {
-		if (!xSemaphoreTake(hc_sr04_sem, pdMS_TO_TICKS(1000))) {
-			// Shouldn't happen
-			vTaskDelay(pdMS_TO_TICKS(100));
-			continue;
-		}
-		distance_mm_copy = distance_mm;
-		xSemaphoreGive(hc_sr04_sem);
-
-		if (distance_mm_copy > 400) {
-			end_sent = false;
-			packets[0] = (lego_packet_t){
-				.key = LEGO_LF | LEGO_RF,
-				.channel = lego_chan,
-			};
-			npackets = 1;
-		} else if (distance_mm_copy < 200) {
-			end_sent = false;
-			packets[0] = (lego_packet_t){
-				.key = LEGO_LB | LEGO_RB,
-				.channel = lego_chan,
-			};
-			npackets = 1;
-		} else if (!end_sent) {
-			packets[0] = LEGO_STOP_PACKET(lego_chan);
-			packets[1] = LEGO_STOP_PACKET(lego_chan);
-			npackets = 2;
-			end_sent = true;
-		} else {
-			vTaskDelay(pdMS_TO_TICKS(100));
-			continue;
-		}
-
-		// if (!xQueueReceive(nes_button_queue, &nes_buttons, 1000 /
-		// portTICK_PERIOD_MS)) { 	continue;
-		// }
-
-		// BaseType_t new_bits = xEventGroupWaitBits(egroup, GPIO_BTN_DOWN_BIT |
-		// GPIO_BTN_UP_BIT, true, false, 0); if (new_bits != 0) { 	bits =
-		// new_bits;
-		// }
-
-		// // Controlling with NES controller
-		// if (nes_buttons == 0x00 && !end_sent) {
-		// 	packets[0] = LEGO_STOP_PACKET(lego_chan);
-		// 	packets[1] = LEGO_STOP_PACKET(lego_chan);
-		// 	npackets = 2;
-		// 	end_sent = true;
-		// } else if (nes_buttons != 0) {
-		// 	end_sent = false;
-		// 	lego_packet_t move_pkt = {.key = 0, .channel = lego_chan};
-		// 	if (nes_buttons & 0x10) {
-		// 		move_pkt.key = LEGO_LF | LEGO_RF;
-		// 	} else if (nes_buttons & 0x20) {
-		// 		move_pkt.key = LEGO_LB | LEGO_RB;
-		// 	} else if (nes_buttons & 0x40) {
-		// 		move_pkt.key = LEGO_RF;
-		// 	} else if (nes_buttons & 0x80) {
-		// 		move_pkt.key = LEGO_LF;
-		// 	}
-		// 	packets[0] = move_pkt;
-		// 	npackets = 1;
-		// } else {
-		// 	continue;
-		// }
-
-		// if (bits & GPIO_BTN_DOWN_BIT) {
-		// 	// if (!end_sent) {
-		// 	// 	// Prevent frequent key packets
-		// 	// 	vTaskDelay(100 / portTICK_PERIOD_MS);
-		// 	// }
-		// 	// ESP_LOGI("lego:tx:flow", "Sending key packet");
-		// 	end_sent = false;
-		// 	packets[0] = (lego_packet_t){.channel = lego_chan, .key = LEGO_LF |
-		// LEGO_RF}; 	npackets = 1; } else if ((bits & GPIO_BTN_UP_BIT) &&
-		// !end_sent) {
-		// 	// ESP_LOGI("lego:tx:flow", "Sending stop packet");
-		// 	end_sent = true;
-		// 	packets[0] = LEGO_STOP_PACKET(lego_chan);
-		// 	packets[1] = LEGO_STOP_PACKET(lego_chan);
-		// 	npackets = 2;
-		// } else {
-		// 	vTaskDelay(50 / portTICK_PERIOD_MS);
-		// 	continue;
-		// }
-
-		ESP_ERROR_CHECK(rmt_transmit(
-			tx_chan, &lego_encoder.base, packets, sizeof(lego_packet_t) * npackets, &tx_config));
-		ESP_ERROR_CHECK(rmt_tx_wait_all_done(tx_chan, 2000 / portTICK_PERIOD_MS));
-		// ESP_LOGI("lego:tx", "Sent lego packets. Total sent packets: %lu",
-		// lego_encoder.done_packets);
-		for (uint32_t i = 0; i < npackets; i++) {
-			LEGO_PACKET_DUMP("lego:tx", packets[i]);
-		}
-		LEGO_PACKET_DUMP("lego:tx:last_pkt", lego_encoder.last_packet);
-	}
-}
-
-static void lego_controller_task_fn(void *arg) {
-	const rmt_transmit_config_t tx_config = {
-		.loop_count = 0,
+	const lego_encoder_config_t encoder_cfg = {
+		.mode = LEGO_ENCODER_MODE_TABLE,
+		.timing.min_gap_us = IR_TX_MIN_GAP_US,
+		.timing.retransmit_windows = IR_TX_RETRANSMIT_WINDOWS,
 	};
-	for (;;) {
-		if (lego_state.pressed_button != 0) {
-			lego_state.pressed_button_end_sent = false;
-			lego_packet_t pkt = {
-				.key = lego_state.pressed_button,
-				.channel = lego_state.channel,
-			};
-			ESP_ERROR_CHECK(
-				rmt_transmit(tx_chan, &lego_encoder.base, &pkt, sizeof(lego_packet_t), &tx_config));
-			rmt_tx_wait_all_done(tx_chan, 10000);
-			ESP_LOGI("lego", "Sent buttons");
-			LEGO_PACKET_DUMP("lego", pkt);
-			continue;
-		} else if (lego_state.pressed_button == 0 && !lego_state.pressed_button_end_sent) {
-			lego_state.pressed_button_end_sent = true;
-			lego_packet_t pkt[] = {
-				LEGO_STOP_PACKET(lego_state.channel), LEGO_STOP_PACKET(lego_state.channel)};
-			ESP_ERROR_CHECK(rmt_transmit(
-				tx_chan, &lego_encoder.base, &pkt, sizeof(lego_packet_t) * 2, &tx_config));
-			rmt_tx_wait_all_done(tx_chan, 10000);
-			ESP_LOGI("lego", "Sent release");
-			LEGO_PACKET_DUMP("lego", pkt[0]);
-			continue;
-		}
-
-		const EventBits_t bits = xEventGroupWaitBits(
-			egroup, LEGO_PKT_FLUSH_BIT | LEGO_PKT_CONT_BIT, true, false, portMAX_DELAY);
-		if (bits == 0 || (bits & LEGO_PKT_CONT_BIT))
-			continue;
-		if (bits & LEGO_PKT_FLUSH_BIT) {
-			const rmt_transmit_config_t tx_config = {
-				.loop_count = 0,
-			};
-			for (uint32_t i = 0; i < lego_state.npackets; i++) {
-				lego_state.packets[i].channel = lego_state.channel;
-			}
-			ESP_ERROR_CHECK(rmt_transmit(
-				tx_chan, &lego_encoder.base, lego_state.packets,
-				sizeof(lego_packet_t) * lego_state.npackets, &tx_config));
-			const esp_err_t tx_result = rmt_tx_wait_all_done(tx_chan, 10000);
-			mqtt_publish_result(tx_result);
-			if (tx_result == ESP_OK)
-				ESP_LOGI("lego", "Sent %lu packets", lego_state.npackets);
-			lego_state.npackets = 0;
-		}
-	}
+	ESP_ERROR_CHECK(lego_encoder_new(&lego_encoder, &encoder_cfg));
 }
 
 static void configure_ir_rx(void) {
 	const rmt_rx_channel_config_t rx_chan_config = {
 		.clk_src = RMT_CLK_SRC_DEFAULT, // select source clock
 		.resolution_hz = 1e6,			// 1MHz tick resolution, i.e. 1 tick = 1us
-		.mem_block_symbols = 64,		// memory block size, 64 * 4 = 256Bytes
-		.gpio_num = GPIO_NUM_14,		// GPIO number
+		.mem_block_symbols = IR_RX_BUFFER_SYMBOLS,
+		.gpio_num = IR_RX_GPIO,			// GPIO number
 		.flags.invert_in = false,		// don't invert input signal
 		.flags.with_dma = false,		// don't need DMA backend
 	};
@@ -227,121 +303,291 @@ static void configure_ir_rx(void) {
 		.on_recv_done = rmt_rx_done_callback,
 	};
 	ESP_ERROR_CHECK(rmt_rx_register_event_callbacks(rx_chan, &callbacks, NULL));
+
+	rx_chunk_queue = xQueueCreate(2, sizeof(ir_rx_chunk_t));
+	lego_rx_queue = xQueueCreate(IR_RX_QUEUE_LEN, sizeof(lego_rx_packet_t));
+	assert(rx_chunk_queue != NULL && lego_rx_queue != NULL);
+	lego_decoder_init(&lego_decoder);
 }
 
-static void ir_rx_task_fn(void *data) {
-	static rmt_receive_config_t rx_config = {
-		.signal_range_min_ns = /* 1250 */ 100 * 1e3,
-		.signal_range_max_ns = /* 12000 * 1e3 */ 30000 * 1e3,
-	};
+// The RMT interrupts go to the core that creates the channels, so this runs
+// pinned to where they should be
+static void ir_setup_task_fn(void *arg) {
+	configure_ir_tx();
+	ESP_ERROR_CHECK(rmt_enable(tx_chan));
+#if IR_RX_ENABLED
+	configure_ir_rx();
+	ESP_ERROR_CHECK(rmt_enable(rx_chan));
+#endif
+	boot_mark(BOOT_IR_READY);
+	xEventGroupSetBits(egroup, IR_READY_BIT);
+	vTaskDelete(NULL);
+}
 
+// `timeout`, cut short to wake up at `deadline_us` if `pending`
+static TickType_t lego_wait_until(bool pending, int64_t deadline_us, TickType_t timeout) {
+	if (!pending) {
+		return timeout;
+	}
+	const int64_t left_us = deadline_us - esp_timer_get_time();
+	// Rounded up, waking up early would only mean waiting again
+	const TickType_t left = left_us <= 0 ? 0 : pdMS_TO_TICKS(left_us / 1000) + 1;
+	return left < timeout ? left : timeout;
+}
+
+static void lego_controller_task_fn(void *arg) {
+	// Keys to hold, 4 bits per channel. They come from lego/button for
+	// lego_state.channel and from the pad mapping. Their frames loop on the
+	// LED once the pipeline has drained, `looping` are the keys that do.
+	uint16_t held = 0;
+	uint16_t looping = 0;
+	uint16_t button_keys = 0;
+	uint16_t pad_keys = 0;
+	// Speed from the distance controller, sent while nothing is held
+	uint16_t drive = 0;
+	bool drive_pending = false;
+	int64_t buttons_changed_us = 0;
+	// A lego/button change waiting for the end of the coalescing window
+	bool button_pending = false;
+	uint32_t button_us = 0;
+	uint32_t latency_max_us = 0;
+	uint64_t latency_sum_us = 0;
+	uint32_t latency_count = 0;
+	bool batch_active = false;
+	uint32_t batch_sent = 0;
+	int64_t batch_start_us = 0;
+	// Per-channel rate accounting, published about once a second
+	int64_t stats_start_us = 0;
+	uint32_t stats_sent[4] = {0};
 	for (;;) {
-		ESP_ERROR_CHECK(
-			rmt_receive(rx_chan, rx_data, sizeof(rx_data) / sizeof(rx_data[0]), &rx_config));
+		uint32_t pad_us = 0;
+		button_pending |= lego_mailbox_take(&lego_state.buttons, &button_keys, &button_us);
+		const bool pad_changed = lego_mailbox_take(&lego_state.pad, &pad_keys, &pad_us);
+		// Bursts are acted on at most once per window, with their newest
+		// state. Until the window is over the loop goes on with the pipeline
+		// and wakes up for its end. The pad is already limited to NES_POLL_HZ
+		// and has to reach the LED within a frame, so it skips the window.
+		const int64_t coalesce_until_us = buttons_changed_us + IR_BUTTON_COALESCE_MS * 1000;
+		if (pad_changed || (button_pending && esp_timer_get_time() >= coalesce_until_us)) {
+			const bool button_changed = button_pending;
+			button_pending = false;
+			const uint16_t keys = pad_keys | (button_keys & 0xf) << (4 * lego_state.channel);
+			if (keys != held) {
+				lego_tx_release(looping, keys);
+				looping = 0;
+				// Released keys stopped the motors
+				drive_pending |= keys == 0 && (int8_t)drive != 0;
+				held = keys;
+				buttons_changed_us = esp_timer_get_time();
+				LEGO_TRACE(BUTTONS, held);
+				if (pad_changed) {
+					lego_metrics_record(
+						&lego_metrics, LEGO_STAGE_PAD, (uint32_t)buttons_changed_us - pad_us);
+				}
+				if (button_changed) {
+					const uint32_t latency_us = (uint32_t)buttons_changed_us - button_us;
+					latency_max_us = latency_us > latency_max_us ? latency_us : latency_max_us;
+					latency_sum_us += latency_us;
+					latency_count++;
+					lego_report_post(&(lego_report_t){
+						.kind = LEGO_REPORT_BUTTON_STATS,
+						.button_stats =
+							{
+								.last_us = latency_us,
+								.max_us = latency_max_us,
+								.avg_us = latency_sum_us / latency_count,
+								.coalesced = lego_state.buttons.coalesced,
+								.dropped = lego_mailbox_dropped(&lego_state.buttons),
+							},
+					});
+				}
+			}
+		}
+		uint32_t drive_us = 0;
+		drive_pending |= lego_mailbox_take(&lego_state.drive, &drive, &drive_us);
+		if (drive_pending && held == 0) {
+			lego_tx_drive((int8_t)drive);
+			drive_pending = false;
+		}
+		if (held != looping && lego_tx_hold(held)) {
+			looping = held;
+		}
 
-		if (xEventGroupWaitBits(egroup, RX_DONE_BIT, true, true, portMAX_DELAY) != RX_DONE_BIT) {
-			// ESP_LOGI(TAG, "Timed out while receiving IR data");
-			continue;
+		// Keep the driver queue topped up with the channel queues
+		// interleaved by the scheduler, while the MQTT task keeps appending.
+		// Held keys get the LED to themselves: the pipeline drains for their
+		// loop and stays empty while it runs, the rest below goes on.
+		lego_tx_resync();
+		while (held == 0 && lego_tx_inflight() < IR_TX_PIPELINE_DEPTH) {
+			lego_packet_t *staged = lego_tx_next_slot();
+			uint32_t ingest_us = 0;
+			const uint32_t npackets =
+				lego_sched_fill(&lego_state.sched, staged, IR_TX_BATCH_PACKETS, &ingest_us);
+			if (npackets == 0)
+				break;
+			if (!batch_active) {
+				batch_start_us = esp_timer_get_time();
+				stats_start_us = batch_start_us;
+				memcpy(stats_sent, lego_state.sched.sent, sizeof(stats_sent));
+			}
+			lego_tx_submit(staged, npackets, ingest_us);
+			batch_sent += npackets;
+			batch_active = true;
 		}
 
-		// Channel 1, snapshot 1:
-		// LF:		0x8124
-		// LB:		0x8117
-		// RF:		0x8142
-		// RB:		0x818e
-		// FF:		0x0168
-		// BB:		0x0197
-		// LFRB:	0x01a4
-		// LBRF:	0x015b
-		// STOP:	0x010e
-		//
-		// Channel 2, snapshot 1:
-		// LF:		0x9125
-		// LB:		0x9116
-		// RF:		0x9143
-		// RB:		0x918f
-		// FF:		0x1169
-		// BB:		0x1196
-		// LFRB:	0x11a5
-		// LBRF:	0x115a
-		// STOP:	0x110f
-		//
-		// Channel 3, snapshot 1
-		// LF:		0xa126
-		// LB:		0xa115
-		// RF:		0xa140
-		// RB:		0xa18c
-		// FF:		0x216a
-		// BB:		0x2195
-		// LFRB:	0x21a6
-		// LBRF:	0x2159
-		// STOP:	0x210c
-		//
-		// Channel 4, snapshot 1
-		// LF:		0xb127
-		// LB:		0xb114
-		// RF:		0xb141
-		// RB:		0xb18d
-		// FF:		0x316b
-		// BB:		0x3194
-		// LFRB:	0x31a7
-		// LBRF:	0x3158
-		// STOP:	0x310d
-		//
-		//
-		// Packet pseudocode:
-		//		command = 0;
-		//		if (two_buttons || stop_command) {
-		//			command |= 1 << 15;
-		//		}
-		//		command |= channel << 12; // channel=0..3
-		//		command |= 1 << 8;
-		//		if (left_backward) command |= 1 << 4;
-		//		if (left_forward) command |= 2 << 4;
-		//		if (right_forward) command |= 4 << 4;
-		//		if (right_backward) command |= 8 << 4;
-		//		uint8_t checksum = 0xf;
-		//		checksum ^= (command >> 12) & 0xf;
-		//		checksum ^= (command >> 8) & 0xf;
-		//		checksum ^= (command >> 4) & 0xf;
-		//		command |= checksum;
-		//
-
-		// ESP_LOGI("lego:rx:tim", "Raw timings:");
-		// for (uint32_t i = 0; i < rx_data_len; i++) {
-		// 	rmt_symbol_word_t w = rx_data[i];
-		// 	ESP_LOGI(
-		// 		"lego:rx:tim", "%3lu. duration0=%u level0=%u duration1=%u level1=%u
-		// val=%u", i + 1, w.duration0, 		w.level0, w.duration1, w.level1, w.val);
-		// }
-
-		uint32_t i = 0;
-		for (; i < rx_data_len;) {
-			if (rx_data[i].duration1 >= 800 && rx_data[i].duration1 < 1100) {
-				i++;
-				uint16_t value = 0;
-				for (uint8_t j = 0; j < 16; j++) {
-					if (rx_data[i + j].duration1 >= 320) {
-						value |= 1 << (15 - j);
-					}
-					// const uint8_t bit = rx_data[i + j].duration1 < 320 ? 0 :
-					// 1; value |= bit << (15 - j);
-				}
-				lego_packet_t pkt = *(lego_packet_t *)&value;
-				LEGO_PACKET_DUMP("lego:rx", pkt);
-				if (get_packet_checksum(&pkt) != pkt.checksum) {
-					ESP_LOGE(
-						"lego:rx", "Checksum: INVALID (exp=0x%x real=0x%x)",
-						get_packet_checksum(&pkt), pkt.checksum);
-				} else {
-					ESP_LOGI("lego:rx", "Checksum: OK (0x%x)", pkt.checksum);
-				}
-			} else {
-				i++;
+		lego_window_done_t acked[LEGO_WINDOW_SIZE];
+		const uint32_t nacked = lego_window_poll(
+			&lego_state.window, &lego_state.sched,
+			atomic_load_explicit(&lego_tx.submitted, memory_order_relaxed),
+			atomic_load_explicit(&lego_tx.completed, memory_order_acquire), acked,
+			LEGO_WINDOW_SIZE);
+		for (uint32_t i = 0; i < nacked; i++) {
+			const uint32_t done_us = lego_metrics_now(&lego_metrics);
+			lego_report_post(&(lego_report_t){
+				.kind = LEGO_REPORT_ACK_DONE,
+				.ack_done = {acked[i].seq, done_us, done_us - acked[i].ingest_us},
+			});
+		}
+
+		const int64_t now_us = esp_timer_get_time();
+		const bool batch_done = batch_active && lego_tx_inflight() == 0 &&
+								lego_sched_pending(&lego_state.sched) == 0;
+		if (batch_active && (batch_done || now_us - stats_start_us >= 1000000)) {
+			const int64_t elapsed_us = now_us - stats_start_us;
+			lego_report_t report = {.kind = LEGO_REPORT_CHANNEL_STATS};
+			for (uint8_t ch = 0; ch < 4; ch++) {
+				report.channel_stats.depth[ch] = lego_ring_count(&lego_state.sched.queues[ch]);
+				report.channel_stats.rate[ch] =
+					elapsed_us > 0 ? (uint64_t)(lego_state.sched.sent[ch] - stats_sent[ch]) *
+										 1000000 / elapsed_us
+								   : 0;
 			}
+			lego_report_post(&report);
+			stats_start_us = now_us;
+			memcpy(stats_sent, lego_state.sched.sent, sizeof(stats_sent));
 		}
-		ESP_LOGI("lego:rx", "");
-		ESP_LOGI("lego:rx", "");
+		if (batch_done) {
+			batch_active = false;
+			const int64_t batch_us = now_us - batch_start_us;
+			lego_report_post(&(lego_report_t){
+				.kind = LEGO_REPORT_BATCH_DONE,
+				.batch_done =
+					{
+						.packets = batch_sent,
+						.packets_per_s = batch_us > 0 ? batch_sent * 1000000LL / batch_us : 0,
+						.cycles_per_packet =
+							lego_encoder.encoded_packets > 0
+								? lego_encoder.encode_cycles / lego_encoder.encoded_packets
+								: 0,
+					},
+			});
+			batch_sent = 0;
+		}
+
+		const lego_hist_t *hist = lego_metrics_rotate(&lego_metrics, LEGO_METRICS_PERIOD_MS * 1000);
+		if (hist != NULL && (hist[LEGO_STAGE_AIR].total > 0 || hist[LEGO_STAGE_PAD].total > 0)) {
+			lego_report_t report = {.kind = LEGO_REPORT_METRICS};
+			for (uint8_t i = 0; i < LEGO_STAGE_COUNT; i++) {
+				lego_hist_summarize(&hist[i], &report.metrics[i]);
+			}
+			lego_report_post(&report);
+		}
+
+		xEventGroupWaitBits(
+			egroup, LEGO_PKT_FLUSH_BIT | LEGO_PKT_CONT_BIT | LEGO_TX_DONE_BIT, true, false,
+			lego_wait_until(
+				button_pending, coalesce_until_us,
+				pdMS_TO_TICKS(batch_active ? 1000 : LEGO_METRICS_PERIOD_MS)));
+	}
+}
+
+// Captured from the original remote, checked by tools/ir_replay.c:
+// Channel 1, snapshot 1:
+// LF:		0x8124
+// LB:		0x8117
+// RF:		0x8142
+// RB:		0x818e
+// FF:		0x0168
+// BB:		0x0197
+// LFRB:	0x01a4
+// LBRF:	0x015b
+// STOP:	0x010e
+//
+// Channel 2, snapshot 1:
+// LF:		0x9125
+// LB:		0x9116
+// RF:		0x9143
+// RB:		0x918f
+// FF:		0x1169
+// BB:		0x1196
+// LFRB:	0x11a5
+// LBRF:	0x115a
+// STOP:	0x110f
+//
+// Channel 3, snapshot 1
+// LF:		0xa126
+// LB:		0xa115
+// RF:		0xa140
+// RB:		0xa18c
+// FF:		0x216a
+// BB:		0x2195
+// LFRB:	0x21a6
+// LBRF:	0x2159
+// STOP:	0x210c
+//
+// Channel 4, snapshot 1
+// LF:		0xb127
+// LB:		0xb114
+// RF:		0xb141
+// RB:		0xb18d
+// FF:		0x316b
+// BB:		0x3194
+// LFRB:	0x31a7
+// LBRF:	0x3158
+// STOP:	0x310d
+
+static void ir_rx_task_fn(void *data) {
+	static lego_rx_packet_t decoded[IR_RX_BUFFER_SYMBOLS / LEGO_FRAME_SYMBOLS + 1];
+	uint32_t dropped = 0;
+	uint32_t stopped = 0;
+
+	// The first receive, rmt_rx_done_callback() starts all the others
+	ESP_ERROR_CHECK(rmt_receive(rx_chan, rx_buffers[rx_next], IR_RX_BUFFER_SYMBOLS, &rx_config));
+	for (;;) {
+		ir_rx_chunk_t chunk;
+		if (xQueueReceive(rx_chunk_queue, &chunk, pdMS_TO_TICKS(IR_RX_CHECK_MS)) != pdTRUE) {
+			// Nothing comes in while the receiver is disarmed
+			if (atomic_load(&ir_rx_stopped) != stopped) {
+				stopped = atomic_load(&ir_rx_stopped);
+				const esp_err_t err =
+					rmt_receive(rx_chan, rx_buffers[rx_next], IR_RX_BUFFER_SYMBOLS, &rx_config);
+				ESP_LOGW(
+					"lego:rx", "Receiver stopped %lu times, re-armed: %s", stopped,
+					esp_err_to_name(err));
+			}
+			continue;
+		}
+		const uint32_t n = lego_decoder_feed(
+			&lego_decoder, chunk.symbols, chunk.num_symbols, chunk.end_us, decoded,
+			sizeof(decoded) / sizeof(decoded[0]));
+		for (uint32_t i = 0; i < n; i++) {
+			LEGO_TRACE(RX_PACKET, lego_packet_raw(&decoded[i].packet));
+			if (xQueueSend(lego_rx_queue, &decoded[i], 0) != pdTRUE) {
+				LEGO_TRACE(RX_DROPPED, ++dropped);
+			}
+		}
+	}
+}
+
+static void ir_rx_dump_task_fn(void *data) {
+	for (;;) {
+		lego_rx_packet_t rx;
+		xQueueReceive(lego_rx_queue, &rx, portMAX_DELAY);
+		// Every packet is traced as RX_PACKET already, this is for debug builds
+		ESP_LOGD(
+			"lego:rx", "%04x at %lld us, frames=%lu bad_checksum=%lu bad_symbols=%lu",
+			lego_packet_raw(&rx.packet), rx.timestamp_us, lego_decoder.frames,
+			lego_decoder.bad_checksum, lego_decoder.bad_symbols);
 	}
 }
 
@@ -0,0 +1,103 @@
+#ifndef JITTER_BENCH_H_INCLUDED
+#define JITTER_BENCH_H_INCLUDED
+
+// Inter-frame gap jitter under MQTT load, to compare task layouts. Start
+// both tasks in app_main, once with IR_TASK_PINNING and once without, and
+// keep the LED otherwise idle. jitter_flood_task_fn() loops messages through
+// the broker, jitter_bench_task_fn() sends single-frame transactions back to
+// back and publishes the spread of their completion intervals on
+// esp/1/bench/jitter.
+
+#include <math.h>
+#include <stdlib.h>
+
+#include "esp_log.h"
+#include "esp_timer.h"
+#include "mqtt_client.h"
+
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+
+#include "defs.h"
+#include "ir.h"
+#include "networking.h"
+
+#define JITTER_BENCH_FRAMES 1000
+#define JITTER_BENCH_SETTLE_MS 5000
+// Messages per tick, each one is received back by the MQTT task
+#define JITTER_FLOOD_BURST 8
+#define JITTER_FLOOD_PAYLOAD 256
+
+#define JITTER_BENCH_FMT                                                                           \
+	"{\"pinned\":%d,\"frames\":%lu,\"mean_us\":%lu,\"stddev_us\":%.1f,\"min_us\":%lu,"             \
+	"\"p50_us\":%lu,\"p99_us\":%lu,\"max_us\":%lu}"
+
+static uint32_t jitter_done_us[JITTER_BENCH_FRAMES];
+
+static int jitter_compare(const void *a, const void *b) {
+	const uint32_t x = *(const uint32_t *)a, y = *(const uint32_t *)b;
+	return (x > y) - (x < y);
+}
+
+static void jitter_flood_task_fn(void *arg) {
+	static char payload[JITTER_FLOOD_PAYLOAD];
+	memset(payload, 'x', sizeof(payload));
+	esp_mqtt_client_subscribe(mqtt_handle, MKTOPIC("bench/flood"), 0);
+	for (;;) {
+		for (uint32_t i = 0; i < JITTER_FLOOD_BURST; i++) {
+			esp_mqtt_client_publish(
+				mqtt_handle, MKTOPIC("bench/flood"), payload, sizeof(payload), 0, false);
+		}
+		vTaskDelay(1);
+	}
+}
+
+static void jitter_bench_task_fn(void *arg) {
+	vTaskDelay(pdMS_TO_TICKS(JITTER_BENCH_SETTLE_MS));
+	atomic_store_explicit(&ir_tx_done_log.count, 0, memory_order_relaxed);
+	ir_tx_done_log.max = JITTER_BENCH_FRAMES;
+	atomic_thread_fence(memory_order_release);
+	ir_tx_done_log.done_us = jitter_done_us;
+
+	// One frame per transaction, so every interval includes a handoff from
+	// the driver's interrupt to the next transaction
+	for (uint32_t i = 0; i < JITTER_BENCH_FRAMES; i++) {
+		while (lego_tx_inflight() >= IR_TX_PIPELINE_DEPTH) {
+			xEventGroupWaitBits(egroup, LEGO_TX_DONE_BIT, true, false, pdMS_TO_TICKS(100));
+		}
+		lego_packet_t *staged = lego_tx_next_slot();
+		staged[0] = LEGO_STOP_PACKET(lego_state.channel);
+		lego_tx_submit(staged, 1, 0);
+	}
+	ESP_ERROR_CHECK(rmt_tx_wait_all_done(tx_chan, IR_TX_DRAIN_TIMEOUT_MS));
+	ir_tx_done_log.done_us = NULL;
+
+	const uint32_t count = atomic_load_explicit(&ir_tx_done_log.count, memory_order_acquire);
+	if (count < 2) {
+		ESP_LOGE("lego:bench", "Only %lu transactions completed", count);
+		vTaskDelete(NULL);
+	}
+	const uint32_t n = count - 1;
+	uint64_t sum = 0;
+	for (uint32_t i = 0; i < n; i++) {
+		jitter_done_us[i] = jitter_done_us[i + 1] - jitter_done_us[i];
+		sum += jitter_done_us[i];
+	}
+	const double mean = (double)sum / n;
+	double var = 0;
+	for (uint32_t i = 0; i < n; i++) {
+		var += (jitter_done_us[i] - mean) * (jitter_done_us[i] - mean);
+	}
+	qsort(jitter_done_us, n, sizeof(jitter_done_us[0]), jitter_compare);
+
+	char payload[192];
+	const int payload_len = snprintf(
+		payload, sizeof(payload), JITTER_BENCH_FMT, IR_TASK_PINNING, n, (uint32_t)mean,
+		sqrt(var / n), jitter_done_us[0], jitter_done_us[n / 2], jitter_done_us[n * 99 / 100],
+		jitter_done_us[n - 1]);
+	ESP_LOGI("lego:bench", "%s", payload);
+	mqtt_publish(MKTOPIC("bench/jitter"), payload, payload_len, false);
+	vTaskDelete(NULL);
+}
+
+#endif
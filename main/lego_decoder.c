@@ -0,0 +1,86 @@
+#include "lego_decoder.h"
+
+#include <string.h>
+
+void lego_decoder_init(lego_decoder_t *dec) {
+	memset(dec, 0, sizeof(*dec));
+}
+
+static inline bool lego_decoder_is_start(uint32_t space) {
+	return space >= LEGO_DECODER_START_MIN_US && space < LEGO_DECODER_START_MAX_US;
+}
+
+uint32_t lego_decoder_feed(
+	lego_decoder_t *dec, const rmt_symbol_word_t *symbols, size_t n, int64_t end_us,
+	lego_rx_packet_t *out, uint32_t max) {
+	int64_t now_us = end_us;
+	for (size_t i = 0; i < n; i++) {
+		now_us -= symbols[i].duration0 + symbols[i].duration1;
+	}
+
+	uint32_t count = 0;
+	for (size_t i = 0; i < n; i++) {
+		const uint32_t mark = symbols[i].duration0;
+		const uint32_t space = symbols[i].duration1;
+		const int64_t symbol_start_us = now_us;
+		now_us += mark + space;
+
+		if (mark < LEGO_DECODER_MARK_MIN_US || mark >= LEGO_DECODER_MARK_MAX_US) {
+			if (dec->state != LEGO_DECODER_IDLE) {
+				dec->bad_symbols++;
+			}
+			dec->state = LEGO_DECODER_IDLE;
+			continue;
+		}
+
+		switch (dec->state) {
+		case LEGO_DECODER_IDLE:
+			break;
+		case LEGO_DECODER_BITS:
+			dec->word <<= 1;
+			if (space >= LEGO_DECODER_BIT0_MIN_US && space < LEGO_DECODER_BIT1_MIN_US) {
+				// 0
+			} else if (space >= LEGO_DECODER_BIT1_MIN_US && space < LEGO_DECODER_START_MIN_US) {
+				dec->word |= 1;
+			} else {
+				// Broken frame, this may be the start of the next one
+				dec->bad_symbols++;
+				dec->state = LEGO_DECODER_IDLE;
+				break;
+			}
+			if (++dec->bits == 16) {
+				dec->state = LEGO_DECODER_STOP;
+			}
+			continue;
+		case LEGO_DECODER_STOP: {
+			dec->state = LEGO_DECODER_IDLE;
+			// The stop bit space runs into the idle time after the frame
+			if (space != 0 && space < LEGO_DECODER_START_MIN_US) {
+				dec->bad_symbols++;
+				break;
+			}
+			lego_packet_t pkt = lego_packet_from_raw(dec->word);
+			if (get_packet_checksum(&pkt) != pkt.checksum) {
+				dec->bad_checksum++;
+				continue;
+			}
+			dec->frames++;
+			if (count < max) {
+				out[count++] = (lego_rx_packet_t){
+					.timestamp_us = dec->frame_start_us,
+					.packet = pkt,
+				};
+			}
+			continue;
+		}
+		}
+
+		if (lego_decoder_is_start(space)) {
+			dec->state = LEGO_DECODER_BITS;
+			dec->word = 0;
+			dec->bits = 0;
+			dec->frame_start_us = symbol_start_us;
+		}
+	}
+	return count;
+}
@@ -0,0 +1,57 @@
+#ifndef LEGO_DECODER_INCLUDED
+#define LEGO_DECODER_INCLUDED
+
+// Incremental RMT symbol to packet decoder. Symbols can be fed in chunks of
+// any size, a frame split across two receive buffers is still decoded. Plain
+// C, buildable on the host.
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "lego_frame.h"
+#include "lego_packet.h"
+
+// Accepted durations in us, for the output of a demodulating IR receiver.
+// Marks come out stretched or shortened depending on the signal strength, the
+// spaces change by the same amount in the other direction. The space
+// boundaries are the ones that worked with the captures in ir.h.
+#define LEGO_DECODER_MARK_MIN_US 60
+#define LEGO_DECODER_MARK_MAX_US 450
+#define LEGO_DECODER_BIT0_MIN_US 100
+#define LEGO_DECODER_BIT1_MIN_US 320
+#define LEGO_DECODER_START_MIN_US 800
+#define LEGO_DECODER_START_MAX_US 1100
+
+enum lego_decoder_state {
+	LEGO_DECODER_IDLE,
+	LEGO_DECODER_BITS,
+	LEGO_DECODER_STOP,
+};
+
+typedef struct {
+	int64_t timestamp_us;
+	lego_packet_t packet;
+} lego_rx_packet_t;
+
+typedef struct {
+	enum lego_decoder_state state;
+	uint16_t word;
+	uint8_t bits;
+	int64_t frame_start_us;
+	// Frames that passed the checksum, failed it, or broke off midway
+	uint32_t frames;
+	uint32_t bad_checksum;
+	uint32_t bad_symbols;
+} lego_decoder_t;
+
+void lego_decoder_init(lego_decoder_t *dec);
+
+// Decodes `n` symbols whose last edge was at `end_us` and stores up to `max`
+// packets in `out`, timestamped with the start of their frame. Returns how
+// many were stored, further packets are dropped. A symbol with a zero space
+// is the end of a receive transaction and may terminate a frame.
+uint32_t lego_decoder_feed(
+	lego_decoder_t *dec, const rmt_symbol_word_t *symbols, size_t n, int64_t end_us,
+	lego_rx_packet_t *out, uint32_t max);
+
+#endif
@@ -1,41 +1,93 @@
+#include "lego_encoder.h"
+
+#include <string.h>
+
+#ifdef ESP_PLATFORM
 #include "esp_attr.h"
 #include "esp_check.h"
+#include "esp_cpu.h"
+#include "esp_timer.h"
 
-#include "lego_encoder.h"
+#define LEGO_ENCODER_CYCLES() esp_cpu_get_cycle_count()
+#define LEGO_ENCODER_NOW_US() esp_timer_get_time()
+#else
+#include <time.h>
 
-#include <string.h>
+// Nanoseconds stand in for CPU cycles
+static inline uint64_t lego_encoder_host_ns(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+#define LEGO_ENCODER_CYCLES() ((uint32_t)lego_encoder_host_ns())
+#define LEGO_ENCODER_NOW_US() ((int64_t)(lego_encoder_host_ns() / 1000))
+#define ESP_RETURN_ON_ERROR(x, tag, msg)                                                           \
+	do {                                                                                           \
+		const esp_err_t err_ = (x);                                                                \
+		(void)(tag);                                                                               \
+		if (err_ != ESP_OK) {                                                                      \
+			return err_;                                                                           \
+		}                                                                                          \
+	} while (0)
+#endif
 
 static const char *TAG = "lego encoder";
 
-static rmt_symbol_word_t start_bit = {
-	.level0 = 1,
-	.duration0 = 158,
-	.level1 = 0,
-	.duration1 = 950,
-};
-
-static rmt_symbol_word_t end_bit = {
-	.level0 = 1,
-	.duration0 = 158,
-	.level1 = 0,
-	.duration1 = 30000,
-};
-
-static rmt_symbol_word_t bit_0 = {
-	.level0 = 1,
-	.duration0 = 158,
-	.level1 = 0,
-	.duration1 = 263,
-};
-
-static rmt_symbol_word_t bit_1 = {
-	.level0 = 1,
-	.duration0 = 158,
-	.level1 = 0,
-	.duration1 = 553,
-};
+static const rmt_symbol_word_t start_bit = LEGO_START_SYMBOL;
+static const rmt_symbol_word_t end_bit = LEGO_END_SYMBOL;
 
-static size_t lego_encoder_encode(
+// Emits the idle time the scheduler asks for before the current packet.
+// Returns true when the encode callback has to return on mem-full.
+//
+// Like everywhere below, a sub-encoder that fills the memory exactly reports
+// complete and mem-full together, so the state moves on before returning or
+// the part would go out twice.
+static bool lego_encoder_encode_gap(
+	lego_encoder_t *enc, rmt_channel_handle_t tx_channel, const lego_packet_t *packets,
+	size_t *ret, rmt_encode_state_t *ret_state) {
+	rmt_encode_state_t state = RMT_ENCODING_COMPLETE;
+	if (!enc->gap_scheduled) {
+		const uint32_t gap_us = lego_timing_schedule(&enc->timing, &packets[enc->packet_index]);
+		enc->gap_symbols = lego_frame_gap(gap_us, enc->gap);
+		enc->gap_scheduled = true;
+		if (enc->packet_index == 0) {
+			enc->tx_first_gap_us = gap_us;
+		}
+	}
+	if (enc->gap_symbols > 0) {
+		*ret += enc->copy_encoder->encode(
+			enc->copy_encoder, tx_channel, enc->gap, sizeof(rmt_symbol_word_t) * enc->gap_symbols,
+			&state);
+	}
+	if (state & RMT_ENCODING_COMPLETE) {
+		enc->gap_scheduled = false;
+		enc->state = enc->mode == LEGO_ENCODER_MODE_TABLE ? LEGO_FRAME : LEGO_START_BIT;
+	}
+	if (state & RMT_ENCODING_MEM_FULL) {
+		*ret_state |= RMT_ENCODING_MEM_FULL;
+		return true;
+	}
+	return false;
+}
+
+// Moves on to the next packet once a frame is out. Returns true when the
+// transaction is complete.
+static bool lego_encoder_next_packet(
+	lego_encoder_t *enc, size_t packet_count, rmt_encode_state_t *ret_state) {
+	enc->state = LEGO_GAP;
+	enc->packet_index++;
+	enc->encoded_packets++;
+	if (enc->packet_index == packet_count) {
+		enc->done_packets += enc->packet_index;
+		enc->packet_index = 0;
+		*ret_state = RMT_ENCODING_COMPLETE;
+		return true;
+	}
+	return false;
+}
+
+static size_t lego_encoder_encode_bytes(
 	rmt_encoder_t *encoder, rmt_channel_handle_t tx_channel, const void *primary_data,
 	size_t data_size, rmt_encode_state_t *ret_state) {
 	size_t ret = 0;
@@ -49,66 +101,129 @@ static size_t lego_encoder_encode(
 		case LEGO_START_BIT: {
 			ret += enc->copy_encoder->encode(
 				enc->copy_encoder, tx_channel, &start_bit, sizeof(start_bit), &state);
+			if (state & RMT_ENCODING_COMPLETE) {
+				enc->state = LEGO_WORD;
+			}
 			if (state & RMT_ENCODING_MEM_FULL) {
 				*ret_state |= RMT_ENCODING_MEM_FULL;
 				return ret;
 			}
-			enc->state = LEGO_WORD;
 			break;
 		}
 		case LEGO_WORD: {
-			lego_packet_t p = packets[enc->packet_index];
-			enc->packet_index++;
-
-			p.reserved_1 = 0x1;
-			switch (p.key) {
-			case LEGO_LF:
-			case LEGO_LB:
-			case LEGO_RF:
-			case LEGO_RB:
-				p.single_key = true;
-				break;
-			default:
-				p.single_key = false;
-				break;
-			}
-			p.checksum = get_packet_checksum(&p);
+			const lego_packet_t p = lego_packet_prepare(packets[enc->packet_index]);
 			enc->last_packet = p;
-
-			// Big-Endian Byte Order
-			// MSB First
-			const uint16_t pkt_raw = *(uint16_t *)&p;
-			const uint16_t pkt_reversed = (pkt_raw >> 8) | (pkt_raw << 8);
+			const uint16_t pkt_wire = lego_packet_wire(&p);
 
 			ret += enc->bytes_encoder->encode(
-				enc->bytes_encoder, tx_channel, &pkt_reversed, sizeof(lego_packet_t), &state);
+				enc->bytes_encoder, tx_channel, &pkt_wire, sizeof(lego_packet_t), &state);
+			if (state & RMT_ENCODING_COMPLETE) {
+				enc->state = LEGO_END_BIT;
+			}
 			if (state & RMT_ENCODING_MEM_FULL) {
 				*ret_state |= RMT_ENCODING_MEM_FULL;
 				return ret;
 			}
-			enc->state = LEGO_END_BIT;
 			break;
 		}
 		case LEGO_END_BIT: {
 			ret += enc->copy_encoder->encode(
 				enc->copy_encoder, tx_channel, &end_bit, sizeof(end_bit), &state);
+			const bool done = (state & RMT_ENCODING_COMPLETE) &&
+							  lego_encoder_next_packet(enc, packet_count, ret_state);
 			if (state & RMT_ENCODING_MEM_FULL) {
 				*ret_state |= RMT_ENCODING_MEM_FULL;
 				return ret;
 			}
-			enc->state = LEGO_START_BIT;
-			if (enc->packet_index == packet_count) {
-				enc->packet_index = 0;
-				enc->done_packets += enc->packet_index;
-				*ret_state = RMT_ENCODING_COMPLETE;
+			if (done) {
 				return ret;
 			}
 			break;
 		}
+		case LEGO_GAP: {
+			if (lego_encoder_encode_gap(enc, tx_channel, packets, &ret, ret_state)) {
+				return ret;
+			}
+			break;
+		}
+		default:
+			break;
 		}
 	}
 }
 
+static size_t lego_encoder_encode_table(
+	rmt_encoder_t *encoder, rmt_channel_handle_t tx_channel, const void *primary_data,
+	size_t data_size, rmt_encode_state_t *ret_state) {
+	size_t ret = 0;
+	lego_encoder_t *enc = (lego_encoder_t *)encoder;
+	const lego_packet_t *packets = (const lego_packet_t *)primary_data;
+	rmt_encode_state_t state = RMT_ENCODING_COMPLETE;
+	size_t packet_count = data_size / sizeof(lego_packet_t);
+
+	for (;;) {
+		if (enc->state == LEGO_GAP) {
+			if (lego_encoder_encode_gap(enc, tx_channel, packets, &ret, ret_state)) {
+				return ret;
+			}
+		}
+
+		const lego_packet_t *p = &packets[enc->packet_index];
+		const rmt_symbol_word_t *frame = NULL;
+		if (lego_frame_in_table(p)) {
+			frame = lego_frame_table[p->channel][p->key];
+		} else {
+			// Rebuilding on resume yields the same symbols, so the copy
+			// encoder can carry on from where it stopped.
+			const lego_packet_t prepared = lego_packet_prepare(*p);
+			lego_frame_build(&prepared, enc->frame);
+			frame = enc->frame;
+		}
+
+		ret += enc->copy_encoder->encode(
+			enc->copy_encoder, tx_channel, frame, sizeof(rmt_symbol_word_t) * LEGO_FRAME_SYMBOLS,
+			&state);
+		bool done = false;
+		if (state & RMT_ENCODING_COMPLETE) {
+			// Not normalized, lego_packet_prepare() is kept off this path
+			enc->last_packet = *p;
+			done = lego_encoder_next_packet(enc, packet_count, ret_state);
+		}
+		if (state & RMT_ENCODING_MEM_FULL) {
+			*ret_state |= RMT_ENCODING_MEM_FULL;
+			return ret;
+		}
+		if (done) {
+			return ret;
+		}
+	}
+}
+
+static size_t lego_encoder_encode(
+	rmt_encoder_t *encoder, rmt_channel_handle_t tx_channel, const void *primary_data,
+	size_t data_size, rmt_encode_state_t *ret_state) {
+	lego_encoder_t *enc = (lego_encoder_t *)encoder;
+	const bool first_call = enc->state == LEGO_GAP && enc->packet_index == 0 && !enc->gap_scheduled;
+	const int64_t start_us = first_call ? LEGO_ENCODER_NOW_US() : 0;
+	if (first_call) {
+		// Nothing before this transaction is still on the air
+		lego_timing_sync(&enc->timing, start_us);
+	}
+	const uint32_t start = LEGO_ENCODER_CYCLES();
+	size_t ret = 0;
+	if (enc->mode == LEGO_ENCODER_MODE_TABLE) {
+		ret = lego_encoder_encode_table(encoder, tx_channel, primary_data, data_size, ret_state);
+	} else {
+		ret = lego_encoder_encode_bytes(encoder, tx_channel, primary_data, data_size, ret_state);
+	}
+	enc->encode_cycles += LEGO_ENCODER_CYCLES() - start;
+	if (first_call) {
+		enc->tx_encode_start_us = start_us;
+		enc->tx_rmt_start_us = LEGO_ENCODER_NOW_US();
+	}
+	return ret;
+}
+
 static esp_err_t lego_encoder_del(rmt_encoder_t *encoder) {
 	lego_encoder_t *enc = (lego_encoder_t *)encoder;
 	ESP_RETURN_ON_ERROR(rmt_del_encoder(enc->bytes_encoder), TAG, "Failed to delete bytes encoder");
@@ -121,31 +236,45 @@ static esp_err_t lego_encoder_reset(rmt_encoder_t *encoder) {
 	ESP_RETURN_ON_ERROR(
 		rmt_encoder_reset(enc->bytes_encoder), TAG, "Failed to reset bytes encoder");
 	ESP_RETURN_ON_ERROR(rmt_encoder_reset(enc->copy_encoder), TAG, "Failed to reset copy encoder");
-	enc->state = LEGO_START_BIT;
+	enc->state = LEGO_GAP;
+	enc->gap_scheduled = false;
 	enc->done_packets = 0;
 	enc->packet_index = 0;
 	return ESP_OK;
 }
 
-esp_err_t lego_encoder_new(lego_encoder_t *encoder) {
+void lego_encoder_init(
+	lego_encoder_t *encoder, const lego_encoder_config_t *config, rmt_encoder_t *copy_encoder,
+	rmt_encoder_t *bytes_encoder) {
 	encoder->base.encode = lego_encoder_encode;
 	encoder->base.del = lego_encoder_del;
 	encoder->base.reset = lego_encoder_reset;
-	encoder->state = LEGO_START_BIT;
+	encoder->copy_encoder = copy_encoder;
+	encoder->bytes_encoder = bytes_encoder;
+	encoder->mode = config->mode;
+	encoder->state = LEGO_GAP;
+	lego_timing_init(&encoder->timing, &config->timing);
+}
 
-	rmt_bytes_encoder_config_t bytes_encoder_cfg = {
-		.bit0 = bit_0,
-		.bit1 = bit_1,
+#ifdef ESP_PLATFORM
+esp_err_t lego_encoder_new(lego_encoder_t *encoder, const lego_encoder_config_t *config) {
+	const rmt_bytes_encoder_config_t bytes_encoder_cfg = {
+		.bit0 = LEGO_BIT0_SYMBOL,
+		.bit1 = LEGO_BIT1_SYMBOL,
 		.flags.msb_first = true,
 	};
+	rmt_encoder_t *bytes_encoder = NULL;
 	ESP_RETURN_ON_ERROR(
-		rmt_new_bytes_encoder(&bytes_encoder_cfg, &encoder->bytes_encoder), TAG,
+		rmt_new_bytes_encoder(&bytes_encoder_cfg, &bytes_encoder), TAG,
 		"Failed to allocate bytes encoder");
 
-	rmt_copy_encoder_config_t copy_encoder_cfg = {};
+	const rmt_copy_encoder_config_t copy_encoder_cfg = {};
+	rmt_encoder_t *copy_encoder = NULL;
 	ESP_RETURN_ON_ERROR(
-		rmt_new_copy_encoder(&copy_encoder_cfg, &encoder->copy_encoder), TAG,
-		"Failed to allocate bytes encoder");
+		rmt_new_copy_encoder(&copy_encoder_cfg, &copy_encoder), TAG,
+		"Failed to allocate copy encoder");
 
+	lego_encoder_init(encoder, config, copy_encoder, bytes_encoder);
 	return ESP_OK;
 }
+#endif
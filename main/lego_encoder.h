@@ -1,67 +1,106 @@
 #ifndef LEGO_ENCODER_INCLUDED
 #define LEGO_ENCODER_INCLUDED
 
+// RMT encoder for arrays of lego_packet_t, with the idle time of
+// lego_timing.h in front of every frame. The state machine only reaches the
+// hardware through its copy and bytes encoders, so it builds on the host as
+// well, where tools/encoder_bench.c runs it against mocks of both.
+
+#ifdef ESP_PLATFORM
 #include "driver/rmt_encoder.h"
 #include "esp_check.h"
+#else
+#include <stddef.h>
+
+// The part of driver/rmt_encoder.h the encoder uses
+typedef int esp_err_t;
+#define ESP_OK 0
+typedef struct rmt_channel_t *rmt_channel_handle_t;
+typedef enum {
+	RMT_ENCODING_RESET = 0,
+	RMT_ENCODING_COMPLETE = 1 << 0,
+	RMT_ENCODING_MEM_FULL = 1 << 1,
+} rmt_encode_state_t;
+typedef struct rmt_encoder_t rmt_encoder_t;
+struct rmt_encoder_t {
+	size_t (*encode)(
+		rmt_encoder_t *encoder, rmt_channel_handle_t tx_channel, const void *primary_data,
+		size_t data_size, rmt_encode_state_t *ret_state);
+	esp_err_t (*reset)(rmt_encoder_t *encoder);
+	esp_err_t (*del)(rmt_encoder_t *encoder);
+};
+
+static inline esp_err_t rmt_encoder_reset(rmt_encoder_t *encoder) {
+	return encoder->reset(encoder);
+}
+
+static inline esp_err_t rmt_del_encoder(rmt_encoder_t *encoder) {
+	return encoder->del(encoder);
+}
+#endif
 
-// Packet pseudocode:
-//		command = 0;
-//		if (two_buttons || stop_command) {
-//			command |= 1 << 15;
-//		}
-//		command |= channel << 12; // channel=0..3
-//		command |= 1 << 8;
-//		if (left_backward) command |= 1 << 4;
-//		if (left_forward) command |= 2 << 4;
-//		if (right_forward) command |= 4 << 4;
-//		if (right_backward) command |= 8 << 4;
-//		command |= 0xf ^ ((command >> 4) & 0xf) ^ ((command >> 8) & 0xf)
-//^ (command >> 12); // checksum
-//
+#include "lego_frame.h"
+#include "lego_packet.h"
+#include "lego_timing.h"
 
 enum lego_encoder_state {
+	LEGO_GAP,
 	LEGO_START_BIT,
 	LEGO_WORD,
 	LEGO_END_BIT,
+	LEGO_FRAME,
 };
 
-enum lego_key {
-	LEGO_LB = 0x1,
-	LEGO_LF = 0x2,
-	LEGO_RF = 0x4,
-	LEGO_RB = 0x8,
+enum lego_encoder_mode {
+	// Start bit, bytes encoder over the packet word, end bit
+	LEGO_ENCODER_MODE_BYTES,
+	// Copy pre-built frames from lego_frame_table in a single state
+	LEGO_ENCODER_MODE_TABLE,
 };
 
-typedef struct __attribute__((packed)) {
-	uint8_t checksum : 4;
-	enum lego_key key : 4;
-	uint8_t reserved_1 : 4;
-	uint8_t channel : 3;
-	bool single_key : 1;
-} lego_packet_t;
+typedef struct {
+	enum lego_encoder_mode mode;
+	lego_timing_config_t timing;
+} lego_encoder_config_t;
 
 typedef struct {
 	rmt_encoder_t base;
 	rmt_encoder_t *copy_encoder;
 	rmt_encoder_t *bytes_encoder;
+	enum lego_encoder_mode mode;
 	enum lego_encoder_state state;
 	uint32_t packet_index;
 	uint32_t done_packets;
 	lego_packet_t last_packet;
+	// Scratch frame for packets that are not in lego_frame_table
+	rmt_symbol_word_t frame[LEGO_FRAME_SYMBOLS];
+	// Idle time before the current packet, filled in by the timing scheduler
+	lego_timing_t timing;
+	rmt_symbol_word_t gap[LEGO_TIMING_GAP_SYMBOLS];
+	uint32_t gap_symbols;
+	bool gap_scheduled;
+	// CPU cycles (ns on the host) spent in the encode callback and packets it
+	// completed, never reset, so the cost per packet can be compared between
+	// modes. 64 bits, at 240 MHz 32 would wrap within 18 s of encoding.
+	uint64_t encode_cycles;
+	uint32_t encoded_packets;
+	// Current transaction, for the latency metrics: first encode call, its
+	// return, when the RMT starts sending, and the idle time before the first
+	// frame
+	int64_t tx_encode_start_us;
+	int64_t tx_rmt_start_us;
+	uint32_t tx_first_gap_us;
 } lego_encoder_t;
 
-esp_err_t lego_encoder_new(lego_encoder_t *encoder);
+// Takes over `copy_encoder` and `bytes_encoder`, which must be made with the
+// symbols of lego_frame.h, MSB first. Deleting `encoder` deletes them.
+void lego_encoder_init(
+	lego_encoder_t *encoder, const lego_encoder_config_t *config, rmt_encoder_t *copy_encoder,
+	rmt_encoder_t *bytes_encoder);
 
-static inline uint8_t get_packet_checksum(lego_packet_t *pkt) {
-	uint16_t praw = *(uint16_t *)pkt;
-	uint8_t ret = 0xf;
-	ret ^= (praw >> 12) & 0xf;
-	ret ^= (praw >> 8) & 0xf;
-	ret ^= (praw >> 4) & 0xf;
-	return ret;
-}
-
-#define LEGO_STOP_PACKET(ch)                                                                       \
-	(lego_packet_t) { .single_key = false, .channel = ch, .key = 0 }
+#ifdef ESP_PLATFORM
+// Same, with the driver's copy and bytes encoders
+esp_err_t lego_encoder_new(lego_encoder_t *encoder, const lego_encoder_config_t *config);
+#endif
 
 #endif
@@ -0,0 +1,56 @@
+#include "lego_frame.h"
+
+#define LEGO_FRAMES_CHANNEL(ch)                                                                    \
+	{                                                                                              \
+		LEGO_FRAME(LEGO_COMBO_WORD(ch, 0x0)), LEGO_FRAME(LEGO_COMBO_WORD(ch, 0x1)),                \
+			LEGO_FRAME(LEGO_COMBO_WORD(ch, 0x2)), LEGO_FRAME(LEGO_COMBO_WORD(ch, 0x3)),            \
+			LEGO_FRAME(LEGO_COMBO_WORD(ch, 0x4)), LEGO_FRAME(LEGO_COMBO_WORD(ch, 0x5)),            \
+			LEGO_FRAME(LEGO_COMBO_WORD(ch, 0x6)), LEGO_FRAME(LEGO_COMBO_WORD(ch, 0x7)),            \
+			LEGO_FRAME(LEGO_COMBO_WORD(ch, 0x8)), LEGO_FRAME(LEGO_COMBO_WORD(ch, 0x9)),            \
+			LEGO_FRAME(LEGO_COMBO_WORD(ch, 0xa)), LEGO_FRAME(LEGO_COMBO_WORD(ch, 0xb)),            \
+			LEGO_FRAME(LEGO_COMBO_WORD(ch, 0xc)), LEGO_FRAME(LEGO_COMBO_WORD(ch, 0xd)),            \
+			LEGO_FRAME(LEGO_COMBO_WORD(ch, 0xe)), LEGO_FRAME(LEGO_COMBO_WORD(ch, 0xf)),            \
+	}
+
+// 4 * 16 * 18 symbols, 4.5 KiB of rodata
+const rmt_symbol_word_t lego_frame_table[4][16][LEGO_FRAME_SYMBOLS] = {
+	LEGO_FRAMES_CHANNEL(0),
+	LEGO_FRAMES_CHANNEL(1),
+	LEGO_FRAMES_CHANNEL(2),
+	LEGO_FRAMES_CHANNEL(3),
+};
+
+void lego_frame_build(const lego_packet_t *pkt, rmt_symbol_word_t frame[LEGO_FRAME_SYMBOLS]) {
+	static const rmt_symbol_word_t start = LEGO_START_SYMBOL, end = LEGO_END_SYMBOL,
+								   bit0 = LEGO_BIT0_SYMBOL, bit1 = LEGO_BIT1_SYMBOL;
+	const uint16_t raw = lego_packet_raw(pkt);
+	frame[0] = start;
+	for (uint8_t i = 0; i < 16; i++) {
+		frame[1 + i] = (raw & (1 << (15 - i))) ? bit1 : bit0;
+	}
+	frame[LEGO_FRAME_SYMBOLS - 1] = end;
+}
+
+uint32_t lego_frame_gap(uint32_t gap_us, rmt_symbol_word_t gap[LEGO_TIMING_GAP_SYMBOLS]) {
+	if (gap_us == 0) {
+		return 0;
+	}
+	if (gap_us == 1) {
+		gap_us = 2;
+	}
+	uint32_t n = 0;
+	while (gap_us > 0 && n < LEGO_TIMING_GAP_SYMBOLS) {
+		uint32_t chunk = gap_us > 2 * 32767 ? 2 * 32767 : gap_us;
+		if (gap_us - chunk == 1) {
+			chunk--;
+		}
+		gap[n++] = (rmt_symbol_word_t){
+			.level0 = 0,
+			.duration0 = chunk - chunk / 2,
+			.level1 = 0,
+			.duration1 = chunk / 2,
+		};
+		gap_us -= chunk;
+	}
+	return n;
+}
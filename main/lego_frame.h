@@ -0,0 +1,84 @@
+#ifndef LEGO_FRAME_INCLUDED
+#define LEGO_FRAME_INCLUDED
+
+// Packet to RMT symbol conversion. Like lego_packet.h this builds on the host,
+// where rmt_symbol_word_t is replaced by a layout-compatible union.
+
+#include <stdint.h>
+
+#ifdef ESP_PLATFORM
+#include "driver/rmt_types.h"
+#else
+typedef union {
+	struct {
+		uint16_t duration0 : 15;
+		uint16_t level0 : 1;
+		uint16_t duration1 : 15;
+		uint16_t level1 : 1;
+	};
+	uint32_t val;
+} rmt_symbol_word_t;
+#endif
+
+#include "lego_packet.h"
+#include "lego_timing.h"
+
+// Durations are in RMT ticks, the channels run at 1 MHz so 1 tick = 1 us.
+#define LEGO_MARK_TICKS 158
+#define LEGO_START_SPACE_TICKS 950
+// Stop bit only, the idle time between frames comes from lego_timing.h
+#define LEGO_END_SPACE_TICKS 1026
+#define LEGO_BIT0_SPACE_TICKS 263
+#define LEGO_BIT1_SPACE_TICKS 553
+
+#define LEGO_SYMBOL(space)                                                                         \
+	{ .level0 = 1, .duration0 = LEGO_MARK_TICKS, .level1 = 0, .duration1 = (space) }
+
+#define LEGO_START_SYMBOL LEGO_SYMBOL(LEGO_START_SPACE_TICKS)
+#define LEGO_END_SYMBOL LEGO_SYMBOL(LEGO_END_SPACE_TICKS)
+#define LEGO_BIT0_SYMBOL LEGO_SYMBOL(LEGO_BIT0_SPACE_TICKS)
+#define LEGO_BIT1_SYMBOL LEGO_SYMBOL(LEGO_BIT1_SPACE_TICKS)
+
+// Start bit, 16 data bits, end bit
+#define LEGO_FRAME_SYMBOLS 18
+
+// Compile-time version of lego_packet_prepare() for combo direct packets,
+// used to build lego_frame_table.
+#define LEGO_KEY_IS_SINGLE(k) ((k) == LEGO_LB || (k) == LEGO_LF || (k) == LEGO_RF || (k) == LEGO_RB)
+#define LEGO_WORD_CHECKSUM(w) (0xf ^ (((w) >> 12) & 0xf) ^ (((w) >> 8) & 0xf) ^ (((w) >> 4) & 0xf))
+#define LEGO_COMBO_WORD_NOCHECK(ch, k)                                                             \
+	((LEGO_KEY_IS_SINGLE(k) << 15) | ((ch) << 12) | (0x1 << 8) | ((k) << 4))
+#define LEGO_COMBO_WORD(ch, k)                                                                     \
+	(LEGO_COMBO_WORD_NOCHECK(ch, k) | LEGO_WORD_CHECKSUM(LEGO_COMBO_WORD_NOCHECK(ch, k)))
+
+#define LEGO_WORD_BIT_SYMBOL(w, i)                                                                 \
+	LEGO_SYMBOL((((w) >> (i)) & 1) ? LEGO_BIT1_SPACE_TICKS : LEGO_BIT0_SPACE_TICKS)
+
+#define LEGO_FRAME(w)                                                                              \
+	{                                                                                              \
+		LEGO_START_SYMBOL, LEGO_WORD_BIT_SYMBOL(w, 15), LEGO_WORD_BIT_SYMBOL(w, 14),               \
+			LEGO_WORD_BIT_SYMBOL(w, 13), LEGO_WORD_BIT_SYMBOL(w, 12), LEGO_WORD_BIT_SYMBOL(w, 11), \
+			LEGO_WORD_BIT_SYMBOL(w, 10), LEGO_WORD_BIT_SYMBOL(w, 9), LEGO_WORD_BIT_SYMBOL(w, 8),   \
+			LEGO_WORD_BIT_SYMBOL(w, 7), LEGO_WORD_BIT_SYMBOL(w, 6), LEGO_WORD_BIT_SYMBOL(w, 5),    \
+			LEGO_WORD_BIT_SYMBOL(w, 4), LEGO_WORD_BIT_SYMBOL(w, 3), LEGO_WORD_BIT_SYMBOL(w, 2),    \
+			LEGO_WORD_BIT_SYMBOL(w, 1), LEGO_WORD_BIT_SYMBOL(w, 0), LEGO_END_SYMBOL,               \
+	}
+
+// Every valid combo direct frame, indexed by [channel][key mask]. The PWM
+// modes go through lego_frame_build().
+extern const rmt_symbol_word_t lego_frame_table[4][16][LEGO_FRAME_SYMBOLS];
+
+static inline bool lego_frame_in_table(const lego_packet_t *pkt) {
+	return lego_packet_is_combo_direct(pkt);
+}
+
+// Slow path for packets that are not in lego_frame_table. Expects a packet
+// that went through lego_packet_prepare().
+void lego_frame_build(const lego_packet_t *pkt, rmt_symbol_word_t frame[LEGO_FRAME_SYMBOLS]);
+
+// Low level symbols for `gap_us` of idle time, returns how many were used.
+// Odd single microseconds are rounded up, a zero duration would end the
+// transmission.
+uint32_t lego_frame_gap(uint32_t gap_us, rmt_symbol_word_t gap[LEGO_TIMING_GAP_SYMBOLS]);
+
+#endif
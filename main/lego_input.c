@@ -0,0 +1,70 @@
+#include "lego_input.h"
+
+void lego_input_init(
+	lego_input_t *in, uint8_t npins, uint32_t scan_ms, uint32_t debounce_ms,
+	uint32_t long_press_ms) {
+	const uint32_t integrate = debounce_ms / scan_ms;
+	in->npins = npins;
+	in->integrate = integrate == 0 ? 1 : integrate > 255 ? 255 : integrate;
+	in->debounce_us = in->integrate * scan_ms * 1000;
+	in->long_press_us = long_press_ms * 1000;
+	for (uint8_t i = 0; i < LEGO_INPUT_MAX; i++) {
+		lego_input_pin_t *pin = &in->pins[i];
+		atomic_init(&pin->edge_us, 0);
+		pin->integrator = 0;
+		pin->pressed = false;
+		pin->long_sent = false;
+		pin->pressed_us = 0;
+	}
+}
+
+static void lego_input_emit(
+	lego_input_event_t *events, uint32_t max, uint32_t *n, uint8_t input,
+	enum lego_input_kind kind, uint32_t stamp_us) {
+	if (*n < max) {
+		events[(*n)++] = (lego_input_event_t){input, kind, stamp_us};
+	}
+}
+
+uint32_t lego_input_scan(
+	lego_input_t *in, uint32_t pressed, uint32_t now_us, lego_input_event_t *events,
+	uint32_t max) {
+	uint32_t n = 0;
+	for (uint8_t i = 0; i < in->npins; i++) {
+		lego_input_pin_t *pin = &in->pins[i];
+		if ((pressed >> i) & 1) {
+			pin->integrator += pin->integrator < in->integrate;
+		} else {
+			pin->integrator -= pin->integrator > 0;
+		}
+
+		const bool at_end = pin->integrator == 0 || pin->integrator == in->integrate;
+		const bool now_pressed = pin->integrator == in->integrate;
+		uint32_t edge_us = atomic_load_explicit(&pin->edge_us, memory_order_relaxed);
+		if (at_end && now_pressed == pin->pressed) {
+			// A glitch that died out, unless a bounce is still to come
+			if (edge_us != 0 && now_us - edge_us >= in->debounce_us) {
+				atomic_compare_exchange_strong_explicit(
+					&pin->edge_us, &edge_us, 0, memory_order_relaxed, memory_order_relaxed);
+			}
+		} else if (at_end) {
+			// Settled, whatever bounced meanwhile started at the stamp. No
+			// stamp means the ISR missed it, e.g. it wasn't installed yet.
+			edge_us = atomic_exchange_explicit(&pin->edge_us, 0, memory_order_relaxed);
+			const uint32_t stamp_us = edge_us != 0 ? edge_us : now_us;
+			pin->pressed = now_pressed;
+			if (now_pressed) {
+				pin->pressed_us = stamp_us;
+				pin->long_sent = false;
+			}
+			lego_input_emit(
+				events, max, &n, i, now_pressed ? LEGO_INPUT_PRESS : LEGO_INPUT_RELEASE, stamp_us);
+		}
+		if (pin->pressed && !pin->long_sent && in->long_press_us > 0 &&
+			now_us - pin->pressed_us >= in->long_press_us) {
+			pin->long_sent = true;
+			lego_input_emit(events, max, &n, i, LEGO_INPUT_LONG_PRESS, now_us);
+		}
+	}
+	return n;
+}
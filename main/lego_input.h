@@ -0,0 +1,70 @@
+#ifndef LEGO_INPUT_INCLUDED
+#define LEGO_INPUT_INCLUDED
+
+// Debounced buttons on any number of pins without a timer per pin. The edge
+// ISR only timestamps the first edge since the last scan, at constant cost.
+// A periodic scan feeds each pin's level into an integrator that has to
+// run all the way to one end before the state flips, and reports press,
+// release and long press. Events carry the time of the edge that started
+// the transition rather than the time it was confirmed, or of a glitch up to
+// the debounce time before it. Plain C, buildable on the host.
+
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+// Pins per lego_input_t, the scan takes them as a bit mask
+#define LEGO_INPUT_MAX 32
+
+enum lego_input_kind {
+	LEGO_INPUT_PRESS,
+	LEGO_INPUT_RELEASE,
+	// Once per press, after it was held for long_press_ms
+	LEGO_INPUT_LONG_PRESS,
+};
+
+typedef struct {
+	uint8_t input;
+	uint8_t kind;
+	// Low 32 bits in us, see above. For a long press, when it was reached.
+	uint32_t stamp_us;
+} lego_input_event_t;
+
+typedef struct {
+	// First edge since the scan last settled this pin, 0 if none. The low
+	// bit is forced on so a stamp of 0 still counts.
+	_Atomic uint32_t edge_us;
+	uint8_t integrator;
+	bool pressed;
+	bool long_sent;
+	uint32_t pressed_us;
+} lego_input_pin_t;
+
+typedef struct {
+	lego_input_pin_t pins[LEGO_INPUT_MAX];
+	uint8_t npins;
+	// Scans a level must hold for before it counts
+	uint8_t integrate;
+	uint32_t debounce_us;
+	uint32_t long_press_us;
+} lego_input_t;
+
+// `debounce_ms` is rounded down to whole scans, at least one
+void lego_input_init(
+	lego_input_t *in, uint8_t npins, uint32_t scan_ms, uint32_t debounce_ms,
+	uint32_t long_press_ms);
+
+// Safe from an ISR
+static inline void lego_input_edge(lego_input_t *in, uint8_t input, uint32_t now_us) {
+	uint32_t none = 0;
+	atomic_compare_exchange_strong_explicit(
+		&in->pins[input].edge_us, &none, now_us | 1, memory_order_relaxed, memory_order_relaxed);
+}
+
+// Takes the pressed pins, bit i for input i, and writes up to `max` events.
+// Returns how many were written; with room for 2 per pin none are lost.
+uint32_t lego_input_scan(
+	lego_input_t *in, uint32_t pressed, uint32_t now_us, lego_input_event_t *events,
+	uint32_t max);
+
+#endif
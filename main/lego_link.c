@@ -0,0 +1,75 @@
+#include "lego_link.h"
+
+// Poll interval while up, nothing to do there
+#define LEGO_LINK_IDLE_MS 60000
+
+void lego_link_init(lego_link_t *link, const lego_link_config_t *config, uint32_t seed) {
+	*link = (lego_link_t){
+		.config = *config,
+		.state = LEGO_LINK_UP,
+		.backoff_ms = config->min_ms,
+		.rng = seed != 0 ? seed : 1,
+	};
+}
+
+// xorshift32
+static uint32_t lego_link_random(lego_link_t *link) {
+	uint32_t x = link->rng;
+	x ^= x << 13;
+	x ^= x >> 17;
+	x ^= x << 5;
+	return link->rng = x;
+}
+
+void lego_link_up(lego_link_t *link, uint32_t now_ms) {
+	link->state = LEGO_LINK_UP;
+	link->backoff_ms = link->config.min_ms;
+	link->attempts = 0;
+}
+
+void lego_link_down(lego_link_t *link, uint32_t now_ms) {
+	if (link->state == LEGO_LINK_UP) {
+		link->outages++;
+	} else if (link->state == LEGO_LINK_BACKOFF) {
+		// Already waiting, a repeated event doesn't push the retry out
+		return;
+	}
+	// Half to all of the backoff, then double it
+	const uint32_t jitter = lego_link_random(link) % (link->backoff_ms / 2 + 1);
+	link->retry_at_ms = now_ms + link->backoff_ms / 2 + jitter;
+	link->backoff_ms = link->backoff_ms >= link->config.max_ms / 2 ? link->config.max_ms
+																   : link->backoff_ms * 2;
+	link->state = LEGO_LINK_BACKOFF;
+}
+
+void lego_link_retry(lego_link_t *link, uint32_t now_ms) {
+	if (link->state == LEGO_LINK_BACKOFF) {
+		link->retry_at_ms = now_ms;
+	}
+}
+
+bool lego_link_poll(lego_link_t *link, uint32_t now_ms, uint32_t *wait_ms) {
+	switch (link->state) {
+	case LEGO_LINK_UP:
+		*wait_ms = LEGO_LINK_IDLE_MS;
+		return false;
+	case LEGO_LINK_BACKOFF:
+		if ((int32_t)(now_ms - link->retry_at_ms) < 0) {
+			*wait_ms = link->retry_at_ms - now_ms;
+			return false;
+		}
+		link->state = LEGO_LINK_CONNECTING;
+		link->attempt_ms = now_ms;
+		link->attempts++;
+		*wait_ms = link->config.connect_timeout_ms;
+		return true;
+	case LEGO_LINK_CONNECTING:
+		if (now_ms - link->attempt_ms >= link->config.connect_timeout_ms) {
+			lego_link_down(link, now_ms);
+			return lego_link_poll(link, now_ms, wait_ms);
+		}
+		*wait_ms = link->config.connect_timeout_ms - (now_ms - link->attempt_ms);
+		return false;
+	}
+	return false;
+}
@@ -0,0 +1,59 @@
+#ifndef LEGO_LINK_INCLUDED
+#define LEGO_LINK_INCLUDED
+
+// Reconnect state machine for the MQTT connection, driven from a task
+// rather than the client's event handler. Attempts are spaced by an
+// exponential backoff with jitter, so a broker that comes back isn't hit by
+// every device at once. Plain C, buildable on the host.
+
+#include <stdbool.h>
+#include <stdint.h>
+
+enum lego_link_state {
+	LEGO_LINK_UP,
+	// Waiting for `retry_at_ms`
+	LEGO_LINK_BACKOFF,
+	// A reconnect was started, waiting for its outcome
+	LEGO_LINK_CONNECTING,
+};
+
+typedef struct {
+	uint32_t min_ms;
+	uint32_t max_ms;
+	// An attempt with no outcome after this long counts as failed
+	uint32_t connect_timeout_ms;
+} lego_link_config_t;
+
+typedef struct {
+	lego_link_config_t config;
+	enum lego_link_state state;
+	// Backoff before the next attempt, before jitter
+	uint32_t backoff_ms;
+	uint32_t retry_at_ms;
+	uint32_t attempt_ms;
+	uint32_t rng;
+	// Attempts since the link was last up, and outages since boot
+	uint32_t attempts;
+	uint32_t outages;
+} lego_link_t;
+
+// Starts out up, the first connection is made by the client itself
+void lego_link_init(lego_link_t *link, const lego_link_config_t *config, uint32_t seed);
+
+static inline bool lego_link_is_up(const lego_link_t *link) {
+	return link->state == LEGO_LINK_UP;
+}
+
+void lego_link_up(lego_link_t *link, uint32_t now_ms);
+
+// The connection dropped or an attempt failed
+void lego_link_down(lego_link_t *link, uint32_t now_ms);
+
+// Skips what is left of the backoff, for when the network is back
+void lego_link_retry(lego_link_t *link, uint32_t now_ms);
+
+// Returns true when a reconnect should be started now. *wait_ms is how long
+// until the next call is due.
+bool lego_link_poll(lego_link_t *link, uint32_t now_ms, uint32_t *wait_ms);
+
+#endif
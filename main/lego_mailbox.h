@@ -0,0 +1,88 @@
+#ifndef LEGO_MAILBOX_INCLUDED
+#define LEGO_MAILBOX_INCLUDED
+
+// Latest-wins mailbox for button states, one reader. lego_mailbox_post() can
+// be called from several writers, lego_mailbox_post_seq() from only one.
+// A writer overwrites whatever is there, the reader only ever sees the
+// newest state, and the sequence number tells it how many it missed. Plain C,
+// buildable on the host.
+
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+#define LEGO_MAILBOX_REORDER_WINDOW 256
+
+typedef struct {
+	// Post sequence number << 16 | state
+	_Atomic uint32_t word;
+	// Low 32 bits of the post time in us. Read after `word`, so it can belong
+	// to a post that is just landing, which only skews latency figures.
+	_Atomic uint32_t stamp_us;
+	// Writer side: last sequence number from the sender, and posts that
+	// arrived older than it
+	uint16_t sender_seq;
+	bool has_sender_seq;
+	_Atomic uint32_t dropped;
+	// Reader side: last sequence number taken, and posts overwritten before
+	// they were taken
+	uint32_t taken_seq;
+	uint32_t coalesced;
+} lego_mailbox_t;
+
+static inline void lego_mailbox_init(lego_mailbox_t *mb) {
+	atomic_init(&mb->word, 0);
+	atomic_init(&mb->stamp_us, 0);
+	atomic_init(&mb->dropped, 0);
+	mb->sender_seq = 0;
+	mb->has_sender_seq = false;
+	mb->taken_seq = 0;
+	mb->coalesced = 0;
+}
+
+static inline void lego_mailbox_post(lego_mailbox_t *mb, uint16_t state, uint32_t stamp_us) {
+	atomic_store_explicit(&mb->stamp_us, stamp_us, memory_order_relaxed);
+	uint32_t word = atomic_load_explicit(&mb->word, memory_order_relaxed);
+	// Another writer's post in between takes the next sequence number first
+	while (!atomic_compare_exchange_weak_explicit(
+		&mb->word, &word, ((word >> 16) + 1) << 16 | state, memory_order_release,
+		memory_order_relaxed)) {
+	}
+}
+
+// Same, for senders that number their updates. Repeats and stale updates, up
+// to LEGO_MAILBOX_REORDER_WINDOW behind the newest one, are dropped and false
+// returned. Anything further back is a restarted sender and accepted.
+static inline bool
+lego_mailbox_post_seq(lego_mailbox_t *mb, uint16_t state, uint16_t sender_seq, uint32_t stamp_us) {
+	const int16_t ahead = sender_seq - mb->sender_seq;
+	if (mb->has_sender_seq && ahead <= 0 && ahead > -LEGO_MAILBOX_REORDER_WINDOW) {
+		atomic_fetch_add_explicit(&mb->dropped, 1, memory_order_relaxed);
+		return false;
+	}
+	mb->sender_seq = sender_seq;
+	mb->has_sender_seq = true;
+	lego_mailbox_post(mb, state, stamp_us);
+	return true;
+}
+
+// Returns true with the newest state if anything was posted since the last
+// call.
+static inline bool lego_mailbox_take(lego_mailbox_t *mb, uint16_t *state, uint32_t *stamp_us) {
+	const uint32_t word = atomic_load_explicit(&mb->word, memory_order_acquire);
+	const uint32_t seq = word >> 16;
+	if (seq == mb->taken_seq) {
+		return false;
+	}
+	mb->coalesced += ((seq - mb->taken_seq) & 0xffff) - 1;
+	mb->taken_seq = seq;
+	*state = word & 0xffff;
+	*stamp_us = atomic_load_explicit(&mb->stamp_us, memory_order_relaxed);
+	return true;
+}
+
+static inline uint32_t lego_mailbox_dropped(lego_mailbox_t *mb) {
+	return atomic_load_explicit(&mb->dropped, memory_order_relaxed);
+}
+
+#endif
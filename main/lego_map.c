@@ -0,0 +1,70 @@
+#include "lego_map.h"
+
+#include "lego_nes.h"
+
+// The two directions of each output
+#define LEGO_MAP_OUTPUT_A (LEGO_LB | LEGO_LF)
+#define LEGO_MAP_OUTPUT_B (LEGO_RF | LEGO_RB)
+
+void lego_map_init(lego_map_t *map, uint8_t channel) {
+	const lego_map_rule_t rules[] = {
+		{LEGO_NES_UP, channel, LEGO_LF | LEGO_RF},
+		{LEGO_NES_DOWN, channel, LEGO_LB | LEGO_RB},
+		{LEGO_NES_LEFT, channel, LEGO_RF},
+		{LEGO_NES_RIGHT, channel, LEGO_LF},
+	};
+	map->nrules = sizeof(rules) / sizeof(rules[0]);
+	for (uint8_t i = 0; i < map->nrules; i++) {
+		map->rules[i] = rules[i];
+	}
+}
+
+uint16_t lego_map_apply(const lego_map_t *map, uint16_t buttons) {
+	static const uint8_t outputs[] = {LEGO_MAP_OUTPUT_A, LEGO_MAP_OUTPUT_B};
+	uint16_t keys = 0;
+	uint16_t driven = 0;
+	for (uint8_t i = 0; i < map->nrules; i++) {
+		const lego_map_rule_t *rule = &map->rules[i];
+		if ((buttons & rule->buttons) != rule->buttons) {
+			continue;
+		}
+		for (uint8_t j = 0; j < 2; j++) {
+			const uint16_t output = outputs[j] << (4 * rule->channel);
+			if ((rule->keys & outputs[j]) != 0 && (driven & output) == 0) {
+				keys |= (rule->keys & outputs[j]) << (4 * rule->channel);
+				driven |= output;
+			}
+		}
+	}
+	return keys;
+}
+
+static bool lego_map_rule_valid(const lego_map_rule_t *rule) {
+	return rule->buttons != 0 && rule->channel < 4 && rule->keys <= 0xf &&
+		   (rule->keys & LEGO_MAP_OUTPUT_A) != LEGO_MAP_OUTPUT_A &&
+		   (rule->keys & LEGO_MAP_OUTPUT_B) != LEGO_MAP_OUTPUT_B;
+}
+
+bool lego_map_load(lego_map_t *map, const uint8_t *data, uint32_t len) {
+	const uint32_t n = len / LEGO_MAP_RULE_BYTES;
+	if (len % LEGO_MAP_RULE_BYTES != 0 || n > LEGO_MAP_MAX_RULES) {
+		return false;
+	}
+	lego_map_rule_t rules[LEGO_MAP_MAX_RULES];
+	for (uint32_t i = 0; i < n; i++) {
+		const uint8_t *record = &data[i * LEGO_MAP_RULE_BYTES];
+		rules[i] = (lego_map_rule_t){
+			.buttons = record[0] | record[1] << 8,
+			.channel = record[2],
+			.keys = record[3],
+		};
+		if (!lego_map_rule_valid(&rules[i])) {
+			return false;
+		}
+	}
+	for (uint32_t i = 0; i < n; i++) {
+		map->rules[i] = rules[i];
+	}
+	map->nrules = n;
+	return true;
+}
@@ -0,0 +1,47 @@
+#ifndef LEGO_MAP_INCLUDED
+#define LEGO_MAP_INCLUDED
+
+// Table mapping pad buttons to combo direct keys per channel. The result of
+// a lookup is what every channel should be doing while those buttons are
+// held, 4 key bits per channel, channel 0 in the low nibble. Plain C,
+// buildable on the host.
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "lego_packet.h"
+
+#define LEGO_MAP_MAX_RULES 16
+// Wire size of a rule in lego_map_load()
+#define LEGO_MAP_RULE_BYTES 4
+
+typedef struct {
+	// Pad buttons that must all be held, see lego_nes.h
+	uint16_t buttons;
+	uint8_t channel;
+	// enum lego_key, at most one direction per output
+	uint8_t keys;
+} lego_map_rule_t;
+
+typedef struct {
+	lego_map_rule_t rules[LEGO_MAP_MAX_RULES];
+	uint8_t nrules;
+} lego_map_t;
+
+// Forward on Up, backward on Down, turning on Left and Right, on `channel`
+void lego_map_init(lego_map_t *map, uint8_t channel);
+
+// Rules are tried in order and each output of a channel is driven by the
+// first matching rule that drives it, so chords go before their buttons.
+uint16_t lego_map_apply(const lego_map_t *map, uint16_t buttons);
+
+// Replaces the rules with `len` / LEGO_MAP_RULE_BYTES records of buttons
+// (little-endian), channel and keys. Returns false and keeps the old rules
+// if any record is invalid or there are too many.
+bool lego_map_load(lego_map_t *map, const uint8_t *data, uint32_t len);
+
+static inline enum lego_key lego_map_channel_keys(uint16_t keys, uint8_t channel) {
+	return (keys >> (4 * channel)) & 0xf;
+}
+
+#endif
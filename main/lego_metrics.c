@@ -0,0 +1,99 @@
+#include "lego_metrics.h"
+
+#include <string.h>
+
+#ifndef ESP_PLATFORM
+#include <time.h>
+#endif
+
+static uint32_t lego_hist_bin(uint32_t value) {
+	if (value < LEGO_HIST_SUB_BINS) {
+		return value;
+	}
+	const uint32_t msb = 31 - __builtin_clz(value);
+	if (msb >= LEGO_HIST_MAX_BITS) {
+		return LEGO_HIST_BINS - 1;
+	}
+	const uint32_t shift = msb - 3;
+	return (shift + 1) * LEGO_HIST_SUB_BINS + ((value >> shift) & (LEGO_HIST_SUB_BINS - 1));
+}
+
+static uint32_t lego_hist_bin_upper(uint32_t bin) {
+	if (bin < LEGO_HIST_SUB_BINS) {
+		return bin;
+	}
+	const uint32_t shift = bin / LEGO_HIST_SUB_BINS - 1;
+	const uint32_t lower = (LEGO_HIST_SUB_BINS + bin % LEGO_HIST_SUB_BINS) << shift;
+	return lower + (1 << shift) - 1;
+}
+
+void lego_hist_record(lego_hist_t *hist, uint32_t value) {
+	hist->counts[lego_hist_bin(value)]++;
+	hist->total++;
+	if (value > hist->max) {
+		hist->max = value;
+	}
+}
+
+uint32_t lego_hist_percentile(const lego_hist_t *hist, uint32_t permille) {
+	if (hist->total == 0) {
+		return 0;
+	}
+	// Rank of the sample, rounded up
+	const uint64_t rank = ((uint64_t)hist->total * permille + 999) / 1000;
+	uint64_t seen = 0;
+	for (uint32_t bin = 0; bin < LEGO_HIST_BINS; bin++) {
+		seen += hist->counts[bin];
+		if (seen >= rank && seen > 0) {
+			if (bin == LEGO_HIST_BINS - 1) {
+				return hist->max;
+			}
+			const uint32_t upper = lego_hist_bin_upper(bin);
+			return upper < hist->max ? upper : hist->max;
+		}
+	}
+	return hist->max;
+}
+
+void lego_hist_summarize(const lego_hist_t *hist, lego_hist_summary_t *summary) {
+	*summary = (lego_hist_summary_t){
+		.total = hist->total,
+		.p50 = lego_hist_percentile(hist, 500),
+		.p95 = lego_hist_percentile(hist, 950),
+		.p99 = lego_hist_percentile(hist, 990),
+		.max = hist->max,
+	};
+}
+
+#ifndef ESP_PLATFORM
+uint32_t lego_metrics_host_clock(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000ULL + ts.tv_nsec / 1000;
+}
+#endif
+
+void lego_metrics_init(lego_metrics_t *metrics, lego_clock_fn_t clock) {
+	memset(metrics->hist, 0, sizeof(metrics->hist));
+	atomic_init(&metrics->active, 0);
+	metrics->clock = clock;
+	metrics->window_start_us = metrics->clock();
+}
+
+void lego_metrics_record(lego_metrics_t *metrics, enum lego_metrics_stage stage, uint32_t us) {
+	const uint32_t active = atomic_load_explicit(&metrics->active, memory_order_acquire);
+	lego_hist_record(&metrics->hist[active][stage], us);
+}
+
+const lego_hist_t *lego_metrics_rotate(lego_metrics_t *metrics, uint32_t period_us) {
+	const uint32_t now_us = metrics->clock();
+	if (now_us - metrics->window_start_us < period_us) {
+		return NULL;
+	}
+	metrics->window_start_us = now_us;
+	const uint32_t retired = atomic_load_explicit(&metrics->active, memory_order_relaxed);
+	// Cleared before it becomes active again on the next call
+	memset(metrics->hist[retired ^ 1], 0, sizeof(metrics->hist[0]));
+	atomic_store_explicit(&metrics->active, retired ^ 1, memory_order_release);
+	return metrics->hist[retired];
+}
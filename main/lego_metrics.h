@@ -0,0 +1,82 @@
+#ifndef LEGO_METRICS_INCLUDED
+#define LEGO_METRICS_INCLUDED
+
+// Fixed-size latency histograms for the command path, from MQTT ingest to
+// the IR LED. Plain C, buildable on the host. The clock is passed in, so it
+// can be lego_metrics_host_clock() or a fake one there.
+
+#include <stdatomic.h>
+#include <stdint.h>
+
+// Values below 8 get a bin each, above that every power of two is split in
+// 8 bins, so a percentile is off by at most 1/8. Values from 2^24 us (16 s)
+// on share one more bin, reported as the max.
+#define LEGO_HIST_SUB_BINS 8
+#define LEGO_HIST_MAX_BITS 24
+#define LEGO_HIST_BINS ((LEGO_HIST_MAX_BITS - 2) * LEGO_HIST_SUB_BINS + 1)
+
+typedef struct {
+	uint32_t counts[LEGO_HIST_BINS];
+	uint32_t total;
+	uint32_t max;
+} lego_hist_t;
+
+void lego_hist_record(lego_hist_t *hist, uint32_t value);
+
+// Upper bound of the bin holding the `permille` quantile, 0 when empty
+uint32_t lego_hist_percentile(const lego_hist_t *hist, uint32_t permille);
+
+// What esp/1/metrics reports per stage, small enough to pass by value
+typedef struct {
+	uint32_t total;
+	uint32_t p50;
+	uint32_t p95;
+	uint32_t p99;
+	uint32_t max;
+} lego_hist_summary_t;
+
+void lego_hist_summarize(const lego_hist_t *hist, lego_hist_summary_t *summary);
+
+enum lego_metrics_stage {
+	// MQTT ingest to the first encode call of the transaction
+	LEGO_STAGE_QUEUE,
+	// First encode call until the RMT starts sending
+	LEGO_STAGE_ENCODE,
+	// MQTT ingest to the first carrier edge
+	LEGO_STAGE_FIRST_EDGE,
+	// RMT start to on_trans_done
+	LEGO_STAGE_AIR,
+	// Pad read to its keys looping on the LED, see nes.h
+	LEGO_STAGE_PAD,
+	LEGO_STAGE_COUNT,
+};
+
+typedef uint32_t (*lego_clock_fn_t)(void);
+
+// Two sets of histograms: the RMT callback records into the active one while
+// the publisher reads and clears the other.
+typedef struct {
+	lego_hist_t hist[2][LEGO_STAGE_COUNT];
+	_Atomic uint32_t active;
+	lego_clock_fn_t clock;
+	uint32_t window_start_us;
+} lego_metrics_t;
+
+#ifndef ESP_PLATFORM
+// CLOCK_MONOTONIC in us, truncated to 32 bits like the device clock
+uint32_t lego_metrics_host_clock(void);
+#endif
+
+void lego_metrics_init(lego_metrics_t *metrics, lego_clock_fn_t clock);
+
+static inline uint32_t lego_metrics_now(const lego_metrics_t *metrics) {
+	return metrics->clock();
+}
+
+void lego_metrics_record(lego_metrics_t *metrics, enum lego_metrics_stage stage, uint32_t us);
+
+// Returns the histograms recorded since the last call once `period_us` has
+// passed, NULL before that. They stay valid until the next call.
+const lego_hist_t *lego_metrics_rotate(lego_metrics_t *metrics, uint32_t period_us);
+
+#endif
@@ -0,0 +1,34 @@
+#include "lego_nes.h"
+
+#include <string.h>
+
+// SPI sends MSB first
+static bool lego_nes_stream_bit(const uint8_t *bytes, uint32_t i) {
+	return (bytes[i / 8] >> (7 - i % 8)) & 1;
+}
+
+uint32_t lego_nes_frame(enum lego_nes_pad pad, uint8_t *tx) {
+	const uint32_t len = (LEGO_NES_LATCH_BITS + lego_nes_bits(pad) + 7) / 8;
+	memset(tx, 0, len);
+	for (uint32_t i = 0; i < LEGO_NES_LATCH_BITS; i++) {
+		tx[i / 8] |= 0x80 >> (i % 8);
+	}
+	return len;
+}
+
+bool lego_nes_decode(enum lego_nes_pad pad, const uint8_t *rx, uint16_t *buttons) {
+	// The first button is on the data line as soon as the latch drops, each
+	// rising edge after that brings the next. Low when pressed.
+	uint16_t pressed = 0;
+	for (uint32_t i = 0; i < lego_nes_bits(pad); i++) {
+		if (!lego_nes_stream_bit(rx, LEGO_NES_LATCH_BITS + i)) {
+			pressed |= 1 << i;
+		}
+	}
+	// An NES pad shifts in zeros after its 8 bits
+	if (pad == LEGO_NES_PAD_SNES && (pressed & 0xf000) != 0) {
+		return false;
+	}
+	*buttons = pressed;
+	return true;
+}
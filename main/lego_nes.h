@@ -0,0 +1,67 @@
+#ifndef LEGO_NES_INCLUDED
+#define LEGO_NES_INCLUDED
+
+// NES and SNES pads read through an SPI peripheral in one full-duplex
+// transaction. The pad is a parallel-in shift register (4021): MOSI drives
+// the latch, SCLK the clock and MISO reads the data line, mode 0. The
+// transaction holds the latch high for LEGO_NES_LATCH_BITS, which loads the
+// buttons, then clocks them out one per bit with the latch low. Plain C,
+// buildable on the host.
+
+#include <stdbool.h>
+#include <stdint.h>
+
+// Long enough for the 12 us latch pulse up to 640 kHz
+#define LEGO_NES_LATCH_BITS 8
+#define LEGO_NES_MAX_BYTES 3
+
+enum lego_nes_pad {
+	LEGO_NES_PAD_NES,
+	// 16 bits, of which the last 4 always read as released
+	LEGO_NES_PAD_SNES,
+};
+
+// Buttons in shift order, set when pressed
+#define LEGO_NES_A (1 << 0)
+#define LEGO_NES_B (1 << 1)
+#define LEGO_NES_SELECT (1 << 2)
+#define LEGO_NES_START (1 << 3)
+#define LEGO_NES_UP (1 << 4)
+#define LEGO_NES_DOWN (1 << 5)
+#define LEGO_NES_LEFT (1 << 6)
+#define LEGO_NES_RIGHT (1 << 7)
+
+#define LEGO_SNES_B (1 << 0)
+#define LEGO_SNES_Y (1 << 1)
+#define LEGO_SNES_SELECT (1 << 2)
+#define LEGO_SNES_START (1 << 3)
+#define LEGO_SNES_UP (1 << 4)
+#define LEGO_SNES_DOWN (1 << 5)
+#define LEGO_SNES_LEFT (1 << 6)
+#define LEGO_SNES_RIGHT (1 << 7)
+#define LEGO_SNES_A (1 << 8)
+#define LEGO_SNES_X (1 << 9)
+#define LEGO_SNES_L (1 << 10)
+#define LEGO_SNES_R (1 << 11)
+
+// What the reader sends on every change
+typedef struct {
+	uint16_t buttons;
+	// When the pad was read, 0 to re-apply the last buttons
+	uint32_t sample_us;
+} lego_nes_event_t;
+
+// Bits shifted out per poll
+static inline uint8_t lego_nes_bits(enum lego_nes_pad pad) {
+	return pad == LEGO_NES_PAD_SNES ? 16 : 8;
+}
+
+// Fills `tx` with the latch pattern and returns the transaction length in
+// bytes, at most LEGO_NES_MAX_BYTES
+uint32_t lego_nes_frame(enum lego_nes_pad pad, uint8_t *tx);
+
+// Buttons from what MISO read during the transaction. Returns false if the
+// frame can't come from this kind of pad, e.g. an NES pad on an SNES read.
+bool lego_nes_decode(enum lego_nes_pad pad, const uint8_t *rx, uint16_t *buttons);
+
+#endif
@@ -0,0 +1,108 @@
+#include "lego_outbox.h"
+
+#include <string.h>
+
+void lego_outbox_init(lego_outbox_t *outbox) {
+	memset(outbox, 0, sizeof(*outbox));
+}
+
+static lego_outbox_entry_t *lego_outbox_entry(lego_outbox_t *outbox, uint32_t i) {
+	return &outbox->entries[i % LEGO_OUTBOX_MAX];
+}
+
+static void lego_outbox_kill(lego_outbox_t *outbox, lego_outbox_entry_t *entry) {
+	entry->dead = true;
+	outbox->live--;
+	outbox->live_bytes -= entry->topic_len + 1 + entry->len;
+}
+
+// Moves the live entries down to the start of `bytes`, in order
+static void lego_outbox_compact(lego_outbox_t *outbox) {
+	uint32_t head = outbox->tail;
+	uint32_t end = 0;
+	for (uint32_t i = outbox->tail; i != outbox->head; i++) {
+		const lego_outbox_entry_t *entry = lego_outbox_entry(outbox, i);
+		if (entry->dead) {
+			continue;
+		}
+		const uint32_t size = entry->topic_len + 1 + entry->len;
+		memmove(&outbox->bytes[end], &outbox->bytes[entry->offset], size);
+		lego_outbox_entry_t *moved = lego_outbox_entry(outbox, head++);
+		*moved = *entry;
+		moved->offset = end;
+		end += size;
+	}
+	outbox->head = head;
+	outbox->end = end;
+}
+
+bool lego_outbox_push(
+	lego_outbox_t *outbox, const char *topic, const void *payload, uint16_t len, bool coalesce) {
+	const size_t topic_len = strlen(topic);
+	const uint32_t size = topic_len + 1 + len;
+	if (topic_len > UINT16_MAX || size > LEGO_OUTBOX_BYTES) {
+		outbox->dropped++;
+		return false;
+	}
+	if (coalesce) {
+		for (uint32_t i = outbox->tail; i != outbox->head; i++) {
+			lego_outbox_entry_t *entry = lego_outbox_entry(outbox, i);
+			if (!entry->dead && entry->coalesce && entry->topic_len == topic_len &&
+				memcmp(&outbox->bytes[entry->offset], topic, topic_len) == 0) {
+				lego_outbox_kill(outbox, entry);
+				outbox->coalesced++;
+			}
+		}
+	}
+	if (outbox->end + size > LEGO_OUTBOX_BYTES ||
+		outbox->head - outbox->tail == LEGO_OUTBOX_MAX) {
+		for (uint32_t i = outbox->tail;
+			 outbox->live_bytes + size > LEGO_OUTBOX_BYTES || outbox->live == LEGO_OUTBOX_MAX;
+			 i++) {
+			lego_outbox_entry_t *entry = lego_outbox_entry(outbox, i);
+			if (!entry->dead) {
+				lego_outbox_kill(outbox, entry);
+				outbox->dropped++;
+			}
+		}
+		lego_outbox_compact(outbox);
+	}
+	lego_outbox_entry_t *entry = lego_outbox_entry(outbox, outbox->head++);
+	*entry = (lego_outbox_entry_t){
+		.offset = outbox->end,
+		.topic_len = topic_len,
+		.len = len,
+		.coalesce = coalesce,
+	};
+	memcpy(&outbox->bytes[outbox->end], topic, topic_len + 1);
+	memcpy(&outbox->bytes[outbox->end + topic_len + 1], payload, len);
+	outbox->end += size;
+	outbox->live++;
+	outbox->live_bytes += size;
+	return true;
+}
+
+bool lego_outbox_peek(lego_outbox_t *outbox, lego_outbox_msg_t *msg) {
+	while (outbox->tail != outbox->head && lego_outbox_entry(outbox, outbox->tail)->dead) {
+		outbox->tail++;
+	}
+	if (outbox->tail == outbox->head) {
+		outbox->end = 0;
+		return false;
+	}
+	const lego_outbox_entry_t *entry = lego_outbox_entry(outbox, outbox->tail);
+	msg->topic = (const char *)&outbox->bytes[entry->offset];
+	msg->payload = &outbox->bytes[entry->offset + entry->topic_len + 1];
+	msg->len = entry->len;
+	return true;
+}
+
+void lego_outbox_pop(lego_outbox_t *outbox) {
+	lego_outbox_msg_t msg;
+	if (lego_outbox_peek(outbox, &msg)) {
+		lego_outbox_kill(outbox, lego_outbox_entry(outbox, outbox->tail++));
+		if (outbox->tail == outbox->head) {
+			outbox->end = 0;
+		}
+	}
+}
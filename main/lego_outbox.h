@@ -0,0 +1,63 @@
+#ifndef LEGO_OUTBOX_INCLUDED
+#define LEGO_OUTBOX_INCLUDED
+
+// Bounded store for messages published while the broker is unreachable,
+// sent in order once it is back. When full the oldest messages are dropped.
+// Messages that only carry the latest state of something can coalesce, a
+// newer one replacing any still buffered for the same topic. Not thread
+// safe. Plain C, buildable on the host.
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#define LEGO_OUTBOX_BYTES 8192
+#define LEGO_OUTBOX_MAX 64
+
+typedef struct {
+	// Into `bytes`, the terminated topic then the payload
+	uint32_t offset;
+	uint16_t topic_len;
+	uint16_t len;
+	bool coalesce;
+	// Replaced or dropped, skipped and reclaimed later
+	bool dead;
+} lego_outbox_entry_t;
+
+typedef struct {
+	uint8_t bytes[LEGO_OUTBOX_BYTES];
+	// Free-running, in publish order
+	lego_outbox_entry_t entries[LEGO_OUTBOX_MAX];
+	uint32_t head;
+	uint32_t tail;
+	// End of the last entry in `bytes`
+	uint32_t end;
+	// Excluding dead entries
+	uint32_t live;
+	uint32_t live_bytes;
+	uint32_t dropped;
+	uint32_t coalesced;
+} lego_outbox_t;
+
+typedef struct {
+	const char *topic;
+	const uint8_t *payload;
+	uint16_t len;
+} lego_outbox_msg_t;
+
+void lego_outbox_init(lego_outbox_t *outbox);
+
+static inline bool lego_outbox_empty(const lego_outbox_t *outbox) {
+	return outbox->live == 0;
+}
+
+// Returns false if the message can never fit, which counts as dropped
+bool lego_outbox_push(
+	lego_outbox_t *outbox, const char *topic, const void *payload, uint16_t len, bool coalesce);
+
+// The oldest message, valid until the next push or pop. Returns false if
+// there is none.
+bool lego_outbox_peek(lego_outbox_t *outbox, lego_outbox_msg_t *msg);
+
+void lego_outbox_pop(lego_outbox_t *outbox);
+
+#endif
@@ -0,0 +1,157 @@
+#ifndef LEGO_PACKET_INCLUDED
+#define LEGO_PACKET_INCLUDED
+
+// Plain C, no ESP-IDF headers: this file must stay buildable on the host.
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+
+// Packet pseudocode, with the field names of lego_packet_t:
+//		// Set for a single key in combo direct, the address in combo PWM
+//		command = toggle << 15;
+//		command |= escape << 14;
+//		command |= channel << 12; // channel=0..3
+//		if (escape) {
+//			// Combo PWM
+//			command |= step_b << 8;
+//			command |= step_a << 4;
+//		} else {
+//			command |= address << 11; // always 0
+//			command |= mode << 8;
+//			// Key mask in combo direct, speed step in single output PWM
+//			command |= key << 4;
+//		}
+//		command |= 0xf ^ ((command >> 4) & 0xf) ^ ((command >> 8) & 0xf)
+//^ (command >> 12); // checksum
+//
+
+enum lego_key {
+	LEGO_LB = 0x1,
+	LEGO_LF = 0x2,
+	LEGO_RF = 0x4,
+	LEGO_RB = 0x8,
+};
+
+// Output speed in the PWM modes. Forward steps count up from 1, backward
+// steps count down from 0xf, brake is followed by float on the receiver.
+#define LEGO_PWM_FLOAT 0x0
+#define LEGO_PWM_BRAKE 0x8
+#define LEGO_PWM_STEPS 7
+
+// Mode bits MMM of nibble 2, with escape = 0. Extended mode (000) is never
+// sent by this firmware: a zero mode field is what older clients put in
+// their packets, so lego_packet_prepare() turns it into combo direct.
+enum lego_mode {
+	LEGO_MODE_EXTENDED = 0x0,
+	LEGO_MODE_COMBO_DIRECT = 0x1,
+	LEGO_MODE_PWM_A = 0x4,
+	LEGO_MODE_PWM_B = 0x5,
+	LEGO_MODE_CSTID_A = 0x6,
+	LEGO_MODE_CSTID_B = 0x7,
+};
+
+// Bit layout, MSB first: T E C C | a M M M | D D D D | L L L L
+// In combo PWM mode (escape = 1) the toggle bit is the address bit, nibble 2
+// is the output B speed and nibble 3 the output A speed.
+typedef struct __attribute__((packed)) {
+	uint8_t checksum : 4;
+	// Key mask in combo direct mode, speed step in single output PWM mode
+	enum lego_key key : 4;
+	enum lego_mode mode : 3;
+	bool address : 1;
+	uint8_t channel : 2;
+	bool escape : 1;
+	bool toggle : 1;
+} lego_packet_t;
+
+static inline uint16_t lego_packet_raw(const lego_packet_t *pkt) {
+	uint16_t praw;
+	memcpy(&praw, pkt, sizeof(praw));
+	return praw;
+}
+
+static inline uint8_t get_packet_checksum(lego_packet_t *pkt) {
+	uint16_t praw = lego_packet_raw(pkt);
+	uint8_t ret = 0xf;
+	ret ^= (praw >> 12) & 0xf;
+	ret ^= (praw >> 8) & 0xf;
+	ret ^= (praw >> 4) & 0xf;
+	return ret;
+}
+
+static inline bool lego_packet_is_combo_direct(const lego_packet_t *pkt) {
+	return !pkt->escape && !pkt->address &&
+		   (pkt->mode == LEGO_MODE_EXTENDED || pkt->mode == LEGO_MODE_COMBO_DIRECT);
+}
+
+// Fill in the fields the sender is not expected to care about and the
+// checksum. For combo direct packets that is the mode and the toggle bit,
+// which the remote sets on single key presses. Other modes are taken as is.
+static inline lego_packet_t lego_packet_prepare(lego_packet_t p) {
+	if (lego_packet_is_combo_direct(&p)) {
+		p.mode = LEGO_MODE_COMBO_DIRECT;
+		switch (p.key) {
+		case LEGO_LF:
+		case LEGO_LB:
+		case LEGO_RF:
+		case LEGO_RB:
+			p.toggle = true;
+			break;
+		default:
+			p.toggle = false;
+			break;
+		}
+	}
+	p.checksum = get_packet_checksum(&p);
+	return p;
+}
+
+static inline lego_packet_t lego_packet_from_raw(uint16_t raw) {
+	lego_packet_t p;
+	memcpy(&p, &raw, sizeof(p));
+	return p;
+}
+
+// Speed step for -LEGO_PWM_STEPS..LEGO_PWM_STEPS, out of range values are
+// clamped. 0 floats the output, use LEGO_PWM_BRAKE to stop it hard.
+static inline uint8_t lego_pwm_step(int8_t speed) {
+	if (speed > LEGO_PWM_STEPS) {
+		speed = LEGO_PWM_STEPS;
+	} else if (speed < -LEGO_PWM_STEPS) {
+		speed = -LEGO_PWM_STEPS;
+	}
+	return speed >= 0 ? speed : 0x10 + speed;
+}
+
+// Single output PWM: one output of the channel at `step` (see lego_pwm_step()),
+// the other one keeps its state. The receiver ignores a repeat of the same
+// command unless `toggle` differs from the previous one.
+static inline lego_packet_t
+lego_packet_pwm(uint8_t channel, bool output_b, uint8_t step, bool toggle) {
+	return lego_packet_prepare((lego_packet_t){
+		.toggle = toggle,
+		.channel = channel,
+		.mode = output_b ? LEGO_MODE_PWM_B : LEGO_MODE_PWM_A,
+		.key = step & 0xf,
+	});
+}
+
+// Combo PWM: both outputs of the channel in a single frame.
+static inline lego_packet_t lego_packet_combo_pwm(uint8_t channel, uint8_t step_a, uint8_t step_b) {
+	const uint16_t raw =
+		(1 << 14) | ((channel & 0x3) << 12) | ((step_b & 0xf) << 8) | ((step_a & 0xf) << 4);
+	return lego_packet_prepare(lego_packet_from_raw(raw));
+}
+
+// The packet goes on the air MSB first, so the bytes are swapped to feed a
+// little-endian word into an MSB-first bytes encoder.
+static inline uint16_t lego_packet_wire(const lego_packet_t *pkt) {
+	const uint16_t pkt_raw = lego_packet_raw(pkt);
+	return (pkt_raw >> 8) | (pkt_raw << 8);
+}
+
+#define LEGO_STOP_PACKET(ch)                                                                       \
+	(lego_packet_t) { .channel = ch, .key = 0 }
+
+#endif
@@ -0,0 +1,66 @@
+#include "lego_pid.h"
+
+#define LEGO_PID_ONE (1 << LEGO_PID_SHIFT)
+
+void lego_pid_init(lego_pid_t *pid, const lego_pid_config_t *config) {
+	pid->config = *config;
+	lego_pid_reset(pid);
+}
+
+void lego_pid_reset(lego_pid_t *pid) {
+	pid->integral = 0;
+	pid->speed = 0;
+	pid->primed = false;
+	pid->step = 0;
+}
+
+static int64_t lego_pid_clamp(int64_t value, int64_t limit) {
+	return value > limit ? limit : value < -limit ? -limit : value;
+}
+
+int8_t lego_pid_update(lego_pid_t *pid, uint32_t mm, uint32_t stamp_us) {
+	const lego_pid_config_t *cfg = &pid->config;
+	if (!pid->primed) {
+		pid->primed = true;
+		pid->last_us = stamp_us;
+		pid->speed_mm = mm;
+		pid->speed_us = stamp_us;
+	}
+	int32_t error = (int32_t)mm - (int32_t)cfg->setpoint_mm;
+	if (error <= (int32_t)cfg->deadband_mm && error >= -(int32_t)cfg->deadband_mm) {
+		error = 0;
+	}
+	const uint32_t dt_us = stamp_us - pid->last_us;
+	pid->last_us = stamp_us;
+
+	// Rate of change of the error, the setpoint doesn't kick it
+	const uint32_t span_us = stamp_us - pid->speed_us;
+	if (span_us >= LEGO_PID_SPEED_WINDOW_US) {
+		pid->speed = ((int64_t)mm - pid->speed_mm) * 1000000 / span_us;
+		pid->speed_mm = mm;
+		pid->speed_us = stamp_us;
+	}
+
+	const int64_t limit = (int64_t)cfg->max_step * LEGO_PID_ONE;
+	const int64_t p = (int64_t)cfg->kp * error;
+	const int64_t d = (int64_t)cfg->kd * pid->speed;
+	int64_t integral = pid->integral + (int64_t)error * dt_us / 1000;
+	if (cfg->ki != 0) {
+		// The I term alone never saturates the output
+		const int64_t max_integral = limit * 1000 / cfg->ki;
+		integral = lego_pid_clamp(integral, max_integral);
+	}
+	int64_t out = p + d + (int64_t)cfg->ki * integral / 1000;
+	// No winding up while saturated in the direction of the error
+	if (!((out > limit && error > 0) || (out < -limit && error < 0))) {
+		pid->integral = integral;
+	}
+	out = lego_pid_clamp(p + d + (int64_t)cfg->ki * pid->integral / 1000, limit);
+
+	const int64_t from_step = out - (int64_t)pid->step * LEGO_PID_ONE;
+	if (from_step > LEGO_PID_ONE / 2 + cfg->hysteresis ||
+		from_step < -(LEGO_PID_ONE / 2 + cfg->hysteresis)) {
+		pid->step = (out + (out >= 0 ? LEGO_PID_ONE / 2 : -LEGO_PID_ONE / 2)) / LEGO_PID_ONE;
+	}
+	return pid->step;
+}
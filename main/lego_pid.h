@@ -0,0 +1,55 @@
+#ifndef LEGO_PID_INCLUDED
+#define LEGO_PID_INCLUDED
+
+// Distance controller: a PID loop from the filtered HC-SR04 distance to a PF
+// PWM speed step. It runs once per sample, whatever the sample rate, so the
+// terms are scaled by the time between samples. The output only moves to
+// another step past a hysteresis band, so a steady distance sends nothing.
+// Integer only. Plain C, buildable on the host.
+
+#include <stdbool.h>
+#include <stdint.h>
+
+// Gains and outputs are in speed steps << LEGO_PID_SHIFT
+#define LEGO_PID_SHIFT 16
+// The closing speed for the D term is taken over at least this long, a
+// shorter span is mostly quantization noise at hundreds of samples per second
+#define LEGO_PID_SPEED_WINDOW_US 50000
+
+typedef struct {
+	uint32_t setpoint_mm;
+	// Steps per mm of error, per mm·s of accumulated error and per mm/s of
+	// closing speed. Positive steps drive towards the target.
+	int32_t kp;
+	int32_t ki;
+	int32_t kd;
+	// Errors this small count as none
+	uint32_t deadband_mm;
+	// Added to the half step the output has to cross before it changes
+	int32_t hysteresis;
+	// Largest step sent, up to LEGO_PWM_STEPS
+	int8_t max_step;
+} lego_pid_config_t;
+
+typedef struct {
+	lego_pid_config_t config;
+	// Error integrated over time in mm·ms
+	int64_t integral;
+	uint32_t last_us;
+	// Start of the window the closing speed is measured over
+	uint32_t speed_mm;
+	uint32_t speed_us;
+	int32_t speed;
+	bool primed;
+	int8_t step;
+} lego_pid_t;
+
+void lego_pid_init(lego_pid_t *pid, const lego_pid_config_t *config);
+
+// Starts over from a standstill, e.g. after a manual override
+void lego_pid_reset(lego_pid_t *pid);
+
+// Takes a filtered sample and returns the step to drive at, -max_step..max_step
+int8_t lego_pid_update(lego_pid_t *pid, uint32_t mm, uint32_t stamp_us);
+
+#endif
@@ -0,0 +1,34 @@
+#include "lego_range.h"
+
+uint32_t lego_range_scale(uint32_t tick_hz) {
+	// 1 / (tick_hz / 1e6) / 5.8, kept in integers
+	return ((uint64_t)10000000 << LEGO_RANGE_SCALE_SHIFT) / ((uint64_t)tick_hz * 58);
+}
+
+static uint32_t lego_range_median(const uint32_t *values, uint8_t n) {
+	uint32_t sorted[LEGO_RANGE_MEDIAN];
+	for (uint8_t i = 0; i < n; i++) {
+		uint8_t j = i;
+		for (; j > 0 && sorted[j - 1] > values[i]; j--) {
+			sorted[j] = sorted[j - 1];
+		}
+		sorted[j] = values[i];
+	}
+	return sorted[n / 2];
+}
+
+uint32_t lego_range_filter(lego_range_filter_t *filter, uint32_t mm) {
+	filter->window[filter->next] = mm;
+	filter->next = (filter->next + 1) % LEGO_RANGE_MEDIAN;
+	if (filter->n < LEGO_RANGE_MEDIAN) {
+		filter->n++;
+	}
+	const uint32_t median = lego_range_median(filter->window, filter->n);
+	if (filter->n == 1) {
+		filter->ema = median << LEGO_RANGE_EMA_SHIFT;
+	} else {
+		// ema += median - ema / 2^shift, in the scaled domain
+		filter->ema = filter->ema - (filter->ema >> LEGO_RANGE_EMA_SHIFT) + median;
+	}
+	return (filter->ema + (1 << (LEGO_RANGE_EMA_SHIFT - 1))) >> LEGO_RANGE_EMA_SHIFT;
+}
@@ -0,0 +1,93 @@
+#ifndef LEGO_RANGE_INCLUDED
+#define LEGO_RANGE_INCLUDED
+
+// HC-SR04 ranging without floats or locks. The capture ISR turns the echo
+// width into mm with a precomputed fixed-point scale and pushes it to a
+// single-producer/single-consumer ring, like lego_ring.h. The task drains the
+// ring through a median and EMA filter. Plain C, buildable on the host.
+
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+// Must be a power of two
+#define LEGO_RANGE_RING_SIZE 32
+// Odd, the median of the last samples knocks out single spikes
+#define LEGO_RANGE_MEDIAN 5
+// The EMA moves 1 / 2^LEGO_RANGE_EMA_SHIFT of the way per sample
+#define LEGO_RANGE_EMA_SHIFT 2
+// The sensor's rated range. A missing echo reads as ~38 ms, far beyond.
+#define LEGO_RANGE_MAX_MM 4000
+#define LEGO_RANGE_SCALE_SHIFT 24
+
+typedef struct {
+	// Falling edge of the echo, low 32 bits in us
+	uint32_t stamp_us;
+	uint32_t mm;
+} lego_range_sample_t;
+
+typedef struct {
+	lego_range_sample_t samples[LEGO_RANGE_RING_SIZE];
+	// Free-running counters, the slot is the counter modulo LEGO_RANGE_RING_SIZE
+	_Atomic uint32_t head;
+	_Atomic uint32_t tail;
+	// Samples lost to a full ring, written by the producer
+	_Atomic uint32_t dropped;
+} lego_range_ring_t;
+
+typedef struct {
+	uint32_t window[LEGO_RANGE_MEDIAN];
+	uint8_t n;
+	uint8_t next;
+	// mm << LEGO_RANGE_EMA_SHIFT
+	uint32_t ema;
+} lego_range_filter_t;
+
+// mm per capture tick in Q24 for a capture clock of `tick_hz`. Sound takes
+// 5.8 us per mm there and back.
+uint32_t lego_range_scale(uint32_t tick_hz);
+
+static inline uint32_t lego_range_mm(uint32_t ticks, uint32_t scale) {
+	return ((uint64_t)ticks * scale) >> LEGO_RANGE_SCALE_SHIFT;
+}
+
+static inline void lego_range_ring_init(lego_range_ring_t *ring) {
+	atomic_init(&ring->head, 0);
+	atomic_init(&ring->tail, 0);
+	atomic_init(&ring->dropped, 0);
+}
+
+// Producer side, safe from an ISR. A full ring keeps its older samples.
+static inline bool lego_range_push(lego_range_ring_t *ring, uint32_t stamp_us, uint32_t mm) {
+	const uint32_t head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+	const uint32_t tail = atomic_load_explicit(&ring->tail, memory_order_acquire);
+	if (head - tail == LEGO_RANGE_RING_SIZE) {
+		atomic_fetch_add_explicit(&ring->dropped, 1, memory_order_relaxed);
+		return false;
+	}
+	ring->samples[head & (LEGO_RANGE_RING_SIZE - 1)] = (lego_range_sample_t){stamp_us, mm};
+	atomic_store_explicit(&ring->head, head + 1, memory_order_release);
+	return true;
+}
+
+// Consumer side
+static inline bool lego_range_pop(lego_range_ring_t *ring, lego_range_sample_t *sample) {
+	const uint32_t tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+	const uint32_t head = atomic_load_explicit(&ring->head, memory_order_acquire);
+	if (head == tail) {
+		return false;
+	}
+	*sample = ring->samples[tail & (LEGO_RANGE_RING_SIZE - 1)];
+	atomic_store_explicit(&ring->tail, tail + 1, memory_order_release);
+	return true;
+}
+
+static inline void lego_range_filter_init(lego_range_filter_t *filter) {
+	*filter = (lego_range_filter_t){0};
+}
+
+// Feeds one in-range sample and returns the filtered distance in mm. The
+// EMA starts at the first sample rather than ramping up from 0.
+uint32_t lego_range_filter(lego_range_filter_t *filter, uint32_t mm);
+
+#endif
@@ -0,0 +1,104 @@
+#ifndef LEGO_RING_INCLUDED
+#define LEGO_RING_INCLUDED
+
+// Bounded single-producer/single-consumer queue of packet steps. The producer
+// only writes head, the consumer only writes tail, so neither side takes a
+// lock. Plain C, buildable on the host.
+
+#include <stdatomic.h>
+#include <stdint.h>
+
+#include "lego_packet.h"
+
+// Must be a power of two
+#ifndef LEGO_RING_SIZE
+#define LEGO_RING_SIZE 256
+#endif
+
+// A packet sent `repeat` times back to back, or for `hold_ms` when that is not
+// zero. This is also the wire format of lego/cmd/batch, little-endian.
+typedef struct __attribute__((packed)) {
+	lego_packet_t packet;
+	// 0 is taken as 1
+	uint16_t repeat;
+	uint16_t hold_ms;
+} lego_step_t;
+
+typedef struct {
+	lego_step_t steps[LEGO_RING_SIZE];
+	// Ingest time of each step in us, owned like the step. The consumer sets
+	// it to 0 once the first copy is out.
+	uint32_t stamps[LEGO_RING_SIZE];
+	// Free-running counters, the slot is the counter modulo LEGO_RING_SIZE
+	_Atomic uint32_t head;
+	_Atomic uint32_t tail;
+} lego_ring_t;
+
+static inline uint32_t lego_ring_count(lego_ring_t *ring) {
+	const uint32_t head = atomic_load_explicit(&ring->head, memory_order_acquire);
+	const uint32_t tail = atomic_load_explicit(&ring->tail, memory_order_acquire);
+	return head - tail;
+}
+
+static inline uint32_t lego_ring_free(lego_ring_t *ring) {
+	return LEGO_RING_SIZE - lego_ring_count(ring);
+}
+
+// Producer side. Position of the next step to be pushed.
+static inline uint32_t lego_ring_head(lego_ring_t *ring) {
+	return atomic_load_explicit(&ring->head, memory_order_relaxed);
+}
+
+// Producer side. Copies as many steps as fit and returns that number, the
+// rest is left to the caller.
+static inline uint32_t
+lego_ring_push(lego_ring_t *ring, const lego_step_t *steps, uint32_t n, uint32_t stamp_us) {
+	const uint32_t head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+	const uint32_t tail = atomic_load_explicit(&ring->tail, memory_order_acquire);
+	const uint32_t space = LEGO_RING_SIZE - (head - tail);
+	if (n > space) {
+		n = space;
+	}
+	for (uint32_t i = 0; i < n; i++) {
+		ring->steps[(head + i) & (LEGO_RING_SIZE - 1)] = steps[i];
+		ring->stamps[(head + i) & (LEGO_RING_SIZE - 1)] = stamp_us;
+	}
+	atomic_store_explicit(&ring->head, head + n, memory_order_release);
+	return n;
+}
+
+// Consumer side. Returns the number of queued steps past `cursor` (a
+// position in the same free-running space as lego_ring_tail()) that are
+// contiguous in memory starting at *steps. They stay owned by the consumer,
+// and may be modified, until lego_ring_consume().
+static inline uint32_t
+lego_ring_peek_from(lego_ring_t *ring, uint32_t cursor, lego_step_t **steps) {
+	const uint32_t head = atomic_load_explicit(&ring->head, memory_order_acquire);
+	const uint32_t slot = cursor & (LEGO_RING_SIZE - 1);
+	uint32_t n = head - cursor;
+	if (n > LEGO_RING_SIZE - slot) {
+		n = LEGO_RING_SIZE - slot;
+	}
+	*steps = &ring->steps[slot];
+	return n;
+}
+
+static inline uint32_t lego_ring_tail(lego_ring_t *ring) {
+	return atomic_load_explicit(&ring->tail, memory_order_relaxed);
+}
+
+static inline uint32_t lego_ring_peek(lego_ring_t *ring, lego_step_t **steps) {
+	return lego_ring_peek_from(ring, lego_ring_tail(ring), steps);
+}
+
+// Stamp of the step at the head, valid while it has not been consumed
+static inline uint32_t *lego_ring_stamp(lego_ring_t *ring) {
+	return &ring->stamps[lego_ring_tail(ring) & (LEGO_RING_SIZE - 1)];
+}
+
+static inline void lego_ring_consume(lego_ring_t *ring, uint32_t n) {
+	const uint32_t tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+	atomic_store_explicit(&ring->tail, tail + n, memory_order_release);
+}
+
+#endif
@@ -0,0 +1,160 @@
+#include "lego_router.h"
+
+#include <string.h>
+
+// FNV-1a of the level, mixed with the parent so the edges of different
+// nodes spread over the table
+static uint32_t lego_router_hash(uint16_t parent, const char *level, uint32_t len) {
+	uint32_t hash = 2166136261u ^ parent;
+	for (uint32_t i = 0; i < len; i++) {
+		hash = (hash ^ (uint8_t)level[i]) * 16777619u;
+	}
+	return hash;
+}
+
+static lego_router_slot_t *
+lego_router_find(lego_router_t *router, uint16_t parent, const char *level, uint32_t len) {
+	const uint32_t hash = lego_router_hash(parent, level, len);
+	for (uint32_t i = 0; i < LEGO_ROUTER_SLOTS; i++) {
+		lego_router_slot_t *slot = &router->slots[(hash + i) & (LEGO_ROUTER_SLOTS - 1)];
+		if (slot->child == 0 || (slot->hash == hash && slot->parent == parent &&
+								 slot->len == len && memcmp(slot->level, level, len) == 0)) {
+			return slot;
+		}
+	}
+	return NULL;
+}
+
+static uint16_t lego_router_new_node(lego_router_t *router) {
+	if (router->nnodes == LEGO_ROUTER_MAX_NODES) {
+		return 0;
+	}
+	router->nodes[router->nnodes] = (lego_router_node_t){.wildcard = 0, .route = -1};
+	return router->nnodes++;
+}
+
+void lego_router_init(lego_router_t *router) {
+	memset(router, 0, sizeof(*router));
+	lego_router_new_node(router);
+}
+
+bool lego_router_add(
+	lego_router_t *router, const char *pattern, uint8_t qos, lego_route_fn_t fn, void *ctx) {
+	if (router->nroutes == LEGO_ROUTER_MAX_ROUTES) {
+		return false;
+	}
+	uint16_t node = 0;
+	const char *level = pattern;
+	for (;;) {
+		const char *end = strchr(level, '/');
+		const uint32_t len = end != NULL ? (uint32_t)(end - level) : strlen(level);
+		uint16_t next = 0;
+		if (len == 1 && level[0] == '+') {
+			next = router->nodes[node].wildcard;
+			if (next == 0) {
+				next = lego_router_new_node(router);
+				router->nodes[node].wildcard = next;
+			}
+		} else {
+			lego_router_slot_t *slot = lego_router_find(router, node, level, len);
+			if (slot == NULL) {
+				return false;
+			}
+			next = slot->child;
+			if (next == 0) {
+				next = lego_router_new_node(router);
+				*slot = (lego_router_slot_t){
+					.level = level,
+					.len = len,
+					.parent = node,
+					.child = next,
+					.hash = lego_router_hash(node, level, len),
+				};
+			}
+		}
+		if (next == 0) {
+			return false;
+		}
+		node = next;
+		if (end == NULL) {
+			break;
+		}
+		level = end + 1;
+	}
+	if (router->nodes[node].route >= 0) {
+		return false;
+	}
+	router->nodes[node].route = router->nroutes;
+	router->routes[router->nroutes++] = (lego_route_t){
+		.pattern = pattern,
+		.qos = qos,
+		.fn = fn,
+		.ctx = ctx,
+	};
+	return true;
+}
+
+// Route matching the topic from `start` on below `node`, -1 if none. Depth
+// first, the exact level before "+". A node only ever sits at one level, so
+// none is visited twice and the recursion is no deeper than the trie.
+static int16_t lego_router_match(
+	lego_router_t *router, uint16_t node, const char *topic, uint32_t topic_len, uint32_t start,
+	lego_route_args_t *args) {
+	// Past the last level
+	if (start > topic_len) {
+		return router->nodes[node].route;
+	}
+	uint32_t end = start;
+	while (end < topic_len && topic[end] != '/') {
+		end++;
+	}
+	const lego_router_slot_t *slot = lego_router_find(router, node, topic + start, end - start);
+	if (slot != NULL && slot->child != 0) {
+		const int16_t route =
+			lego_router_match(router, slot->child, topic, topic_len, end + 1, args);
+		if (route >= 0) {
+			return route;
+		}
+	}
+	const uint16_t wildcard = router->nodes[node].wildcard;
+	if (wildcard == 0 || args->n == LEGO_ROUTER_MAX_ARGS) {
+		return -1;
+	}
+	args->arg[args->n] = topic + start;
+	args->len[args->n++] = end - start;
+	const int16_t route = lego_router_match(router, wildcard, topic, topic_len, end + 1, args);
+	if (route < 0) {
+		// Taken back for the levels above to try "+"
+		args->n--;
+	}
+	return route;
+}
+
+bool lego_router_dispatch(lego_router_t *router, const char *topic, uint32_t topic_len, void *msg) {
+	lego_route_args_t args = {.n = 0};
+	const int16_t route = lego_router_match(router, 0, topic, topic_len, 0, &args);
+	if (route < 0) {
+		return false;
+	}
+	router->routes[route].fn(msg, &args, router->routes[route].ctx);
+	return true;
+}
+
+bool lego_route_arg_u32(const lego_route_args_t *args, uint8_t i, uint32_t *value) {
+	if (i >= args->n || args->len[i] == 0 || args->len[i] > 10) {
+		return false;
+	}
+	uint64_t v = 0;
+	for (uint16_t j = 0; j < args->len[i]; j++) {
+		const char c = args->arg[i][j];
+		if (c < '0' || c > '9') {
+			return false;
+		}
+		v = v * 10 + (c - '0');
+	}
+	if (v > UINT32_MAX) {
+		return false;
+	}
+	*value = v;
+	return true;
+}
@@ -0,0 +1,83 @@
+#ifndef LEGO_ROUTER_INCLUDED
+#define LEGO_ROUTER_INCLUDED
+
+// MQTT topic to handler dispatch. Routes are registered once, at startup,
+// into a trie of topic levels whose edges live in one hash table, so a
+// message costs a hash and a lookup per level whatever the number of
+// routes, and no allocations. A "+" level matches any one level and is
+// passed to the handler. Where an exact level and "+" both continue, the
+// exact one is tried first and "+" after it fails further down, which costs
+// at most a lookup per trie node. Plain C, buildable on the host.
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#define LEGO_ROUTER_MAX_ROUTES 32
+#define LEGO_ROUTER_MAX_NODES 128
+// Hash table of trie edges, a power of two well above LEGO_ROUTER_MAX_NODES
+#define LEGO_ROUTER_SLOTS 256
+#define LEGO_ROUTER_MAX_ARGS 4
+
+// Levels matched by "+", in topic order. They point into the topic and are
+// not terminated.
+typedef struct {
+	const char *arg[LEGO_ROUTER_MAX_ARGS];
+	uint16_t len[LEGO_ROUTER_MAX_ARGS];
+	uint8_t n;
+} lego_route_args_t;
+
+// `msg` is whatever was passed to lego_router_dispatch(), `ctx` whatever was
+// registered with the route
+typedef void (*lego_route_fn_t)(void *msg, const lego_route_args_t *args, void *ctx);
+
+typedef struct {
+	// Kept, not copied
+	const char *pattern;
+	uint8_t qos;
+	lego_route_fn_t fn;
+	void *ctx;
+} lego_route_t;
+
+typedef struct {
+	// Edge from `parent` by the level `level`
+	const char *level;
+	uint16_t len;
+	uint16_t parent;
+	uint16_t child;
+	uint32_t hash;
+} lego_router_slot_t;
+
+typedef struct {
+	// Node reached through "+", 0 if none
+	uint16_t wildcard;
+	// Route ending here, -1 if none
+	int16_t route;
+} lego_router_node_t;
+
+typedef struct {
+	lego_route_t routes[LEGO_ROUTER_MAX_ROUTES];
+	uint16_t nroutes;
+	// Node 0 is the root
+	lego_router_node_t nodes[LEGO_ROUTER_MAX_NODES];
+	uint16_t nnodes;
+	// Unused while `child` is 0
+	lego_router_slot_t slots[LEGO_ROUTER_SLOTS];
+} lego_router_t;
+
+void lego_router_init(lego_router_t *router);
+
+// Returns false when the tables are full or `pattern` is already taken.
+// Overlapping patterns are fine: with "a/+/c" and "a/b/d", "a/b/c" goes to
+// the former. When several match, the one with an exact level furthest to
+// the left wins, so "a/b/+" takes "a/b/c" over "a/+/c".
+bool lego_router_add(
+	lego_router_t *router, const char *pattern, uint8_t qos, lego_route_fn_t fn, void *ctx);
+
+// Calls the handler of `topic`, which need not be terminated. Returns false
+// if no route matches.
+bool lego_router_dispatch(lego_router_t *router, const char *topic, uint32_t topic_len, void *msg);
+
+// Argument `i` as a decimal number, false if it isn't one or doesn't fit
+bool lego_route_arg_u32(const lego_route_args_t *args, uint8_t i, uint32_t *value);
+
+#endif
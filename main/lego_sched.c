@@ -0,0 +1,172 @@
+#include "lego_sched.h"
+
+void lego_sched_init(lego_sched_t *sched, const lego_timing_config_t *timing) {
+	for (uint8_t ch = 0; ch < 4; ch++) {
+		atomic_init(&sched->queues[ch].head, 0);
+		atomic_init(&sched->queues[ch].tail, 0);
+		sched->hold_until_us[ch] = 0;
+		sched->holding[ch] = false;
+		sched->sent[ch] = 0;
+	}
+	lego_timing_init(&sched->model, timing);
+	sched->next_channel = 0;
+}
+
+uint32_t
+lego_sched_fill(lego_sched_t *sched, lego_packet_t *out, uint32_t max, uint32_t *ingest_us) {
+	uint32_t n = 0;
+	*ingest_us = 0;
+	while (n < max) {
+		int8_t best = -1;
+		uint64_t best_start = UINT64_MAX;
+		for (uint8_t i = 0; i < 4; i++) {
+			const uint8_t ch = (sched->next_channel + i) & 0x3;
+			lego_step_t *head = NULL;
+			if (lego_ring_peek(&sched->queues[ch], &head) == 0)
+				continue;
+			const uint64_t start = lego_timing_earliest_us(&sched->model, &head->packet);
+			if (start <= sched->model.now_us + sched->model.config.min_gap_us) {
+				best = ch;
+				break;
+			}
+			if (start < best_start) {
+				best_start = start;
+				best = ch;
+			}
+		}
+		if (best < 0)
+			break;
+
+		lego_step_t *step = NULL;
+		lego_ring_peek(&sched->queues[best], &step);
+		out[n] = step->packet;
+		uint32_t *stamp = lego_ring_stamp(&sched->queues[best]);
+		if (*stamp != 0 && (*ingest_us == 0 || (int32_t)(*stamp - *ingest_us) < 0)) {
+			*ingest_us = *stamp;
+		}
+		*stamp = 0;
+		lego_timing_schedule(&sched->model, &out[n]);
+
+		bool step_done;
+		if (step->hold_ms) {
+			if (!sched->holding[best]) {
+				// Counted from the start of the first copy
+				sched->hold_until_us[best] =
+					sched->model.last_start_us[best] + (uint64_t)step->hold_ms * 1000;
+				sched->holding[best] = true;
+			}
+			step_done = sched->model.now_us >= sched->hold_until_us[best];
+		} else if (step->repeat > 1) {
+			step->repeat--;
+			step_done = false;
+		} else {
+			step_done = true;
+		}
+		if (step_done) {
+			sched->holding[best] = false;
+			lego_ring_consume(&sched->queues[best], 1);
+		}
+
+		sched->sent[best]++;
+		sched->next_channel = (best + 1) & 0x3;
+		n++;
+	}
+	return n;
+}
+
+void lego_sched_account(lego_sched_t *sched, const lego_packet_t *pkts, uint32_t n) {
+	for (uint32_t i = 0; i < n; i++) {
+		lego_timing_schedule(&sched->model, &pkts[i]);
+	}
+}
+
+void lego_sched_resync(lego_sched_t *sched, const lego_timing_t *encoder, uint64_t now_us) {
+	sched->model = *encoder;
+	lego_timing_sync(&sched->model, now_us);
+}
+
+uint32_t lego_sched_push(
+	lego_sched_t *sched, const lego_step_t *steps, uint32_t n, uint32_t ingest_us) {
+	uint32_t accepted = 0;
+	bool full[4] = {false};
+	for (uint32_t i = 0; i < n; i++) {
+		const uint8_t ch = steps[i].packet.channel & 0x3;
+		if (!full[ch] && lego_ring_push(&sched->queues[ch], &steps[i], 1, ingest_us) == 1) {
+			accepted++;
+		} else {
+			full[ch] = true;
+		}
+	}
+	return accepted;
+}
+
+static uint32_t lego_sched_push_run(
+	lego_sched_t *sched, const lego_step_t *run, bool *full, uint32_t ingest_us) {
+	if (run->repeat == 0 || *full) {
+		return 0;
+	}
+	if (lego_ring_push(&sched->queues[run->packet.channel & 0x3], run, 1, ingest_us) == 1) {
+		return run->repeat;
+	}
+	*full = true;
+	return 0;
+}
+
+// Whether the run on its channel continues with `pkt`, as merged by
+// lego_sched_push_packets()
+static bool lego_sched_run_continues(const lego_step_t *run, const lego_packet_t *pkt) {
+	return run->repeat > 0 && run->repeat < UINT16_MAX &&
+		   lego_packet_raw(&run->packet) == lego_packet_raw(pkt);
+}
+
+uint32_t lego_sched_push_packets(
+	lego_sched_t *sched, const lego_packet_t *pkts, uint32_t n, uint32_t ingest_us) {
+	uint32_t accepted = 0;
+	bool full[4] = {false};
+	lego_step_t run[4] = {0};
+	for (uint32_t i = 0; i < n; i++) {
+		const uint8_t ch = pkts[i].channel & 0x3;
+		if (lego_sched_run_continues(&run[ch], &pkts[i])) {
+			run[ch].repeat++;
+			continue;
+		}
+		accepted += lego_sched_push_run(sched, &run[ch], &full[ch], ingest_us);
+		run[ch] = (lego_step_t){.packet = pkts[i], .repeat = 1};
+	}
+	for (uint8_t ch = 0; ch < 4; ch++) {
+		accepted += lego_sched_push_run(sched, &run[ch], &full[ch], ingest_us);
+	}
+	return accepted;
+}
+
+static bool lego_sched_room(lego_sched_t *sched, const uint32_t needed[4]) {
+	for (uint8_t ch = 0; ch < 4; ch++) {
+		if (needed[ch] > lego_ring_free(&sched->queues[ch])) {
+			return false;
+		}
+	}
+	return true;
+}
+
+bool lego_sched_fits(lego_sched_t *sched, const lego_step_t *steps, uint32_t n) {
+	uint32_t needed[4] = {0};
+	for (uint32_t i = 0; i < n; i++) {
+		needed[steps[i].packet.channel & 0x3]++;
+	}
+	return lego_sched_room(sched, needed);
+}
+
+bool lego_sched_fits_packets(lego_sched_t *sched, const lego_packet_t *pkts, uint32_t n) {
+	uint32_t needed[4] = {0};
+	lego_step_t run[4] = {0};
+	for (uint32_t i = 0; i < n; i++) {
+		const uint8_t ch = pkts[i].channel & 0x3;
+		if (lego_sched_run_continues(&run[ch], &pkts[i])) {
+			run[ch].repeat++;
+			continue;
+		}
+		run[ch] = (lego_step_t){.packet = pkts[i], .repeat = 1};
+		needed[ch]++;
+	}
+	return lego_sched_room(sched, needed);
+}
@@ -0,0 +1,77 @@
+#ifndef LEGO_SCHED_INCLUDED
+#define LEGO_SCHED_INCLUDED
+
+// Time-division scheduler that interleaves the four per-channel queues onto
+// the single IR LED. Plain C, buildable on the host.
+//
+// Channels take turns round-robin. A channel whose next packet has to wait
+// for its PF retransmit window (see lego_timing.h) is skipped in favour of
+// one that can go right away, so every channel with queued packets gets a
+// frame at least every 4 frames unless its own window holds it back.
+//
+// The queues hold lego_step_t, which are expanded into packets only as they
+// are handed out, so a long repeat costs one queue entry.
+
+#include <stdint.h>
+
+#include "lego_packet.h"
+#include "lego_ring.h"
+#include "lego_timing.h"
+
+typedef struct {
+	lego_ring_t queues[4];
+	// Mirrors the encoder's scheduler to know which channels are ready. Runs
+	// ahead of it by the transactions in flight.
+	lego_timing_t model;
+	uint8_t next_channel;
+	// End of the hold of the step at the head of each queue, once started
+	uint64_t hold_until_us[4];
+	bool holding[4];
+	// Packets handed out per channel, never reset
+	uint32_t sent[4];
+} lego_sched_t;
+
+void lego_sched_init(lego_sched_t *sched, const lego_timing_config_t *timing);
+
+// Consumer side: expands up to `max` packets out of the queues, in air order.
+// *ingest_us is the ingest time of the oldest step that started in `out`, 0
+// if all of them are continued.
+uint32_t
+lego_sched_fill(lego_sched_t *sched, lego_packet_t *out, uint32_t max, uint32_t *ingest_us);
+
+static inline uint32_t lego_sched_pending(lego_sched_t *sched) {
+	uint32_t n = 0;
+	for (uint8_t ch = 0; ch < 4; ch++) {
+		n += lego_ring_count(&sched->queues[ch]);
+	}
+	return n;
+}
+
+// Consumer side: tells the model about packets sent around the scheduler, in
+// the order they were submitted, so it keeps mirroring the encoder
+void lego_sched_account(lego_sched_t *sched, const lego_packet_t *pkts, uint32_t n);
+
+// Consumer side: replaces the model with the encoder's own timing, moved up to
+// `now_us` like the encoder does when it starts again. Only valid while no
+// transaction is in flight. Catches up with what accounting can't see, like
+// how long a hardware loop ran or the LED sat idle.
+void lego_sched_resync(lego_sched_t *sched, const lego_timing_t *encoder, uint64_t now_us);
+
+// Producer side: routes steps to the queue of their channel, keeping the
+// order within a channel. Once a channel's queue is full the rest of its
+// steps are rejected. Returns the number accepted. `ingest_us` must not be 0,
+// it is stamped on every step for the latency metrics.
+uint32_t lego_sched_push(
+	lego_sched_t *sched, const lego_step_t *steps, uint32_t n, uint32_t ingest_us);
+
+// Same for single packets. Runs of the same packet on a channel are merged
+// into one step. Returns the number of packets accepted.
+uint32_t lego_sched_push_packets(
+	lego_sched_t *sched, const lego_packet_t *pkts, uint32_t n, uint32_t ingest_us);
+
+// Producer side: whether all of the steps or packets would be accepted, for
+// callers that take a batch whole or not at all
+bool lego_sched_fits(lego_sched_t *sched, const lego_step_t *steps, uint32_t n);
+bool lego_sched_fits_packets(lego_sched_t *sched, const lego_packet_t *pkts, uint32_t n);
+
+#endif
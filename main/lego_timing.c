@@ -0,0 +1,73 @@
+#include "lego_timing.h"
+
+#include "lego_frame.h"
+
+void lego_timing_init(lego_timing_t *timing, const lego_timing_config_t *config) {
+	memset(timing, 0, sizeof(*timing));
+	timing->config = *config;
+}
+
+// The word on the air, what tells repeats apart
+static uint16_t lego_timing_word(const lego_packet_t *pkt) {
+	const lego_packet_t prepared = lego_packet_prepare(*pkt);
+	return lego_packet_raw(&prepared);
+}
+
+uint32_t lego_timing_frame_us(const lego_packet_t *pkt) {
+	const uint32_t ones = __builtin_popcount(lego_timing_word(pkt));
+	return 18 * LEGO_MARK_TICKS + LEGO_START_SPACE_TICKS + ones * LEGO_BIT1_SPACE_TICKS +
+		   (16 - ones) * LEGO_BIT0_SPACE_TICKS + LEGO_END_SPACE_TICKS;
+}
+
+uint64_t lego_timing_earliest_us(const lego_timing_t *timing, const lego_packet_t *pkt) {
+	const uint8_t ch = pkt->channel & 0x3;
+	if (!timing->config.retransmit_windows || timing->repeats[ch] == 0 ||
+		timing->last_raw[ch] != lego_timing_word(pkt)) {
+		return 0;
+	}
+	// Start to start distance before message number repeats + 1
+	const uint32_t window = timing->repeats[ch] < 3 ? 5 * LEGO_TIMING_TM_US
+													: (6 + 2 * (ch + 1)) * LEGO_TIMING_TM_US;
+	return timing->last_start_us[ch] + window;
+}
+
+uint32_t lego_timing_schedule(lego_timing_t *timing, const lego_packet_t *pkt) {
+	const uint8_t ch = pkt->channel & 0x3;
+	const uint16_t raw = lego_timing_word(pkt);
+	const uint64_t earliest = lego_timing_earliest_us(timing, pkt);
+
+	uint32_t gap = timing->config.min_gap_us;
+	if (earliest > timing->now_us + gap) {
+		gap = earliest - timing->now_us;
+	}
+	if (gap > LEGO_TIMING_GAP_MAX_US) {
+		gap = LEGO_TIMING_GAP_MAX_US;
+		timing->clamped++;
+	}
+
+	if (timing->repeats[ch] > 0 && timing->last_raw[ch] == raw) {
+		timing->repeats[ch]++;
+	} else {
+		timing->last_raw[ch] = raw;
+		timing->repeats[ch] = 1;
+	}
+	timing->last_start_us[ch] = timing->now_us + gap;
+	timing->now_us += gap + lego_timing_frame_us(pkt);
+	return gap;
+}
+
+void lego_timing_sync(lego_timing_t *timing, uint64_t now_us) {
+	if (now_us > timing->now_us) {
+		timing->now_us = now_us;
+	}
+}
+
+uint64_t lego_timing_sequence_us(
+	const lego_timing_config_t *config, const lego_packet_t *pkts, uint32_t npackets) {
+	lego_timing_t timing;
+	lego_timing_init(&timing, config);
+	for (uint32_t i = 0; i < npackets; i++) {
+		lego_timing_schedule(&timing, &pkts[i]);
+	}
+	return timing.now_us;
+}
@@ -0,0 +1,80 @@
+#ifndef LEGO_TIMING_INCLUDED
+#define LEGO_TIMING_INCLUDED
+
+// Inter-packet spacing. Plain C, buildable on the host, which makes it double
+// as a timing model: lego_timing_sequence_us() tells how long a sequence takes
+// on the air without transmitting it.
+//
+// Power Functions spacing rules: a remote sends each message up to 5 times,
+// the start of message 2 and 3 is 5 * Tm after the previous one and the start
+// of message 4 and 5 is (6 + 2 * Ch) * Tm after the previous one, where Tm is
+// the maximum message length (16 ms) and Ch the channel number (1..4). The
+// channel-dependent windows keep transmitters on different channels from
+// colliding forever. Different messages only need the stop bit in between.
+//
+// The windows are tracked per channel against a virtual air clock, so frames
+// of other channels can be slotted into a window instead of idling.
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "lego_packet.h"
+
+#define LEGO_TIMING_TM_US 16000
+// Longest idle time a single gap can take, see lego_frame_gap()
+#define LEGO_TIMING_GAP_SYMBOLS 4
+#define LEGO_TIMING_GAP_MAX_US (LEGO_TIMING_GAP_SYMBOLS * 2 * 32767)
+
+typedef struct {
+	// Idle time before every frame, on top of the previous stop bit
+	uint32_t min_gap_us;
+	// Space repeated frames on the same channel like a PF remote does
+	bool retransmit_windows;
+} lego_timing_config_t;
+
+typedef struct {
+	lego_timing_config_t config;
+	// Air time scheduled so far, the end of the last frame. Starts at 0,
+	// lego_timing_sync() takes it to the caller's time base.
+	uint64_t now_us;
+	// Per channel: the last frame as prepared for the air, when it started
+	// and how many times in a row it was sent
+	uint16_t last_raw[4];
+	uint64_t last_start_us[4];
+	uint32_t repeats[4];
+	// Gaps cut short to LEGO_TIMING_GAP_MAX_US, never reset
+	uint32_t clamped;
+} lego_timing_t;
+
+void lego_timing_init(lego_timing_t *timing, const lego_timing_config_t *config);
+
+// Air time of a frame, start bit to the end of the stop bit
+uint32_t lego_timing_frame_us(const lego_packet_t *pkt);
+
+// Earliest start of `pkt` its channel window allows, 0 when there is none
+uint64_t lego_timing_earliest_us(const lego_timing_t *timing, const lego_packet_t *pkt);
+
+// Idle time to leave before `pkt`, at most LEGO_TIMING_GAP_MAX_US with
+// longer ones counted in `clamped`. Advances the clock past the frame and
+// updates the channel window, so it must be called exactly once per
+// transmitted frame.
+uint32_t lego_timing_schedule(lego_timing_t *timing, const lego_packet_t *pkt);
+
+// Moves the clock up to `now_us` if it fell behind, which it does whenever
+// the LED sat idle for longer than scheduled, e.g. after the queue drained.
+// Windows that ran out in the meantime are then not waited for again. A
+// clock that is ahead, with frames still queued for the air, is left alone.
+void lego_timing_sync(lego_timing_t *timing, uint64_t now_us);
+
+// Total air time of a sequence, including gaps, starting from a fresh
+// scheduler
+uint64_t lego_timing_sequence_us(
+	const lego_timing_config_t *config, const lego_packet_t *pkts, uint32_t npackets);
+
+static inline uint32_t lego_timing_packets_per_sec(
+	const lego_timing_config_t *config, const lego_packet_t *pkts, uint32_t npackets) {
+	const uint64_t us = lego_timing_sequence_us(config, pkts, npackets);
+	return us == 0 ? 0 : (uint32_t)((uint64_t)npackets * 1000000 / us);
+}
+
+#endif
@@ -0,0 +1,167 @@
+#ifndef LEGO_TRACE_INCLUDED
+#define LEGO_TRACE_INCLUDED
+
+// Binary trace ring for the TX and RX paths, in place of ESP_LOGI there. A
+// write is a cycle count, an event id and a 16-bit payload, from any task or
+// ISR on either core. A low priority task drains it and publishes the records
+// as they are, tools/trace_decode.c turns them back into log lines. Plain C,
+// buildable on the host.
+
+#include <stdatomic.h>
+#include <stdint.h>
+
+#ifdef ESP_PLATFORM
+#include "esp_cpu.h"
+#else
+#include <time.h>
+#endif
+
+// Power of two
+#define LEGO_TRACE_SIZE 512
+#define LEGO_TRACE_MAGIC 0x4352544c // "LTRC"
+#define LEGO_TRACE_VERSION 1
+
+// X(id, name, payload is a raw lego_packet_t)
+#define LEGO_TRACE_EVENTS(X)                                                                       \
+	/* Packets in the transaction */                                                               \
+	X(TX_SUBMIT, "tx_submit", false)                                                               \
+	/* Transactions completed so far, low 16 bits */                                               \
+	X(TX_DONE, "tx_done", false)                                                                   \
+	/* Keys now looped by the RMT, 4 bits per channel, 0 on release */                             \
+	X(TX_HOLD, "tx_hold", false)                                                                   \
+	X(TX_PACKET, "tx_packet", true)                                                                \
+	X(RX_PACKET, "rx_packet", true)                                                                \
+	/* Decoded packets dropped so far */                                                           \
+	X(RX_DROPPED, "rx_dropped", false)                                                             \
+	/* Commands taken from lego/cmd/append or lego/cmd/batch */                                    \
+	X(CMD_ACCEPTED, "cmd_accepted", false)                                                         \
+	X(CMD_REJECTED, "cmd_rejected", false)                                                         \
+	/* Keys acted on from lego/button */                                                           \
+	X(BUTTONS, "buttons", false)                                                                   \
+	/* rmt_receive() failed in the receive callback, failures so far */                            \
+	X(RX_STOPPED, "rx_stopped", false)                                                             \
+	/* Gaps the encoder cut short to LEGO_TIMING_GAP_MAX_US so far */                              \
+	X(TX_GAP_CLAMPED, "tx_gap_clamped", false)
+
+#define LEGO_TRACE_ENUM(id, name, is_packet) LEGO_TRACE_##id,
+enum lego_trace_event { LEGO_TRACE_EVENTS(LEGO_TRACE_ENUM) LEGO_TRACE_EVENT_COUNT };
+#undef LEGO_TRACE_ENUM
+
+// What goes out on esp/1/trace, little-endian: a header, then `count`
+// records.
+typedef struct {
+	// Write number + 1, gaps are lost records
+	uint32_t seq;
+	// CPU cycles on `core`
+	uint32_t cycles;
+	uint8_t event;
+	uint8_t core;
+	uint16_t payload;
+} lego_trace_record_t;
+
+typedef struct {
+	uint32_t magic;
+	uint16_t version;
+	uint16_t cpu_mhz;
+	// Records overwritten before they were drained, since boot
+	uint32_t lost;
+	uint16_t count;
+	uint8_t cores;
+	uint8_t reserved;
+	// Cycle count and esp_timer time read together on each core after the
+	// records were drained, to put them on one time line
+	struct {
+		int64_t us;
+		uint32_t cycles;
+		uint32_t reserved;
+	} sync[2];
+} lego_trace_header_t;
+
+typedef struct {
+	// Published once the rest of the slot is written
+	_Atomic uint32_t seq;
+	uint32_t cycles;
+	uint8_t event;
+	uint8_t core;
+	uint16_t payload;
+} lego_trace_slot_t;
+
+// Any number of writers, one reader. Writers never wait, a full ring
+// overwrites its oldest records.
+typedef struct {
+	lego_trace_slot_t slots[LEGO_TRACE_SIZE];
+	_Atomic uint32_t head;
+	// Reader side
+	uint32_t tail;
+	uint32_t lost;
+} lego_trace_t;
+
+#ifdef ESP_PLATFORM
+#define LEGO_TRACE_CYCLES() esp_cpu_get_cycle_count()
+#define LEGO_TRACE_CORE() esp_cpu_get_core_id()
+#else
+static inline uint32_t lego_trace_host_cycles(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+#define LEGO_TRACE_CYCLES() lego_trace_host_cycles()
+#define LEGO_TRACE_CORE() 0
+#endif
+
+static inline void lego_trace_init(lego_trace_t *trace) {
+	for (uint32_t i = 0; i < LEGO_TRACE_SIZE; i++) {
+		atomic_init(&trace->slots[i].seq, 0);
+	}
+	atomic_init(&trace->head, 0);
+	trace->tail = 0;
+	trace->lost = 0;
+}
+
+static inline void lego_trace(lego_trace_t *trace, enum lego_trace_event event, uint16_t payload) {
+	const uint32_t index = atomic_fetch_add_explicit(&trace->head, 1, memory_order_relaxed);
+	lego_trace_slot_t *slot = &trace->slots[index % LEGO_TRACE_SIZE];
+	// Invalid while it is being written
+	atomic_store_explicit(&slot->seq, 0, memory_order_relaxed);
+	atomic_thread_fence(memory_order_release);
+	slot->cycles = LEGO_TRACE_CYCLES();
+	slot->event = event;
+	slot->core = LEGO_TRACE_CORE();
+	slot->payload = payload;
+	atomic_store_explicit(&slot->seq, index + 1, memory_order_release);
+}
+
+// Copies up to `max` records in write order. Stops at a slot that is still
+// being written, a slot overwritten while it was copied counts as lost.
+static inline uint32_t
+lego_trace_drain(lego_trace_t *trace, lego_trace_record_t *out, uint32_t max) {
+	const uint32_t head = atomic_load_explicit(&trace->head, memory_order_acquire);
+	if (head - trace->tail > LEGO_TRACE_SIZE) {
+		trace->lost += head - trace->tail - LEGO_TRACE_SIZE;
+		trace->tail = head - LEGO_TRACE_SIZE;
+	}
+	uint32_t count = 0;
+	for (; trace->tail != head && count < max; trace->tail++) {
+		lego_trace_slot_t *slot = &trace->slots[trace->tail % LEGO_TRACE_SIZE];
+		const uint32_t seq = atomic_load_explicit(&slot->seq, memory_order_acquire);
+		lego_trace_record_t *record = &out[count];
+		record->seq = seq;
+		record->cycles = slot->cycles;
+		record->event = slot->event;
+		record->core = slot->core;
+		record->payload = slot->payload;
+		atomic_thread_fence(memory_order_acquire);
+		if ((int32_t)(seq - (trace->tail + 1)) < 0) {
+			break;
+		}
+		if (seq != trace->tail + 1 ||
+			atomic_load_explicit(&slot->seq, memory_order_relaxed) != seq) {
+			trace->lost++;
+			continue;
+		}
+		count++;
+	}
+	return count;
+}
+
+#endif
@@ -0,0 +1,94 @@
+#include "lego_window.h"
+
+#include <string.h>
+
+void lego_window_init(lego_window_t *window) {
+	memset(window->entries, 0, sizeof(window->entries));
+	atomic_init(&window->head, 0);
+	atomic_init(&window->tail, 0);
+	window->newest = 0;
+	window->started = false;
+	memset(window->seen, 0, sizeof(window->seen));
+}
+
+static inline bool lego_window_bit(const lego_window_t *window, uint32_t behind) {
+	return window->seen[behind / 32] & (1u << (behind % 32));
+}
+
+bool lego_window_seen(const lego_window_t *window, uint16_t seq) {
+	const uint16_t behind = window->newest - seq;
+	return window->started && behind < LEGO_WINDOW_REPLAY_BITS && lego_window_bit(window, behind);
+}
+
+// Marks `seq`, sliding the window forward when it is the newest
+static void lego_window_mark(lego_window_t *window, uint16_t seq) {
+	const uint16_t ahead = seq - window->newest;
+	const uint16_t behind = window->newest - seq;
+	if (window->started && ahead != 0 && ahead < 0x8000 && ahead < LEGO_WINDOW_REPLAY_BITS) {
+		// Newer, everything seen so far moves `ahead` bits further behind
+		uint32_t seen[LEGO_WINDOW_REPLAY_BITS / 32] = {0};
+		for (uint32_t i = 0; i + ahead < LEGO_WINDOW_REPLAY_BITS; i++) {
+			if (lego_window_bit(window, i)) {
+				seen[(i + ahead) / 32] |= 1u << ((i + ahead) % 32);
+			}
+		}
+		memcpy(window->seen, seen, sizeof(seen));
+		window->newest = seq;
+	} else if (!window->started || (ahead != 0 && behind >= LEGO_WINDOW_REPLAY_BITS)) {
+		// First one, far ahead, or from a restarted client
+		memset(window->seen, 0, sizeof(window->seen));
+		window->newest = seq;
+		window->started = true;
+	}
+	const uint16_t bit = window->newest - seq;
+	window->seen[bit / 32] |= 1u << (bit % 32);
+}
+
+void lego_window_open(
+	lego_window_t *window, lego_sched_t *sched, uint16_t seq, uint32_t ingest_us) {
+	lego_window_mark(window, seq);
+	const uint32_t head = atomic_load_explicit(&window->head, memory_order_relaxed);
+	lego_window_entry_t *entry = &window->entries[head % LEGO_WINDOW_SIZE];
+	entry->seq = seq;
+	for (uint8_t ch = 0; ch < 4; ch++) {
+		entry->end[ch] = lego_ring_head(&sched->queues[ch]);
+	}
+	entry->ingest_us = ingest_us;
+	entry->tx_mark = 0;
+	entry->done = false;
+	atomic_store_explicit(&window->head, head + 1, memory_order_release);
+}
+
+uint32_t lego_window_poll(
+	lego_window_t *window, lego_sched_t *sched, uint32_t submitted, uint32_t completed,
+	lego_window_done_t *out, uint32_t max) {
+	const uint32_t head = atomic_load_explicit(&window->head, memory_order_acquire);
+	uint32_t tail = atomic_load_explicit(&window->tail, memory_order_relaxed);
+	uint32_t count = 0;
+	for (uint32_t i = tail; i != head; i++) {
+		lego_window_entry_t *entry = &window->entries[i % LEGO_WINDOW_SIZE];
+		if (entry->tx_mark == 0) {
+			bool queued = false;
+			for (uint8_t ch = 0; ch < 4; ch++) {
+				queued |= (int32_t)(lego_ring_tail(&sched->queues[ch]) - entry->end[ch]) < 0;
+			}
+			if (queued) {
+				continue;
+			}
+			// Its last packet went out with one of these, 0 is taken by "not
+			// yet", which costs a wrap-around one extra transaction at most
+			entry->tx_mark = submitted != 0 ? submitted : 1;
+		}
+		entry->done |= (int32_t)(completed - entry->tx_mark) >= 0;
+	}
+	// Reported in order, a batch on a busy channel holds back the later ones
+	for (; tail != head && count < max; tail++) {
+		lego_window_entry_t *entry = &window->entries[tail % LEGO_WINDOW_SIZE];
+		if (!entry->done) {
+			break;
+		}
+		out[count++] = (lego_window_done_t){.seq = entry->seq, .ingest_us = entry->ingest_us};
+	}
+	atomic_store_explicit(&window->tail, tail, memory_order_release);
+	return count;
+}
@@ -0,0 +1,70 @@
+#ifndef LEGO_WINDOW_INCLUDED
+#define LEGO_WINDOW_INCLUDED
+
+// Numbered command batches from lego/cmd/append/<seq> and
+// lego/cmd/batch/<seq>: which ones were already taken, so a redelivered one
+// is not queued twice, and which ones are still on their way to the LED.
+// The MQTT task opens batches, lego_controller closes them, so like
+// lego_ring.h neither side takes a lock. Plain C, buildable on the host.
+
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "lego_sched.h"
+
+// Batches a client can have outstanding, must be a power of two
+#define LEGO_WINDOW_SIZE 16
+// Sequence numbers remembered behind the newest one. Anything older is a
+// restarted client, as in lego_mailbox.h.
+#define LEGO_WINDOW_REPLAY_BITS 256
+
+typedef struct {
+	uint16_t seq;
+	// Queue heads right after the batch was pushed, it has left a queue once
+	// the tail gets there
+	uint32_t end[4];
+	uint32_t ingest_us;
+	// Transactions submitted when the last step left the queues, 0 before
+	uint32_t tx_mark;
+	bool done;
+} lego_window_entry_t;
+
+typedef struct {
+	uint16_t seq;
+	uint32_t ingest_us;
+} lego_window_done_t;
+
+typedef struct {
+	lego_window_entry_t entries[LEGO_WINDOW_SIZE];
+	_Atomic uint32_t head;
+	_Atomic uint32_t tail;
+	// Producer side: bit i is sequence number newest - i
+	uint16_t newest;
+	bool started;
+	uint32_t seen[LEGO_WINDOW_REPLAY_BITS / 32];
+} lego_window_t;
+
+void lego_window_init(lego_window_t *window);
+
+// Producer side. True if `seq` was already opened.
+bool lego_window_seen(const lego_window_t *window, uint16_t seq);
+
+static inline uint32_t lego_window_outstanding(lego_window_t *window) {
+	return atomic_load_explicit(&window->head, memory_order_acquire) -
+		   atomic_load_explicit(&window->tail, memory_order_acquire);
+}
+
+// Producer side, after the batch went into the queues of `sched`. Expects
+// lego_window_outstanding() < LEGO_WINDOW_SIZE.
+void lego_window_open(
+	lego_window_t *window, lego_sched_t *sched, uint16_t seq, uint32_t ingest_us);
+
+// Consumer side. `submitted` and `completed` count RMT transactions. Stores
+// up to `max` batches whose last packet is now off the LED, in the order
+// they were opened, and returns how many.
+uint32_t lego_window_poll(
+	lego_window_t *window, lego_sched_t *sched, uint32_t submitted, uint32_t completed,
+	lego_window_done_t *out, uint32_t max);
+
+#endif
@@ -9,7 +9,6 @@
 #include "esp_event.h"
 #include "esp_log.h"
 #include "esp_netif.h"
-#include "esp_private/esp_clk.h"
 #include "esp_timer.h"
 #include "nvs_flash.h"
 
@@ -20,8 +19,12 @@
 #include "defs.h"
 #include "lego_encoder.h"
 
+#include "input.h"
 #include "ir.h"
+#include "jitter_bench.h"
 #include "networking.h"
+#include "nes.h"
+#include "telemetry.h"
 
 static esp_err_t publish_led_state(void) {
 	esp_err_t err;
@@ -34,141 +37,8 @@ static esp_err_t publish_led_state(void) {
 	return err;
 }
 
-// Basic anti-glitch GPIO filter using timer
-static void gpio_isr_handler(void *data) {
-	uint32_t period = 100 * 1e3;
-	if (esp_timer_is_active(gpio_glitch_timer_handle)) {
-		ESP_ERROR_CHECK(esp_timer_restart(gpio_glitch_timer_handle, period));
-	} else {
-		ESP_ERROR_CHECK(esp_timer_start_once(gpio_glitch_timer_handle, period));
-	}
-}
-
-static void gpio_glitch_timer_callback(void *arg) {
-	gpio_num_t gpio = (gpio_num_t)arg;
-	if (!gpio_get_level(gpio)) {
-		xEventGroupSetBitsFromISR(egroup, GPIO_BTN_DOWN_BIT, NULL);
-	} else {
-		xEventGroupSetBitsFromISR(egroup, GPIO_BTN_UP_BIT, NULL);
-	}
-}
-
-static void button_task_fn(void *arg) {
-	for (;;) {
-		if (xEventGroupWaitBits(egroup, GPIO_BTN_DOWN_BIT | GPIO_BTN_UP_BIT, true, false, 1000) ==
-			0)
-			continue;
-		ESP_LOGI("lego:button", "GPIO0=%u", gpio_get_level(GPIO_NUM_0));
-	}
-}
-
-static void configure_button(void) {
-	gpio_num_t btn = GPIO_NUM_0;
-	ESP_ERROR_CHECK(gpio_reset_pin(btn));
-	ESP_ERROR_CHECK(gpio_set_direction(btn, GPIO_MODE_INPUT));
-	ESP_ERROR_CHECK(gpio_set_pull_mode(btn, GPIO_PULLUP_ONLY));
-	ESP_ERROR_CHECK(gpio_intr_enable(btn));
-	ESP_ERROR_CHECK(gpio_set_intr_type(btn, GPIO_INTR_ANYEDGE));
-	ESP_ERROR_CHECK(gpio_install_isr_service(ESP_INTR_FLAG_EDGE));
-	ESP_ERROR_CHECK(gpio_isr_handler_add(btn, gpio_isr_handler, NULL));
-
-	esp_timer_create_args_t timer_cfg = {
-		.callback = gpio_glitch_timer_callback,
-		.arg = (void *)GPIO_NUM_0,
-	};
-	ESP_ERROR_CHECK(esp_timer_create(&timer_cfg, &gpio_glitch_timer_handle));
-}
-
-static void nes_timer_master_callback(void *arg) {
-	ESP_ERROR_CHECK(esp_timer_start_periodic(nes_timer_handle[1], 6));
-	return;
-}
-
-static void nes_timer_slave_callback(void *arg) {
-	if (nes_state == 0) {
-		nes_buttons = 0;
-	}
-	if (nes_state % 2 == 0) {
-		gpio_set_level(nes_state == 0 ? nes_latch : nes_clk, 1);
-	} else {
-		gpio_set_level(nes_state == 1 ? nes_latch : nes_clk, 0);
-		nes_buttons |= gpio_get_level(nes_miso) << (nes_state / 2);
-	}
-	nes_state++;
-	if (nes_state == 16) {
-		const uint8_t buttons_inv = ~nes_buttons;
-		xQueueSendFromISR(nes_button_queue, &buttons_inv, NULL);
-		nes_state = 0;
-		ESP_ERROR_CHECK(esp_timer_stop(nes_timer_handle[1]));
-	}
-
-	// if (nes_state == NES_STATE_RESET) {
-	// 	ESP_ERROR_CHECK(gpio_set_level(nes_latch, 1));
-	// 	nes_buttons = 0;
-	// } else if (nes_state == 1) {
-	// 	ESP_ERROR_CHECK(gpio_set_level(nes_latch, 0));
-	// 	nes_buttons |= gpio_get_level(nes_miso);
-	// } else if (nes_state > 1 && nes_state % 2 == 0) {
-	// 	ESP_ERROR_CHECK(gpio_set_level(nes_clk, 1));
-	// } else if (nes_state > 1 && nes_state % 2 == 1) {
-	// 	ESP_ERROR_CHECK(gpio_set_level(nes_clk, 0));
-	// 	nes_buttons |= gpio_get_level(nes_miso) << ((nes_state - 1) / 2);
-	// }
-	// nes_state++;
-	// if (nes_state == 16) {
-	// 	const uint8_t buttons_inv = ~nes_buttons;
-	// 	xQueueSendFromISR(nes_button_queue, &buttons_inv, NULL);
-	// 	nes_state = NES_STATE_RESET;
-	// 	ESP_ERROR_CHECK(esp_timer_stop(nes_timer_handle[1]));
-	// }
-}
-
-static void configure_nes(void) {
-	gpio_reset_pin(nes_latch);
-	gpio_reset_pin(nes_clk);
-	gpio_reset_pin(nes_miso);
-	gpio_set_direction(nes_latch, GPIO_MODE_OUTPUT);
-	gpio_set_pull_mode(nes_latch, GPIO_PULLDOWN_ONLY);
-	gpio_set_direction(nes_clk, GPIO_MODE_OUTPUT);
-	gpio_set_pull_mode(nes_clk, GPIO_PULLDOWN_ONLY);
-	gpio_set_direction(nes_miso, GPIO_MODE_INPUT);
-	gpio_set_pull_mode(nes_miso, GPIO_FLOATING);
-
-	nes_button_queue = xQueueCreate(10, sizeof(nes_buttons));
-	assert(nes_button_queue != NULL);
-	ESP_ERROR_CHECK(esp_timer_create(
-		&(esp_timer_create_args_t){
-			.callback = nes_timer_master_callback,
-		},
-		&nes_timer_handle[0]));
-	ESP_ERROR_CHECK(esp_timer_start_periodic(nes_timer_handle[0], 1e6 / 50));
-	ESP_ERROR_CHECK(esp_timer_create(
-		&(esp_timer_create_args_t){
-			.callback = nes_timer_slave_callback,
-		},
-		&nes_timer_handle[1]));
-};
-
-static void nes_task_fn(void *arg) {
-	uint8_t old_buttons = 0, buttons = 0;
-	for (;;) {
-		if (!xQueueReceive(nes_button_queue, &buttons, 1000 / portTICK_PERIOD_MS))
-			continue;
-
-		if (buttons == old_buttons)
-			continue;
-
-		old_buttons = buttons;
-		char buttons_str[9] = {'A', 'B', 'S', 'S', 'U', 'D', 'L', 'R', 0};
-		for (uint8_t i = 0; i < 8; i++) {
-			if (((buttons >> i) & 1) == 0) {
-				buttons_str[i] = ' ';
-			}
-		}
-		ESP_LOGI("lego:nes", "raw=%02x buttons=%s", buttons, buttons_str);
-	}
-}
-
+// Echo edges. The width goes to hc_sr04_ring and wakes hs_sr04, which sends
+// the next ping.
 static bool pwm_capture_callback(
 	mcpwm_cap_channel_handle_t cap_channel, const mcpwm_capture_event_data_t *edata,
 	void *user_ctx) {
@@ -178,11 +48,11 @@ static bool pwm_capture_callback(
 		capture_positive = edata->cap_value;
 		break;
 	case MCPWM_CAP_EDGE_NEG: {
-		if (xSemaphoreTakeFromISR(hc_sr04_sem, &woken)) {
-			const uint32_t delta = edata->cap_value - capture_positive;
-			distance_mm = (uint32_t)((float)(delta / (esp_clk_apb_freq() / 1e6)) / 5.8);
-			capture_positive = 0;
-			xSemaphoreGiveFromISR(hc_sr04_sem, &woken);
+		const uint32_t delta = edata->cap_value - capture_positive;
+		lego_range_push(
+			&hc_sr04_ring, esp_timer_get_time(), lego_range_mm(delta, hc_sr04_scale));
+		if (hc_sr04_task != NULL) {
+			vTaskNotifyGiveFromISR(hc_sr04_task, &woken);
 		}
 		break;
 	}
@@ -201,10 +71,14 @@ static void configure_hc_sr04(void) {
 		.clk_src = MCPWM_CAPTURE_CLK_SRC_DEFAULT,
 	};
 	ESP_ERROR_CHECK(mcpwm_new_capture_timer(&timer_cfg, &hc_sr04_mcpwm_capture_timer_handle));
+	uint32_t tick_hz = 0;
+	ESP_ERROR_CHECK(
+		mcpwm_capture_timer_get_resolution(hc_sr04_mcpwm_capture_timer_handle, &tick_hz));
+	hc_sr04_scale = lego_range_scale(tick_hz);
+	lego_range_ring_init(&hc_sr04_ring);
 
 	const mcpwm_capture_channel_config_t chan_cfg = {
 		.prescale = 1,
-		// .prescale = esp_clk_apb_freq() / 1e6,
 		.gpio_num = HC_SR04_ECHO_GPIO,
 		.flags.pos_edge = true,
 		.flags.neg_edge = true,
@@ -224,25 +98,77 @@ static void configure_hc_sr04(void) {
 	ESP_ERROR_CHECK(esp_timer_create(&trig_timer_cfg, &hc_sr04_trig_timer_handle));
 }
 
+// Pings as soon as the previous echo is in, or has timed out, so the rate is
+// set by the distance. Samples go through the filter into distance_mm and
+// the distance controller, and while hc_sr04_stream is on, out to
+// esp/1/range. lego_controller gets the speed only when it changes.
 static void hs_sr04_task_fn(void *arg) {
-	uint32_t value = 0;
+	lego_range_filter_t filter;
+	lego_range_filter_init(&filter);
+	const lego_pid_config_t pid_cfg = {
+		.setpoint_mm = RANGE_SETPOINT_MM,
+		.kp = RANGE_PID_KP * (1 << LEGO_PID_SHIFT),
+		.ki = RANGE_PID_KI * (1 << LEGO_PID_SHIFT),
+		.kd = RANGE_PID_KD * (1 << LEGO_PID_SHIFT),
+		.deadband_mm = RANGE_PID_DEADBAND_MM,
+		.hysteresis = RANGE_PID_HYSTERESIS * (1 << LEGO_PID_SHIFT),
+		.max_step = RANGE_PID_MAX_STEP,
+	};
+	lego_pid_t pid;
+	lego_pid_init(&pid, &pid_cfg);
+	int8_t drive = 0;
+	lego_range_sample_t batch[HC_SR04_STREAM_BATCH];
+	uint32_t filtered[HC_SR04_STREAM_BATCH];
+	uint32_t nbatch = 0;
+	hc_sr04_task = xTaskGetCurrentTaskHandle();
 	ESP_ERROR_CHECK(gpio_reset_pin(HC_SR04_TRIG_GPIO));
 	ESP_ERROR_CHECK(gpio_set_direction(HC_SR04_TRIG_GPIO, GPIO_MODE_OUTPUT));
 	ESP_ERROR_CHECK(gpio_set_level(HC_SR04_TRIG_GPIO, 0));
 	for (;;) {
 		ESP_ERROR_CHECK(gpio_set_level(HC_SR04_TRIG_GPIO, 1));
 		ESP_ERROR_CHECK(esp_timer_start_once(hc_sr04_trig_timer_handle, 10));
-		// if (xTaskNotifyWait(0, ~0, &value, pdMS_TO_TICKS(10000))) {
-		// 	float distance_mm = (float)(value / (esp_clk_apb_freq() / 1e6))
-		// / 5.8; 	ESP_LOGI("hs_sr04", "value=%lu distance=%f", value,
-		// distance_mm); } else { 	ESP_LOGE("hs_sr04", "Timed out while waiting
-		// for echo");
-		// }
-		vTaskDelay(pdMS_TO_TICKS(20));
+		ulTaskNotifyTake(pdTRUE, pdMS_TO_TICKS(HC_SR04_ECHO_TIMEOUT_MS));
+		lego_range_sample_t sample;
+		while (lego_range_pop(&hc_sr04_ring, &sample)) {
+			if (sample.mm > LEGO_RANGE_MAX_MM) {
+				continue;
+			}
+			const uint32_t mm = lego_range_filter(&filter, sample.mm);
+			atomic_store(&distance_mm, mm);
+			const uint32_t setpoint_mm = atomic_load(&range_setpoint_mm);
+			if (setpoint_mm != pid.config.setpoint_mm) {
+				pid.config.setpoint_mm = setpoint_mm;
+				lego_pid_reset(&pid);
+			}
+			const int8_t step = setpoint_mm != 0 ? lego_pid_update(&pid, mm, sample.stamp_us) : 0;
+			if (step != drive) {
+				drive = step;
+				lego_mailbox_post(&lego_state.drive, (uint8_t)drive, sample.stamp_us);
+				xEventGroupSetBits(egroup, LEGO_PKT_CONT_BIT);
+			}
+			if (!atomic_load(&hc_sr04_stream)) {
+				nbatch = 0;
+				continue;
+			}
+			batch[nbatch] = sample;
+			filtered[nbatch] = mm;
+			if (++nbatch == HC_SR04_STREAM_BATCH) {
+				mqtt_publish_range(batch, filtered, nbatch);
+				nbatch = 0;
+			}
+		}
 	}
 }
 
+// Pinned to `core` unless IR_TASK_PINNING is off
+static void start_task(
+	TaskFunction_t fn, const char *name, uint32_t stack, UBaseType_t priority, BaseType_t core) {
+	assert(
+		xTaskCreatePinnedToCore(fn, name, stack, NULL, priority, NULL, TASK_CORE(core)) == pdPASS);
+}
+
 void app_main(void) {
+	boot_mark(BOOT_APP_MAIN);
 	// Initialize NVS
 	esp_err_t ret = nvs_flash_init();
 	if (ret == ESP_ERR_NVS_NO_FREE_PAGES || ret == ESP_ERR_NVS_NEW_VERSION_FOUND) {
@@ -250,17 +176,24 @@ void app_main(void) {
 		ret = nvs_flash_init();
 	}
 	ESP_ERROR_CHECK(ret);
-	ESP_ERROR_CHECK(esp_netif_init());
-	ESP_ERROR_CHECK(esp_event_loop_create_default());
 
-	lego_state.npackets = 0;
 	lego_state.channel = 1;
+	const lego_timing_config_t sched_timing_cfg = {
+		.min_gap_us = IR_TX_MIN_GAP_US,
+		.retransmit_windows = IR_TX_RETRANSMIT_WINDOWS,
+	};
+	lego_sched_init(&lego_state.sched, &sched_timing_cfg);
+	lego_mailbox_init(&lego_state.buttons);
+	lego_mailbox_init(&lego_state.pad);
+	lego_mailbox_init(&lego_state.drive);
+	lego_window_init(&lego_state.window);
+	lego_metrics_init(&lego_metrics, lego_metrics_clock);
+	lego_trace_init(&lego_trace_log);
 
 	egroup = xEventGroupCreate();
 	assert(egroup != NULL);
-
-	hc_sr04_sem = xSemaphoreCreateMutex();
-	assert(hc_sr04_sem != NULL);
+	configure_mqtt_outbox();
+	configure_lego_reports();
 
 	const gpio_config_t gpio_cfg = {
 		.pin_bit_mask = (uint64_t)1 << GPIO_NUM_4 | (uint64_t)1 << GPIO_NUM_33,
@@ -271,29 +204,63 @@ void app_main(void) {
 	// GPIO33 is pulled up
 	gpio_set_level(GPIO_NUM_33, 1);
 
-	configure_ir_tx();
-	// configure_ir_rx();
-	// configure_button();
+	// The IR pipeline and local inputs come first, none of them needs the
+	// network. Results published before MQTT is up wait in the outbox.
+	// NOTE: Lego IR Transceiver peripherals, enabled on their core
+	assert(
+		xTaskCreatePinnedToCore(
+			ir_setup_task_fn, "ir_setup", 3072, NULL, PRIO_IR, NULL,
+			IR_TASK_PINNING ? IR_CORE : NET_CORE) == pdPASS);
+	xEventGroupWaitBits(egroup, IR_READY_BIT, true, true, portMAX_DELAY);
+#if INPUT_ENABLED
+	configure_inputs();
+#endif
 	// configure_uart();
-	// configure_nes();
-	// configure_hc_sr04();
-	configure_wifi();
-	configure_mqtt();
-
-	// NOTE: Lego IR Transceiver peripherals
-	ESP_ERROR_CHECK(rmt_enable(tx_chan));
-	// ESP_ERROR_CHECK(rmt_enable(rx_chan));
+#if NES_ENABLED
+	configure_nes();
+#endif
+#if HC_SR04_ENABLED
+	configure_hc_sr04();
 
 	// NOTE: HS-SR04 peripherals
-	// ESP_ERROR_CHECK(mcpwm_capture_timer_enable(hc_sr04_mcpwm_capture_timer_handle));
-	// ESP_ERROR_CHECK(mcpwm_capture_channel_enable(hc_sr04_mcpwm_capture_channel_handle));
-	// ESP_ERROR_CHECK(mcpwm_capture_timer_start(hc_sr04_mcpwm_capture_timer_handle));
-
-	// assert(xTaskCreate(ir_tx_task_fn, "ir_tx", 2048, NULL, 10, NULL) == pdPASS);
-	assert(xTaskCreate(lego_controller_task_fn, "lego_controller", 2048, NULL, 10, NULL) == pdPASS);
-	// assert(xTaskCreate(ir_rx_task_fn, "ir_rx", 2048, NULL, 10, NULL) == pdPASS);
-	// assert(xTaskCreate(button_task_fn, "button", 2048, NULL, 10, NULL) == pdPASS);
-	// assert(xTaskCreate(nes_task_fn, "nes", 2048, NULL, 10, NULL) == pdPASS);
-	// assert(xTaskCreate(hs_sr04_task_fn, "hs_sr04", 2048, NULL, 10, NULL) == pdPASS);
-	assert(xTaskCreate(wifi_task_fn, "wifi", 1024, NULL, 10, NULL) == pdPASS);
+	ESP_ERROR_CHECK(mcpwm_capture_timer_enable(hc_sr04_mcpwm_capture_timer_handle));
+	ESP_ERROR_CHECK(mcpwm_capture_channel_enable(hc_sr04_mcpwm_capture_channel_handle));
+	ESP_ERROR_CHECK(mcpwm_capture_timer_start(hc_sr04_mcpwm_capture_timer_handle));
+#endif
+
+	start_task(lego_report_task_fn, "lego_report", 3072, PRIO_NET, NET_CORE);
+	// About 400 bytes for the loop, the rest for lego_tx_submit() down through
+	// the RMT driver into the encoder. Nothing is formatted on this task, see
+	// lego_report_task_fn(). Check stack_free on esp/1/telemetry after a
+	// change, telemetry_task_fn() warns below TELEMETRY_STACK_MIN_FREE.
+	start_task(lego_controller_task_fn, "lego_controller", 2560, PRIO_IR, IR_CORE);
+#if IR_RX_ENABLED
+	start_task(ir_rx_task_fn, "ir_rx", 2048, PRIO_IR, IR_CORE);
+	start_task(ir_rx_dump_task_fn, "ir_rx_dump", 2048, PRIO_BACKGROUND, NET_CORE);
+#endif
+#if INPUT_ENABLED
+	start_task(input_task_fn, "input", 2048, PRIO_SENSOR, IR_CORE);
+#endif
+#if NES_ENABLED
+	start_task(nes_task_fn, "nes", 2048, PRIO_SENSOR, IR_CORE);
+	start_task(nes_map_task_fn, "nes_map", 2048, PRIO_SENSOR, IR_CORE);
+#endif
+#if HC_SR04_ENABLED
+	// Publishes esp/1/range itself, as much stack as lego_report
+	start_task(hs_sr04_task_fn, "hs_sr04", 3072, PRIO_SENSOR, IR_CORE);
+#endif
+	boot_mark(BOOT_IR_STARTED);
+
+	// Wi-Fi and MQTT come up in the background and retry forever, see
+	// wifi_task_fn() and mqtt_task_fn()
+	ESP_ERROR_CHECK(esp_netif_init());
+	ESP_ERROR_CHECK(esp_event_loop_create_default());
+	configure_mqtt();
+	configure_wifi();
+	start_task(wifi_task_fn, "wifi", 3072, PRIO_NET, NET_CORE);
+	start_task(mqtt_task_fn, "mqtt_link", 3072, PRIO_NET, NET_CORE);
+	start_task(lego_trace_task_fn, "lego_trace", 2048, PRIO_BACKGROUND, NET_CORE);
+	start_task(telemetry_task_fn, "telemetry", 3072, PRIO_BACKGROUND, NET_CORE);
+	// start_task(jitter_bench_task_fn, "jitter_bench", 3072, PRIO_IR, IR_CORE);
+	// start_task(jitter_flood_task_fn, "jitter_flood", 3072, PRIO_NET, NET_CORE);
 }
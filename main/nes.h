@@ -0,0 +1,141 @@
+#ifndef NES_H_INCLUDED
+#define NES_H_INCLUDED
+
+#include "driver/gpio.h"
+#include "driver/spi_master.h"
+#include "esp_attr.h"
+#include "esp_log.h"
+#include "esp_timer.h"
+
+#include "freertos/FreeRTOS.h"
+#include "freertos/queue.h"
+#include "freertos/semphr.h"
+
+#include "defs.h"
+#include "lego_map.h"
+#include "lego_nes.h"
+
+// Pad reader on the SPI peripheral, see lego_nes.h for the wiring. Every
+// NES_POLL_HZ the timer wakes nes_task_fn(), which reads the pad in one DMA
+// transaction and sends changes to nes_button_queue. This replaces a 6 us
+// timer that bit-banged latch and clock, 16 callbacks per read.
+// nes_map_task_fn() turns the changes into keys for the controller through
+// nes_map, which can be replaced over MQTT (esp/1/nes/map).
+
+static spi_device_handle_t nes_spi = NULL;
+static esp_timer_handle_t nes_poll_timer = NULL;
+// Reads that don't look like NES_PAD
+static uint32_t nes_invalid = 0;
+// DMA buffers. The transaction is a whole word so the driver receives in
+// place instead of through a bounce buffer; the extra clocks come after
+// the pad's bits and are ignored.
+WORD_ALIGNED_ATTR static uint8_t nes_tx[4] = {0};
+WORD_ALIGNED_ATTR static uint8_t nes_rx[4] = {0};
+// Pad buttons to keys, written by the MQTT task
+static lego_map_t nes_map = {0};
+static SemaphoreHandle_t nes_map_lock = NULL;
+
+_Static_assert(NES_POLL_HZ > 0 && NES_POLL_HZ <= 1000, "NES_POLL_HZ is 1..1000");
+
+static void nes_poll_timer_callback(void *arg) {
+	xEventGroupSetBits(egroup, NES_POLL_BIT);
+}
+
+static void configure_nes(void) {
+	const spi_bus_config_t bus_cfg = {
+		// MOSI drives the latch
+		.mosi_io_num = NES_LATCH_GPIO,
+		.miso_io_num = NES_MISO_GPIO,
+		.sclk_io_num = NES_CLK_GPIO,
+		.quadwp_io_num = -1,
+		.quadhd_io_num = -1,
+		.max_transfer_sz = sizeof(nes_tx),
+	};
+	ESP_ERROR_CHECK(spi_bus_initialize(NES_SPI_HOST, &bus_cfg, SPI_DMA_CH_AUTO));
+	const spi_device_interface_config_t dev_cfg = {
+		// The pad shifts on the rising edge, MISO is sampled on it
+		.mode = 0,
+		.clock_speed_hz = NES_SPI_HZ,
+		.spics_io_num = -1,
+		.queue_size = 1,
+	};
+	ESP_ERROR_CHECK(spi_bus_add_device(NES_SPI_HOST, &dev_cfg, &nes_spi));
+	// An unplugged pad reads as nothing pressed
+	ESP_ERROR_CHECK(gpio_pullup_en(NES_MISO_GPIO));
+	lego_nes_frame(NES_PAD, nes_tx);
+
+	lego_map_init(&nes_map, lego_state.channel);
+	nes_map_lock = xSemaphoreCreateMutex();
+	assert(nes_map_lock != NULL);
+	nes_button_queue = xQueueCreate(10, sizeof(lego_nes_event_t));
+	assert(nes_button_queue != NULL);
+	const esp_timer_create_args_t timer_cfg = {
+		.callback = nes_poll_timer_callback,
+		.name = "nes_poll",
+	};
+	ESP_ERROR_CHECK(esp_timer_create(&timer_cfg, &nes_poll_timer));
+	ESP_ERROR_CHECK(esp_timer_start_periodic(nes_poll_timer, 1000000 / NES_POLL_HZ));
+}
+
+static void nes_task_fn(void *arg) {
+	static const char *names[] = {
+		[LEGO_NES_PAD_NES] = "ABSSUDLR",
+		[LEGO_NES_PAD_SNES] = "BYSSUDLRAXLR",
+	};
+	spi_transaction_t trans = {
+		.length = sizeof(nes_tx) * 8,
+		.tx_buffer = nes_tx,
+		.rx_buffer = nes_rx,
+	};
+	uint16_t old_buttons = 0, buttons = 0;
+	for (;;) {
+		xEventGroupWaitBits(egroup, NES_POLL_BIT, true, false, portMAX_DELAY);
+		ESP_ERROR_CHECK(spi_device_transmit(nes_spi, &trans));
+		if (!lego_nes_decode(NES_PAD, nes_rx, &buttons)) {
+			nes_invalid++;
+			continue;
+		}
+		if (buttons == old_buttons) {
+			continue;
+		}
+		old_buttons = buttons;
+		const lego_nes_event_t event = {
+			.buttons = buttons,
+			.sample_us = lego_metrics_now(&lego_metrics),
+		};
+		xQueueSend(nes_button_queue, &event, 0);
+
+		char buttons_str[16] = {0};
+		const char *name = names[NES_PAD];
+		for (uint8_t i = 0; name[i] != 0; i++) {
+			buttons_str[i] = (buttons >> i) & 1 ? name[i] : ' ';
+		}
+		ESP_LOGI("lego:nes", "raw=%03x buttons=%s", buttons, buttons_str);
+	}
+}
+
+// Only woken by the queue. Hands the keys to the controller when the mapping
+// changes them, stamped with the pad read so it can record LEGO_STAGE_PAD.
+static void nes_map_task_fn(void *arg) {
+	lego_nes_event_t event = {0};
+	uint16_t buttons = 0, keys = 0;
+	for (;;) {
+		xQueueReceive(nes_button_queue, &event, portMAX_DELAY);
+		if (event.sample_us != 0) {
+			buttons = event.buttons;
+		}
+		xSemaphoreTake(nes_map_lock, portMAX_DELAY);
+		const uint16_t mapped = lego_map_apply(&nes_map, buttons);
+		xSemaphoreGive(nes_map_lock);
+		if (mapped == keys) {
+			continue;
+		}
+		keys = mapped;
+		const uint32_t stamp_us =
+			event.sample_us != 0 ? event.sample_us : lego_metrics_now(&lego_metrics);
+		lego_mailbox_post(&lego_state.pad, keys, stamp_us);
+		xEventGroupSetBits(egroup, LEGO_PKT_CONT_BIT);
+	}
+}
+
+#endif
@@ -1,69 +1,429 @@
 #ifndef WIFI_H_INCLUDED
 #define WIFI_H_INCLUDED
 
+#include <stdatomic.h>
 #include <string.h>
 
+#include "esp_cpu.h"
 #include "esp_event.h"
+#include "esp_ipc.h"
 #include "esp_log.h"
+#include "esp_private/esp_clk.h"
+#include "esp_random.h"
 #include "esp_wifi.h"
 #include "mqtt_client.h"
 
 #include "freertos/FreeRTOS.h"
+#include "freertos/queue.h"
 
 #include "defs.h"
 #include "lego_encoder.h"
+#include "lego_link.h"
+#include "lego_outbox.h"
+#include "lego_router.h"
+#include "nes.h"
 
 static esp_netif_t *wifi_netif = NULL;
 static esp_mqtt_client_handle_t mqtt_handle = NULL;
+// Incoming topics, filled by the *_register_routes() functions before the
+// client starts. Every route is also a subscription.
+static lego_router_t mqtt_router;
+// Outage mode. mqtt_task_fn() reconnects with backoff, and until it has
+// emptied mqtt_outbox, results and telemetry are buffered there instead of
+// published.
+static lego_link_t mqtt_link;
+static lego_outbox_t mqtt_outbox;
+static SemaphoreHandle_t mqtt_outbox_lock = NULL;
+static atomic_bool mqtt_online = false;
+// Station reconnects, see wifi_task_fn()
+static lego_link_t wifi_link;
 
 #define MKTOPIC(t) ("esp/1/" t)
 
+#define LEGO_QUEUE_SPACE_FMT                                                                       \
+	"{\"accepted\":%lu,\"rejected\":%lu,\"free\":[%lu,%lu,%lu,%lu]}"
+#define LEGO_CHANNEL_STATS_FMT "{\"depth\":[%lu,%lu,%lu,%lu],\"rate\":[%lu,%lu,%lu,%lu]}"
+#define LEGO_METRICS_STAGE_FMT "\"%s\":{\"n\":%lu,\"p50\":%lu,\"p95\":%lu,\"p99\":%lu,\"max\":%lu}"
+#define LEGO_ACK_FMT "{\"seq\":%u,\"status\":\"%s\",\"position\":%lu,\"outstanding\":%lu}"
+#define LEGO_ACK_DONE_FMT "{\"seq\":%u,\"status\":\"done\",\"done_us\":%lu,\"latency_us\":%lu}"
+#define LEGO_BUTTON_STATS_FMT                                                                      \
+	"{\"last_us\":%lu,\"max_us\":%lu,\"avg_us\":%lu,\"coalesced\":%lu,\"dropped\":%lu}"
+#define LEGO_RANGE_SAMPLE_FMT "[%lu,%lu,%lu]"
+
+// Publishes, or buffers while offline. `coalesce` for messages that only
+// carry the latest state of something, see lego_outbox.h. A 0 `len` means
+// a string payload.
+static void mqtt_publish(const char *topic, const char *payload, int len, bool coalesce) {
+	if (len == 0) {
+		len = strlen(payload);
+	}
+	if (atomic_load(&mqtt_online) &&
+		esp_mqtt_client_publish(mqtt_handle, topic, payload, len, 0, false) >= 0) {
+		return;
+	}
+	xSemaphoreTake(mqtt_outbox_lock, portMAX_DELAY);
+	lego_outbox_push(&mqtt_outbox, topic, payload, len, coalesce);
+	xSemaphoreGive(mqtt_outbox_lock);
+	// Came back meanwhile, and the flush may already be done
+	if (atomic_load(&mqtt_online)) {
+		xEventGroupSetBits(egroup, MQTT_FLUSH_BIT);
+	}
+}
+
+// Backpressure for lego/cmd/append and lego/cmd/batch: how much of the last
+// write made it into the queues and how many steps are left per channel.
+static void mqtt_publish_queue_space(uint32_t accepted, uint32_t rejected) {
+	lego_ring_t *queues = lego_state.sched.queues;
+	char payload[96];
+	const int payload_len = snprintf(
+		payload, sizeof(payload), LEGO_QUEUE_SPACE_FMT, accepted, rejected,
+		lego_ring_free(&queues[0]), lego_ring_free(&queues[1]), lego_ring_free(&queues[2]),
+		lego_ring_free(&queues[3]));
+	mqtt_publish(MKTOPIC("lego/cmd/space"), payload, payload_len, true);
+}
+
+// Per-channel queue depth and achieved packets/s
+static void mqtt_publish_channel_stats(const uint32_t depth[4], const uint32_t rate[4]) {
+	char payload[128];
+	const int payload_len = snprintf(
+		payload, sizeof(payload), LEGO_CHANNEL_STATS_FMT, depth[0], depth[1], depth[2], depth[3],
+		rate[0], rate[1], rate[2], rate[3]);
+	mqtt_publish(MKTOPIC("lego/stats"), payload, payload_len, true);
+}
+
+// Time from a lego/button message until its frame is handed to the RMT, and
+// how many updates were merged or arrived out of order
+typedef struct {
+	uint32_t last_us;
+	uint32_t max_us;
+	uint32_t avg_us;
+	uint32_t coalesced;
+	uint32_t dropped;
+} lego_button_stats_t;
+
+static void mqtt_publish_button_stats(const lego_button_stats_t *stats) {
+	char payload[112];
+	const int payload_len = snprintf(
+		payload, sizeof(payload), LEGO_BUTTON_STATS_FMT, stats->last_us, stats->max_us,
+		stats->avg_us, stats->coalesced, stats->dropped);
+	mqtt_publish(MKTOPIC("lego/button/stats"), payload, payload_len, true);
+}
+
+// Answer to a numbered batch: "queued" with the steps ahead of it, or
+// "duplicate", "busy" when the window is full, "full" when the queues are,
+// "invalid" when the payload is cut off or not whole steps
+static void mqtt_publish_ack(uint16_t seq, const char *status, uint32_t position) {
+	char payload[96];
+	const int payload_len = snprintf(
+		payload, sizeof(payload), LEGO_ACK_FMT, seq, status, position,
+		lego_window_outstanding(&lego_state.window));
+	mqtt_publish(MKTOPIC("lego/cmd/ack"), payload, payload_len, false);
+}
+
+// A numbered batch is off the LED, `done_us` on the lego_metrics clock
+static void mqtt_publish_ack_done(uint16_t seq, uint32_t done_us, uint32_t latency_us) {
+	char payload[96];
+	const int payload_len =
+		snprintf(payload, sizeof(payload), LEGO_ACK_DONE_FMT, seq, done_us, latency_us);
+	mqtt_publish(MKTOPIC("lego/cmd/ack"), payload, payload_len, false);
+}
+
+// lego/cmd/append/<seq> and lego/cmd/batch/<seq>: same payloads as without
+// the number, but the batch is taken whole or not at all, acked, and a
+// redelivered one is only acked again. `whole` is false for a message the
+// client delivered in fragments, which are not reassembled.
+static void lego_cmd_submit_numbered(
+	bool is_batch, uint16_t seq, const char *data, int data_len, bool whole,
+	uint32_t ingest_us) {
+	lego_sched_t *sched = &lego_state.sched;
+	const uint32_t position = lego_sched_pending(sched);
+	const size_t size = is_batch ? sizeof(lego_step_t) : sizeof(lego_packet_t);
+	if (!whole || data_len % size != 0) {
+		LEGO_TRACE(CMD_REJECTED, data_len);
+		mqtt_publish_ack(seq, "invalid", position);
+		return;
+	}
+	if (lego_window_seen(&lego_state.window, seq)) {
+		mqtt_publish_ack(seq, "duplicate", position);
+		return;
+	}
+	if (lego_window_outstanding(&lego_state.window) >= LEGO_WINDOW_SIZE) {
+		mqtt_publish_ack(seq, "busy", position);
+		return;
+	}
+	uint32_t n = 0;
+	if (is_batch) {
+		const lego_step_t *steps = (const lego_step_t *)data;
+		n = data_len / sizeof(lego_step_t);
+		if (!lego_sched_fits(sched, steps, n)) {
+			LEGO_TRACE(CMD_REJECTED, n);
+			mqtt_publish_ack(seq, "full", position);
+			return;
+		}
+		lego_sched_push(sched, steps, n, ingest_us);
+	} else {
+		const lego_packet_t *pkts = (const lego_packet_t *)data;
+		n = data_len / sizeof(lego_packet_t);
+		if (!lego_sched_fits_packets(sched, pkts, n)) {
+			LEGO_TRACE(CMD_REJECTED, n);
+			mqtt_publish_ack(seq, "full", position);
+			return;
+		}
+		lego_sched_push_packets(sched, pkts, n, ingest_us);
+	}
+	lego_window_open(&lego_state.window, sched, seq, ingest_us);
+	LEGO_TRACE(CMD_ACCEPTED, n);
+	mqtt_publish_ack(seq, "queued", position);
+	xEventGroupSetBits(egroup, LEGO_PKT_FLUSH_BIT);
+}
+
+static int lego_metrics_format(
+	char *buf, size_t len, const char *name, const lego_hist_summary_t *summary) {
+	return snprintf(
+		buf, len, LEGO_METRICS_STAGE_FMT, name, summary->total, summary->p50, summary->p95,
+		summary->p99, summary->max);
+}
+
+// p50/p95/p99 per stage of the command path in us, over the last window
+static void mqtt_publish_metrics(const lego_hist_summary_t summary[LEGO_STAGE_COUNT]) {
+	static const char *names[LEGO_STAGE_COUNT] = {
+		[LEGO_STAGE_QUEUE] = "queue",
+		[LEGO_STAGE_ENCODE] = "encode",
+		[LEGO_STAGE_FIRST_EDGE] = "first_edge",
+		[LEGO_STAGE_AIR] = "air",
+		[LEGO_STAGE_PAD] = "pad",
+	};
+	char payload[512];
+	int payload_len = snprintf(payload, sizeof(payload), "{");
+	for (uint8_t i = 0; i < LEGO_STAGE_COUNT; i++) {
+		payload_len += lego_metrics_format(
+			payload + payload_len, sizeof(payload) - payload_len, names[i], &summary[i]);
+		payload[payload_len++] = i + 1 < LEGO_STAGE_COUNT ? ',' : '}';
+	}
+	mqtt_publish(MKTOPIC("metrics"), payload, payload_len, false);
+}
+
+// HC-SR04 samples as [stamp_us, raw_mm, filtered_mm], and how many the ring
+// lost so far
+static void mqtt_publish_range(
+	const lego_range_sample_t *samples, const uint32_t *filtered, uint32_t n) {
+	char payload[48 + HC_SR04_STREAM_BATCH * 32];
+	int payload_len = snprintf(
+		payload, sizeof(payload), "{\"dropped\":%lu,\"samples\":[",
+		atomic_load(&hc_sr04_ring.dropped));
+	for (uint32_t i = 0; i < n; i++) {
+		payload_len += snprintf(
+			payload + payload_len, sizeof(payload) - payload_len, LEGO_RANGE_SAMPLE_FMT,
+			samples[i].stamp_us, samples[i].mm, filtered[i]);
+		payload[payload_len++] = i + 1 < n ? ',' : ']';
+	}
+	payload[payload_len++] = '}';
+	mqtt_publish(MKTOPIC("range"), payload, payload_len, false);
+}
+
+// What the route handlers get as `msg`
+typedef struct {
+	const esp_mqtt_event_t *e;
+	// lego_metrics clock, never 0 since that means no stamp to the scheduler
+	uint32_t ingest_us;
+} mqtt_msg_t;
+
+// A payload larger than the client's buffer arrives in several
+// MQTT_EVENT_DATA, only the first one with the topic
+static bool mqtt_msg_whole(const mqtt_msg_t *m) {
+	return m->e->current_data_offset == 0 && m->e->data_len == m->e->total_data_len;
+}
+
+static void lego_cmd_append_route(void *msg, const lego_route_args_t *args, void *ctx) {
+	const mqtt_msg_t *m = msg;
+	uint32_t npackets = m->e->data_len / sizeof(lego_packet_t);
+	if (!mqtt_msg_whole(m)) {
+		npackets = m->e->total_data_len / sizeof(lego_packet_t);
+		LEGO_TRACE(CMD_REJECTED, npackets);
+		mqtt_publish_queue_space(0, npackets);
+		return;
+	}
+	// for (uint32_t i = 0; i < pkt_count; i++) {
+	// 	lego_packet_t p = ((lego_packet_t *)e->data)[i];
+	// 	LEGO_PACKET_DUMP("wifi", p);
+	// }
+	const uint32_t accepted = lego_sched_push_packets(
+		&lego_state.sched, (const lego_packet_t *)m->e->data, npackets, m->ingest_us);
+	LEGO_TRACE(CMD_ACCEPTED, accepted);
+	if (accepted < npackets) {
+		LEGO_TRACE(CMD_REJECTED, npackets - accepted);
+	}
+	mqtt_publish_queue_space(accepted, npackets - accepted);
+	if (accepted > 0) {
+		xEventGroupSetBits(egroup, LEGO_PKT_FLUSH_BIT);
+	}
+}
+
+static void lego_cmd_batch_route(void *msg, const lego_route_args_t *args, void *ctx) {
+	const mqtt_msg_t *m = msg;
+	uint32_t nsteps = m->e->data_len / sizeof(lego_step_t);
+	if (!mqtt_msg_whole(m)) {
+		nsteps = m->e->total_data_len / sizeof(lego_step_t);
+		LEGO_TRACE(CMD_REJECTED, nsteps);
+		mqtt_publish_queue_space(0, nsteps);
+		return;
+	}
+	const uint32_t accepted = lego_sched_push(
+		&lego_state.sched, (const lego_step_t *)m->e->data, nsteps, m->ingest_us);
+	LEGO_TRACE(CMD_ACCEPTED, accepted);
+	if (accepted < nsteps) {
+		LEGO_TRACE(CMD_REJECTED, nsteps - accepted);
+	}
+	mqtt_publish_queue_space(accepted, nsteps - accepted);
+	if (accepted > 0) {
+		xEventGroupSetBits(egroup, LEGO_PKT_FLUSH_BIT);
+	}
+}
+
+// lego/cmd/append/+ and lego/cmd/batch/+, `ctx` tells which
+static void lego_cmd_numbered_route(void *msg, const lego_route_args_t *args, void *ctx) {
+	const mqtt_msg_t *m = msg;
+	uint32_t seq = 0;
+	if (!lego_route_arg_u32(args, 0, &seq) || seq > UINT16_MAX) {
+		ESP_LOGW("lego:cmd", "Rejected sequence number \"%.*s\"", args->len[0], args->arg[0]);
+		return;
+	}
+	lego_cmd_submit_numbered(
+		ctx != NULL, seq, m->e->data, m->e->data_len, mqtt_msg_whole(m), m->ingest_us);
+}
+
+static void lego_cmd_flush_route(void *msg, const lego_route_args_t *args, void *ctx) {
+	if (lego_sched_pending(&lego_state.sched) == 0) {
+		ESP_LOGW("wifi", "Received flush, but the queue is empty");
+	} else {
+		xEventGroupSetBits(egroup, LEGO_PKT_FLUSH_BIT);
+	}
+}
+
+static void lego_button_route(void *msg, const lego_route_args_t *args, void *ctx) {
+	const esp_mqtt_event_t *e = ((const mqtt_msg_t *)msg)->e;
+	if (e->data_len == 0) {
+		return;
+	}
+	// Keys, optionally followed by a little-endian 16-bit sequence number
+	const uint8_t keys = e->data[0] & 0xf;
+	const uint32_t now_us = esp_timer_get_time();
+	bool posted = true;
+	if (e->data_len >= 3) {
+		const uint16_t seq = (uint8_t)e->data[1] | (uint8_t)e->data[2] << 8;
+		posted = lego_mailbox_post_seq(&lego_state.buttons, keys, seq, now_us);
+	} else {
+		lego_mailbox_post(&lego_state.buttons, keys, now_us);
+	}
+	if (posted) {
+		xEventGroupSetBits(egroup, LEGO_PKT_CONT_BIT);
+	}
+}
+
+static void gpio_set_route(void *msg, const lego_route_args_t *args, void *ctx) {
+	uint32_t gpio_num = 0, gpio_level = 0;
+	if (lego_route_arg_u32(args, 0, &gpio_num) && lego_route_arg_u32(args, 1, &gpio_level)) {
+		ESP_LOGI("mqtt", "Setting GPIO=%lu to level %lu", gpio_num, gpio_level);
+		gpio_set_level(gpio_num, gpio_level);
+	}
+}
+
+// Replaces the pad mapping, see lego_map_load() for the payload. The result
+// goes to esp/1/nes/map/status: "loaded", "rejected" or "disabled" without
+// NES_ENABLED.
+static void nes_map_route(void *msg, const lego_route_args_t *args, void *ctx) {
+	static const char *topic = MKTOPIC("nes/map/status");
+	const esp_mqtt_event_t *e = ((const mqtt_msg_t *)msg)->e;
+	if (nes_button_queue == NULL) {
+		ESP_LOGW("lego:nes", "Received a mapping, but the pad is disabled");
+		mqtt_publish(topic, "disabled", 0, false);
+		return;
+	}
+	xSemaphoreTake(nes_map_lock, portMAX_DELAY);
+	const bool loaded = lego_map_load(&nes_map, (const uint8_t *)e->data, e->data_len);
+	xSemaphoreGive(nes_map_lock);
+	if (!loaded) {
+		ESP_LOGW("lego:nes", "Rejected a %d byte mapping", e->data_len);
+		mqtt_publish(topic, "rejected", 0, false);
+		return;
+	}
+	const lego_nes_event_t reload = {0};
+	xQueueSend(nes_button_queue, &reload, 0);
+	mqtt_publish(topic, "loaded", 0, false);
+}
+
+static void lego_register_routes(lego_router_t *router) {
+	assert(lego_router_add(router, MKTOPIC("lego/cmd/append"), 0, lego_cmd_append_route, NULL));
+	assert(lego_router_add(router, MKTOPIC("lego/cmd/batch"), 0, lego_cmd_batch_route, NULL));
+	assert(lego_router_add(router, MKTOPIC("lego/cmd/append/+"), 1, lego_cmd_numbered_route, NULL));
+	assert(lego_router_add(
+		router, MKTOPIC("lego/cmd/batch/+"), 1, lego_cmd_numbered_route, (void *)true));
+	assert(lego_router_add(router, MKTOPIC("lego/cmd/flush"), 0, lego_cmd_flush_route, NULL));
+	assert(lego_router_add(router, MKTOPIC("lego/button"), 0, lego_button_route, NULL));
+}
+
+// "1" starts esp/1/range, anything else stops it
+static void range_stream_route(void *msg, const lego_route_args_t *args, void *ctx) {
+	const esp_mqtt_event_t *e = ((const mqtt_msg_t *)msg)->e;
+	atomic_store(&hc_sr04_stream, e->data_len == 1 && e->data[0] == '1');
+}
+
+// Distance to hold in mm as text, 0 stops the distance controller
+static void range_setpoint_route(void *msg, const lego_route_args_t *args, void *ctx) {
+	const esp_mqtt_event_t *e = ((const mqtt_msg_t *)msg)->e;
+	char text[8];
+	if (e->data_len <= 0 || e->data_len >= sizeof(text)) {
+		return;
+	}
+	memcpy(text, e->data, e->data_len);
+	text[e->data_len] = 0;
+	char *end = NULL;
+	const unsigned long mm = strtoul(text, &end, 10);
+	if (*end != 0 || mm > LEGO_RANGE_MAX_MM) {
+		ESP_LOGW("lego:range", "Rejected setpoint \"%s\"", text);
+		return;
+	}
+	atomic_store(&range_setpoint_mm, mm);
+}
+
+static void range_register_routes(lego_router_t *router) {
+	assert(lego_router_add(router, MKTOPIC("range/stream"), 0, range_stream_route, NULL));
+	assert(lego_router_add(router, MKTOPIC("range/setpoint"), 0, range_setpoint_route, NULL));
+}
+
+static void nes_register_routes(lego_router_t *router) {
+	assert(lego_router_add(router, MKTOPIC("nes/map"), 1, nes_map_route, NULL));
+}
+
+static void gpio_register_routes(lego_router_t *router) {
+	// lego_router_add(router, "esp/led/+", 0, ...);
+	// lego_router_add(router, "esp/flash/+", 0, ...);
+	assert(lego_router_add(router, MKTOPIC("gpio/+/set/+"), 0, gpio_set_route, NULL));
+}
+
 static void esp_mqtt_event_callback(
 	void *arg, esp_event_base_t event_base, int32_t event_id, void *event_data) {
 	if (event_id == MQTT_EVENT_CONNECTED) {
-		// esp_mqtt_client_subscribe(mqtt_handle, "esp/led/+", 0);
-		// esp_mqtt_client_subscribe(mqtt_handle, "esp/flash/+", 0);
-		esp_mqtt_client_subscribe(mqtt_handle, MKTOPIC("lego/cmd/append"), 0);
-		esp_mqtt_client_subscribe(mqtt_handle, MKTOPIC("lego/button"), 0);
-		esp_mqtt_client_subscribe(mqtt_handle, MKTOPIC("gpio/+/set/+"), 0);
+		for (uint16_t i = 0; i < mqtt_router.nroutes; i++) {
+			esp_mqtt_client_subscribe(
+				mqtt_handle, mqtt_router.routes[i].pattern, mqtt_router.routes[i].qos);
+		}
 		esp_mqtt_client_publish(mqtt_handle, MKTOPIC("status"), "alive", 0, 0, true);
-		xEventGroupSetBits(egroup, MQTT_CONNECTED_BIT);
+		boot_mark(BOOT_MQTT_CONNECTED);
+		xEventGroupClearBits(egroup, MQTT_DOWN_BIT);
+		xEventGroupSetBits(egroup, MQTT_UP_BIT);
 	} else if (event_id == MQTT_EVENT_DISCONNECTED) {
-		ESP_LOGI("lego:mqtt", "MQTT disconnected");
-		vTaskDelay(pdMS_TO_TICKS(1000));
-		ESP_ERROR_CHECK(esp_mqtt_client_reconnect(mqtt_handle));
+		// Also after every failed attempt. Reconnecting is up to mqtt_task_fn(),
+		// the handler must not block the client.
+		atomic_store(&mqtt_online, false);
+		xEventGroupClearBits(egroup, MQTT_UP_BIT);
+		xEventGroupSetBits(egroup, MQTT_DOWN_BIT);
 	} else if (event_id == MQTT_EVENT_DATA) {
-		esp_mqtt_event_t *e = event_data;
-		uint32_t gpio_num = 0, gpio_level = 0;
-
-		if (strncmp(e->topic, MKTOPIC("lego/cmd/append"), e->topic_len) == 0) {
-			uint32_t npackets = e->data_len / sizeof(lego_packet_t);
-			ESP_LOGI("wifi", "Received %lu Lego packets", npackets);
-			// for (uint32_t i = 0; i < pkt_count; i++) {
-			// 	lego_packet_t p = ((lego_packet_t *)e->data)[i];
-			// 	LEGO_PACKET_DUMP("wifi", p);
-			// }
-			memcpy(
-				&lego_state.packets[lego_state.npackets], e->data,
-				npackets * sizeof(lego_packet_t));
-			lego_state.npackets += npackets;
-			if (lego_state.npackets > 0) {
-				xEventGroupSetBits(egroup, LEGO_PKT_FLUSH_BIT);
-			}
-		} else if (strncmp(e->topic, MKTOPIC("lego/cmd/flush"), e->topic_len) == 0) {
-			if (lego_state.npackets == 0) {
-				ESP_LOGW("wifi", "Received flush, but the queue is empty");
-			} else {
-				xEventGroupSetBits(egroup, LEGO_PKT_FLUSH_BIT);
-			}
-		} else if (strncmp(e->topic, MKTOPIC("lego/button"), e->topic_len) == 0) {
-			enum lego_key keys = *e->data;
-			lego_state.pressed_button = keys;
-			xEventGroupSetBits(egroup, LEGO_PKT_CONT_BIT);
-		} else if (sscanf(e->topic, MKTOPIC("gpio/%lu/set/%lu"), &gpio_num, &gpio_level) == 2) {
-			ESP_LOGI("mqtt", "Setting GPIO=%lu to level %lu", gpio_num, gpio_level);
-			gpio_set_level(gpio_num, gpio_level);
-		}
+		mqtt_msg_t msg = {
+			.e = event_data,
+			.ingest_us = lego_metrics_now(&lego_metrics) | 1,
+		};
+		lego_router_dispatch(&mqtt_router, msg.e->topic, msg.e->topic_len, &msg);
 	}
 }
 
@@ -73,8 +433,11 @@ static void esp_generic_event_callback(
 		if (event_id == WIFI_EVENT_STA_START) {
 			xEventGroupSetBits(egroup, WIFI_STARTED_BIT);
 		} else if (event_id == WIFI_EVENT_STA_DISCONNECTED) {
+			// Only the latest of the two matters to wifi_task_fn()
+			xEventGroupClearBits(egroup, WIFI_CONNECTED_BIT | IP_GOT_IP_BIT);
 			xEventGroupSetBits(egroup, WIFI_DISCONNECTED_BIT);
 		} else if (event_id == WIFI_EVENT_STA_CONNECTED) {
+			xEventGroupClearBits(egroup, WIFI_DISCONNECTED_BIT);
 			xEventGroupSetBits(egroup, WIFI_CONNECTED_BIT);
 		}
 	} else if (event_base == IP_EVENT) {
@@ -84,6 +447,7 @@ static void esp_generic_event_callback(
 	}
 }
 
+// Returns right away, wifi_task_fn() connects
 static void configure_wifi(void) {
 	wifi_netif = esp_netif_create_default_wifi_sta();
 	assert(wifi_netif != NULL);
@@ -103,19 +467,29 @@ static void configure_wifi(void) {
 	ESP_ERROR_CHECK(esp_wifi_set_mode(WIFI_MODE_STA));
 	ESP_ERROR_CHECK(esp_wifi_set_config(WIFI_IF_STA, &wifi_cfg));
 
+	const lego_link_config_t link_cfg = {
+		.min_ms = WIFI_BACKOFF_MIN_MS,
+		.max_ms = WIFI_BACKOFF_MAX_MS,
+		.connect_timeout_ms = WIFI_CONNECT_TIMEOUT_MS,
+	};
+	lego_link_init(&wifi_link, &link_cfg, esp_random());
 	ESP_ERROR_CHECK(esp_wifi_start());
-	assert(
-		xEventGroupWaitBits(egroup, WIFI_STARTED_BIT, true, true, pdMS_TO_TICKS(5000)) ==
-		WIFI_STARTED_BIT);
+}
 
-	ESP_ERROR_CHECK(esp_wifi_connect());
-	assert(
-		xEventGroupWaitBits(
-			egroup, WIFI_CONNECTED_BIT | IP_GOT_IP_BIT, true, true, pdMS_TO_TICKS(60 * 1e3)) ==
-		(WIFI_CONNECTED_BIT | IP_GOT_IP_BIT));
-	ESP_LOGI("wifi", "WiFi is ready");
+// Before anything can publish, mqtt_publish() buffers until the client is up
+static void configure_mqtt_outbox(void) {
+	const lego_link_config_t link_cfg = {
+		.min_ms = MQTT_BACKOFF_MIN_MS,
+		.max_ms = MQTT_BACKOFF_MAX_MS,
+		.connect_timeout_ms = MQTT_CONNECT_TIMEOUT_MS,
+	};
+	lego_link_init(&mqtt_link, &link_cfg, esp_random());
+	lego_outbox_init(&mqtt_outbox);
+	mqtt_outbox_lock = xSemaphoreCreateMutex();
+	assert(mqtt_outbox_lock != NULL);
 }
 
+// The client is started by wifi_task_fn() once there is an address
 static void configure_mqtt(void) {
 	const esp_mqtt_client_config_t mqtt_cfg = {
 		.broker.address.uri = MQTT_URI,
@@ -130,29 +504,188 @@ static void configure_mqtt(void) {
 		.session.disable_clean_session = false,
 		.session.keepalive = 5,
 		.session.protocol_ver = MQTT_PROTOCOL_V_5,
+		// See mqtt_task_fn()
+		.network.disable_auto_reconnect = true,
 	};
+	lego_router_init(&mqtt_router);
+	lego_register_routes(&mqtt_router);
+	nes_register_routes(&mqtt_router);
+#if HC_SR04_ENABLED
+	// Only hs_sr04 reads them
+	range_register_routes(&mqtt_router);
+#endif
+	gpio_register_routes(&mqtt_router);
 	mqtt_handle = esp_mqtt_client_init(&mqtt_cfg);
 	assert(mqtt_handle != NULL);
 	ESP_ERROR_CHECK(esp_mqtt_client_register_event(
 		mqtt_handle, ESP_EVENT_ANY_ID, esp_mqtt_event_callback, NULL));
-	ESP_ERROR_CHECK(esp_mqtt_client_start(mqtt_handle));
-	assert(xEventGroupWaitBits(egroup, MQTT_CONNECTED_BIT, true, true, pdMS_TO_TICKS(10000)));
-	ESP_LOGI("mqtt", "MQTT is ready");
 }
 
+// Sends what was buffered while offline, oldest first, and goes online once
+// it is empty so nothing newer overtakes it. The lock is held per message,
+// publishers wait at most for one.
+static void mqtt_flush_outbox(void) {
+	const uint32_t held = mqtt_outbox.live;
+	for (;;) {
+		lego_outbox_msg_t msg;
+		xSemaphoreTake(mqtt_outbox_lock, portMAX_DELAY);
+		if (!lego_outbox_peek(&mqtt_outbox, &msg)) {
+			atomic_store(&mqtt_online, true);
+			xSemaphoreGive(mqtt_outbox_lock);
+			break;
+		}
+		const int err = esp_mqtt_client_publish(
+			mqtt_handle, msg.topic, (const char *)msg.payload, msg.len, 0, false);
+		if (err >= 0) {
+			lego_outbox_pop(&mqtt_outbox);
+		}
+		xSemaphoreGive(mqtt_outbox_lock);
+		if (err < 0) {
+			// Gone again, the rest waits for the next connection
+			return;
+		}
+	}
+	if (held > 0) {
+		ESP_LOGI(
+			"lego:mqtt", "Sent %lu buffered messages, %lu dropped, %lu coalesced", held,
+			mqtt_outbox.dropped, mqtt_outbox.coalesced);
+	}
+}
+
+// Reconnects after the broker or the network goes away, which used to be
+// done by sleeping in esp_mqtt_event_callback(), stalling the client
+static void mqtt_task_fn(void *arg) {
+	for (;;) {
+		uint32_t wait_ms = 0;
+		if (lego_link_poll(&mqtt_link, esp_timer_get_time() / 1000, &wait_ms)) {
+			ESP_LOGI("lego:mqtt", "Reconnecting, attempt %lu", mqtt_link.attempts);
+			if (esp_mqtt_client_reconnect(mqtt_handle) != ESP_OK) {
+				ESP_LOGW("lego:mqtt", "Reconnect refused");
+			}
+		}
+		const EventBits_t bits = xEventGroupWaitBits(
+			egroup, MQTT_UP_BIT | MQTT_DOWN_BIT | MQTT_FLUSH_BIT | MQTT_RETRY_BIT, true, false,
+			pdMS_TO_TICKS(wait_ms));
+		const uint32_t now_ms = esp_timer_get_time() / 1000;
+		if (bits & MQTT_RETRY_BIT) {
+			lego_link_retry(&mqtt_link, now_ms);
+		}
+		if (bits & MQTT_DOWN_BIT) {
+			if (lego_link_is_up(&mqtt_link)) {
+				ESP_LOGW("lego:mqtt", "MQTT disconnected, buffering");
+			}
+			lego_link_down(&mqtt_link, now_ms);
+		} else if (bits & MQTT_UP_BIT) {
+			if (mqtt_link.attempts > 0) {
+				ESP_LOGI("lego:mqtt", "MQTT reconnected after %lu attempts", mqtt_link.attempts);
+			}
+			lego_link_up(&mqtt_link, now_ms);
+			mqtt_flush_outbox();
+		} else if ((bits & MQTT_FLUSH_BIT) && lego_link_is_up(&mqtt_link)) {
+			mqtt_flush_outbox();
+		}
+	}
+}
+
+// Brings the station up in the background and keeps it up, nothing else
+// waits for the access point. Starts the MQTT client on the first address
+// and cuts its backoff short on every later one.
 static void wifi_task_fn(void *arg) {
+	bool mqtt_started = false;
 	for (;;) {
-		EventBits_t bits = xEventGroupWaitBits(
-			egroup, WIFI_DISCONNECTED_BIT | WIFI_CONNECTED_BIT, true, false, pdMS_TO_TICKS(5000));
-		if (bits & WIFI_DISCONNECTED_BIT) {
-			ESP_LOGW("wifi", "WiFi disconnected");
+		uint32_t wait_ms = 0;
+		if (lego_link_poll(&wifi_link, esp_timer_get_time() / 1000, &wait_ms)) {
+			ESP_LOGI("wifi", "Reconnecting, attempt %lu", wifi_link.attempts);
+			esp_wifi_connect();
+		}
+		const EventBits_t bits = xEventGroupWaitBits(
+			egroup, WIFI_STARTED_BIT | WIFI_DISCONNECTED_BIT | WIFI_CONNECTED_BIT | IP_GOT_IP_BIT,
+			true, false, pdMS_TO_TICKS(wait_ms));
+		const uint32_t now_ms = esp_timer_get_time() / 1000;
+		if (bits & WIFI_STARTED_BIT) {
+			boot_mark(BOOT_WIFI_STARTED);
 			esp_wifi_connect();
-		} else if (bits & WIFI_CONNECTED_BIT) {
-			ESP_LOGI("wifi", "WiFi reconnected");
+		}
+		if (bits & WIFI_DISCONNECTED_BIT) {
+			// Also after every failed attempt
+			if (lego_link_is_up(&wifi_link)) {
+				ESP_LOGW("wifi", "WiFi disconnected");
+			}
+			lego_link_down(&wifi_link, now_ms);
+		}
+		if (bits & WIFI_CONNECTED_BIT) {
+			boot_mark(BOOT_WIFI_CONNECTED);
+			lego_link_up(&wifi_link, now_ms);
+			ESP_LOGI("wifi", "WiFi connected");
+		}
+		if (bits & IP_GOT_IP_BIT) {
+			boot_mark(BOOT_GOT_IP);
+			if (!mqtt_started) {
+				ESP_ERROR_CHECK(esp_mqtt_client_start(mqtt_handle));
+				mqtt_started = true;
+			} else {
+				xEventGroupSetBits(egroup, MQTT_RETRY_BIT);
+			}
+		}
+	}
+}
+
+static void lego_trace_sync_fn(void *arg) {
+	lego_trace_header_t *header = arg;
+	const uint32_t core = esp_cpu_get_core_id();
+	header->sync[core].cycles = esp_cpu_get_cycle_count();
+	header->sync[core].us = esp_timer_get_time();
+}
+
+// Empties the trace ring onto esp/1/trace, see lego_trace.h for the format.
+// Records that can't be published are counted as lost.
+static void mqtt_publish_trace(void) {
+	// Too much to buffer, while offline the ring keeps the newest records
+	if (!atomic_load(&mqtt_online)) {
+		return;
+	}
+	static struct {
+		lego_trace_header_t header;
+		lego_trace_record_t records[LEGO_TRACE_CHUNK];
+	} msg;
+	uint32_t count = LEGO_TRACE_CHUNK;
+	while (count == LEGO_TRACE_CHUNK) {
+		count = lego_trace_drain(&lego_trace_log, msg.records, LEGO_TRACE_CHUNK);
+		if (count == 0) {
+			break;
+		}
+		msg.header = (lego_trace_header_t){
+			.magic = LEGO_TRACE_MAGIC,
+			.version = LEGO_TRACE_VERSION,
+			.cpu_mhz = esp_clk_cpu_freq() / 1000000,
+			.lost = lego_trace_log.lost,
+			.count = count,
+			.cores = portNUM_PROCESSORS,
+		};
+#if CONFIG_FREERTOS_UNICORE
+		lego_trace_sync_fn(&msg.header);
+#else
+		for (uint32_t core = 0; core < portNUM_PROCESSORS; core++) {
+			ESP_ERROR_CHECK(esp_ipc_call_blocking(core, lego_trace_sync_fn, &msg.header));
+		}
+#endif
+		const int len = sizeof(msg.header) + count * sizeof(lego_trace_record_t);
+		if (esp_mqtt_client_publish(
+				mqtt_handle, MKTOPIC("trace"), (const char *)&msg, len, 0, false) < 0) {
+			lego_trace_log.lost += count;
 		}
 	}
 }
 
+// Lowest priority above idle, the trace only goes out when nothing else
+// wants the CPU
+static void lego_trace_task_fn(void *arg) {
+	for (;;) {
+		vTaskDelay(pdMS_TO_TICKS(LEGO_TRACE_PERIOD_MS));
+		mqtt_publish_trace();
+	}
+}
+
 static void mqtt_publish_result(esp_err_t err) {
 	static const char *topic = MKTOPIC("lego/cmd/callback");
 	const char *payload = NULL;
@@ -173,7 +706,86 @@ static void mqtt_publish_result(esp_err_t err) {
 		payload = "unknown_error";
 		break;
 	}
-	esp_mqtt_client_publish(mqtt_handle, topic, payload, 0, 0, false);
+	mqtt_publish(topic, payload, 0, false);
+}
+
+// What lego_controller has to say, posted as plain values and formatted,
+// logged and published by lego_report_task_fn() on NET_CORE. The IR core
+// never waits for snprintf(), the outbox lock or the client, and the
+// controller stack needs no room for payloads.
+enum lego_report_kind {
+	LEGO_REPORT_ACK_DONE,
+	LEGO_REPORT_CHANNEL_STATS,
+	LEGO_REPORT_BUTTON_STATS,
+	LEGO_REPORT_BATCH_DONE,
+	LEGO_REPORT_METRICS,
+};
+
+typedef struct {
+	enum lego_report_kind kind;
+	union {
+		struct {
+			uint16_t seq;
+			uint32_t done_us;
+			uint32_t latency_us;
+		} ack_done;
+		struct {
+			uint32_t depth[4];
+			uint32_t rate[4];
+		} channel_stats;
+		lego_button_stats_t button_stats;
+		struct {
+			uint32_t packets;
+			uint32_t packets_per_s;
+			uint32_t cycles_per_packet;
+		} batch_done;
+		lego_hist_summary_t metrics[LEGO_STAGE_COUNT];
+	};
+} lego_report_t;
+
+static QueueHandle_t lego_report_queue = NULL;
+// Reports lego_report_queue had no room for, only written by the poster
+static uint32_t lego_report_dropped = 0;
+
+static void configure_lego_reports(void) {
+	lego_report_queue = xQueueCreate(LEGO_REPORT_QUEUE_LEN, sizeof(lego_report_t));
+	assert(lego_report_queue != NULL);
+}
+
+// Never blocks, a report that doesn't fit is dropped and counted
+static void lego_report_post(const lego_report_t *report) {
+	if (xQueueSend(lego_report_queue, report, 0) != pdTRUE) {
+		lego_report_dropped++;
+	}
+}
+
+static void lego_report_task_fn(void *arg) {
+	for (;;) {
+		lego_report_t report;
+		xQueueReceive(lego_report_queue, &report, portMAX_DELAY);
+		switch (report.kind) {
+		case LEGO_REPORT_ACK_DONE:
+			mqtt_publish_ack_done(
+				report.ack_done.seq, report.ack_done.done_us, report.ack_done.latency_us);
+			break;
+		case LEGO_REPORT_CHANNEL_STATS:
+			mqtt_publish_channel_stats(report.channel_stats.depth, report.channel_stats.rate);
+			break;
+		case LEGO_REPORT_BUTTON_STATS:
+			mqtt_publish_button_stats(&report.button_stats);
+			break;
+		case LEGO_REPORT_BATCH_DONE:
+			mqtt_publish_result(ESP_OK);
+			ESP_LOGI(
+				"lego", "Sent %lu packets, %lu packets/s, encoder: %lu cycles/packet",
+				report.batch_done.packets, report.batch_done.packets_per_s,
+				report.batch_done.cycles_per_packet);
+			break;
+		case LEGO_REPORT_METRICS:
+			mqtt_publish_metrics(report.metrics);
+			break;
+		}
+	}
 }
 
 #endif
@@ -0,0 +1,166 @@
+#ifndef TELEMETRY_H_INCLUDED
+#define TELEMETRY_H_INCLUDED
+
+#include <stdarg.h>
+#include <string.h>
+
+#include "esp_heap_caps.h"
+#include "esp_timer.h"
+#include "mqtt_client.h"
+
+#include "freertos/FreeRTOS.h"
+#include "freertos/queue.h"
+#include "freertos/task.h"
+
+#include "defs.h"
+#include "ir.h"
+#include "networking.h"
+
+// uxTaskGetSystemState() reports no tasks at all when there are more
+#define TELEMETRY_MAX_TASKS 24
+
+#define TELEMETRY_HEAP_FMT "\"%s\":{\"free\":%u,\"min\":%u,\"largest\":%u}"
+#define TELEMETRY_QUEUES_FMT                                                                       \
+	"\"queues\":{\"rmt\":%lu,\"rx_chunks\":%lu,\"rx_packets\":%lu,\"rx_stopped\":%lu,"             \
+	"\"nes\":%lu,\"lego\":[%lu,%lu,%lu,%lu],\"reports\":%lu,\"reports_dropped\":%lu,"              \
+	"\"mqtt_outbox\":%d,\"trace_lost\":%lu}"
+#define TELEMETRY_OFFLINE_FMT                                                                      \
+	"\"offline\":{\"held\":%lu,\"dropped\":%lu,\"coalesced\":%lu,\"outages\":%lu}"
+#define TELEMETRY_TASK_FMT                                                                         \
+	"{\"name\":\"%s\",\"prio\":%u,\"core\":%d,\"stack_free\":%lu,\"cpu\":%lu}"
+// Upper bounds of the report, counting every conversion as 11 characters:
+// everything up to the task list, with room for the heap and boot names,
+// and a task with a full name and its comma
+#define TELEMETRY_HEAD_MAX                                                                         \
+	(64 + 4 * (sizeof(TELEMETRY_HEAP_FMT) + 16 + 3 * 11) + BOOT_PHASE_COUNT * (32 + 11) +          \
+	 sizeof(TELEMETRY_QUEUES_FMT) + 13 * 11 + sizeof(TELEMETRY_OFFLINE_FMT) + 4 * 11)
+#define TELEMETRY_TASK_MAX (sizeof(TELEMETRY_TASK_FMT) + configMAX_TASK_NAME_LEN + 4 * 11 + 1)
+
+#define TELEMETRY_BOOT_NAME(id, name) [BOOT_##id] = name,
+static const char *telemetry_boot_names[BOOT_PHASE_COUNT] = {BOOT_PHASES(TELEMETRY_BOOT_NAME)};
+#undef TELEMETRY_BOOT_NAME
+
+static const struct {
+	const char *name;
+	uint32_t caps;
+} telemetry_heaps[] = {
+	{"8bit", MALLOC_CAP_8BIT},
+	{"32bit", MALLOC_CAP_32BIT},
+	{"dma", MALLOC_CAP_DMA},
+	{"internal", MALLOC_CAP_INTERNAL},
+};
+_Static_assert(sizeof(telemetry_heaps) / sizeof(telemetry_heaps[0]) <= 4, "See TELEMETRY_HEAD_MAX");
+
+// Run time counters of the previous sample, by task number
+static struct {
+	UBaseType_t number;
+	uint32_t run_time;
+} telemetry_prev[TELEMETRY_MAX_TASKS];
+static uint32_t telemetry_nprev = 0;
+
+static void telemetry_append(char *buf, size_t size, int *len, const char *fmt, ...) {
+	if (*len >= size) {
+		return;
+	}
+	va_list args;
+	va_start(args, fmt);
+	*len += vsnprintf(buf + *len, size - *len, fmt, args);
+	va_end(args);
+}
+
+static uint32_t telemetry_queue_depth(QueueHandle_t queue) {
+	return queue != NULL ? uxQueueMessagesWaiting(queue) : 0;
+}
+
+// CPU time of a task since the last sample
+static uint32_t telemetry_run_time_delta(const TaskStatus_t *task) {
+	for (uint32_t i = 0; i < telemetry_nprev; i++) {
+		if (telemetry_prev[i].number == task->xTaskNumber) {
+			return task->ulRunTimeCounter - telemetry_prev[i].run_time;
+		}
+	}
+	return task->ulRunTimeCounter;
+}
+
+// Stack headroom in bytes and CPU share in permille of one core over the
+// last period per task, free heap per capability and the queue depths along
+// the command path, as JSON on esp/1/telemetry
+static void mqtt_publish_telemetry(void) {
+	static TaskStatus_t tasks[TELEMETRY_MAX_TASKS];
+	static char payload[TELEMETRY_HEAD_MAX + TELEMETRY_MAX_TASKS * TELEMETRY_TASK_MAX];
+	static uint32_t prev_total = 0;
+	uint32_t total = 0;
+	const UBaseType_t ntasks = uxTaskGetSystemState(tasks, TELEMETRY_MAX_TASKS, &total);
+	// Run time stats count esp_timer us, per core
+	const uint32_t elapsed = total - prev_total;
+	prev_total = total;
+
+	int len = 0;
+	telemetry_append(
+		payload, sizeof(payload), &len, "{\"uptime_ms\":%lld,\"ntasks\":%u,\"heap\":{",
+		esp_timer_get_time() / 1000, uxTaskGetNumberOfTasks());
+	for (uint32_t i = 0; i < sizeof(telemetry_heaps) / sizeof(telemetry_heaps[0]); i++) {
+		const uint32_t caps = telemetry_heaps[i].caps;
+		telemetry_append(
+			payload, sizeof(payload), &len, TELEMETRY_HEAP_FMT "%s", telemetry_heaps[i].name,
+			heap_caps_get_free_size(caps), heap_caps_get_minimum_free_size(caps),
+			heap_caps_get_largest_free_block(caps),
+			i + 1 < sizeof(telemetry_heaps) / sizeof(telemetry_heaps[0]) ? "," : "},");
+	}
+
+	// us since boot, 0 for phases not reached yet
+	telemetry_append(payload, sizeof(payload), &len, "\"boot\":{");
+	for (uint32_t i = 0; i < BOOT_PHASE_COUNT; i++) {
+		telemetry_append(
+			payload, sizeof(payload), &len, "\"%s\":%lu%s", telemetry_boot_names[i],
+			atomic_load(&boot_us[i]), i + 1 < BOOT_PHASE_COUNT ? "," : "},");
+	}
+
+	lego_ring_t *queues = lego_state.sched.queues;
+	telemetry_append(
+		payload, sizeof(payload), &len,
+		TELEMETRY_QUEUES_FMT "," TELEMETRY_OFFLINE_FMT ",\"tasks\":[", lego_tx_inflight(),
+		telemetry_queue_depth(rx_chunk_queue), telemetry_queue_depth(lego_rx_queue),
+		atomic_load(&ir_rx_stopped), telemetry_queue_depth(nes_button_queue),
+		lego_ring_count(&queues[0]), lego_ring_count(&queues[1]), lego_ring_count(&queues[2]),
+		lego_ring_count(&queues[3]),
+		telemetry_queue_depth(lego_report_queue), lego_report_dropped,
+		esp_mqtt_client_get_outbox_size(mqtt_handle), lego_trace_log.lost, mqtt_outbox.live,
+		mqtt_outbox.dropped, mqtt_outbox.coalesced, mqtt_link.outages);
+	for (UBaseType_t i = 0; i < ntasks; i++) {
+		const TaskStatus_t *task = &tasks[i];
+		const uint32_t cpu =
+			elapsed > 0 ? (uint64_t)telemetry_run_time_delta(task) * 1000 / elapsed : 0;
+		telemetry_append(
+			payload, sizeof(payload), &len, TELEMETRY_TASK_FMT "%s", task->pcTaskName,
+			task->uxCurrentPriority, task->xCoreID == tskNO_AFFINITY ? -1 : (int)task->xCoreID,
+			task->usStackHighWaterMark, cpu, i + 1 < ntasks ? "," : "");
+		if (task->usStackHighWaterMark < TELEMETRY_STACK_MIN_FREE) {
+			ESP_LOGW(
+				"telemetry", "%s is down to %lu bytes of stack", task->pcTaskName,
+				task->usStackHighWaterMark);
+		}
+	}
+	telemetry_append(payload, sizeof(payload), &len, "]}");
+
+	for (telemetry_nprev = 0; telemetry_nprev < ntasks; telemetry_nprev++) {
+		telemetry_prev[telemetry_nprev].number = tasks[telemetry_nprev].xTaskNumber;
+		telemetry_prev[telemetry_nprev].run_time = tasks[telemetry_nprev].ulRunTimeCounter;
+	}
+
+	if (len >= sizeof(payload)) {
+		ESP_LOGW("telemetry", "Report truncated, %d bytes", len);
+		return;
+	}
+	mqtt_publish(MKTOPIC("telemetry"), payload, len, true);
+}
+
+static void telemetry_task_fn(void *arg) {
+	TickType_t wake = xTaskGetTickCount();
+	for (;;) {
+		mqtt_publish_telemetry();
+		vTaskDelayUntil(&wake, pdMS_TO_TICKS(TELEMETRY_PERIOD_MS));
+	}
+}
+
+#endif
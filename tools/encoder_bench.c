@@ -0,0 +1,392 @@
+// Host test and benchmark for lego_encoder.c, run against mocks of the RMT
+// copy and bytes encoders. Build and run from the repo root:
+//
+//	gcc -std=gnu11 -O2 -Imain -o encoder_bench tools/encoder_bench.c main/lego_encoder.c
+//		main/lego_frame.c main/lego_timing.c
+//	./encoder_bench -n 1000000 -b 64
+//
+// The mocks write into a channel memory of -b symbols and report mem-full
+// whenever it fills up, together with complete when a part ends right there,
+// the way the driver's encoders do; the driver stand-in then empties it and
+// calls the encoder again. Every combo direct, single output PWM and combo
+// PWM frame is decoded back from the symbols and checked for its checksum,
+// the single key toggle bit and the bit order, in both encoder modes. A mixed
+// sequence with retransmit gaps is then encoded with every memory size from 1
+// to 64 symbols and has to come out the same as when it fits at once. Last,
+// both modes are timed in ns per packet, mocks included.
+
+#include <getopt.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "lego_encoder.h"
+
+// Same values as defs.h, which needs ESP-IDF
+#define IR_TX_BATCH_PACKETS 8
+#define IR_TX_MIN_GAP_US 2000
+
+#define MAX_PACKETS 64
+#define MAX_SYMBOLS (MAX_PACKETS * (LEGO_TIMING_GAP_SYMBOLS + LEGO_FRAME_SYMBOLS))
+
+// Channel memory and what went out on the air
+struct rmt_channel_t {
+	uint32_t block;
+	uint32_t mem_off;
+	rmt_symbol_word_t *air;
+	uint32_t nair;
+	uint32_t max;
+};
+
+typedef struct {
+	rmt_encoder_t base;
+	// Where the current input resumes, in symbols or bits
+	uint32_t index;
+} mock_encoder_t;
+
+static const rmt_symbol_word_t bit_symbols[2] = {LEGO_BIT0_SYMBOL, LEGO_BIT1_SYMBOL};
+
+static bool mock_put(struct rmt_channel_t *chan, rmt_symbol_word_t symbol) {
+	if (chan->mem_off == chan->block) {
+		return false;
+	}
+	chan->mem_off++;
+	if (chan->nair < chan->max) {
+		chan->air[chan->nair] = symbol;
+	}
+	chan->nair++;
+	return true;
+}
+
+// Both flags when the part fills the memory exactly, as the driver's
+// encoders report it
+static void mock_state(
+	mock_encoder_t *mock, const struct rmt_channel_t *chan, uint32_t n,
+	rmt_encode_state_t *ret_state) {
+	*ret_state = RMT_ENCODING_RESET;
+	if (mock->index == n) {
+		mock->index = 0;
+		*ret_state |= RMT_ENCODING_COMPLETE;
+	}
+	if (chan->mem_off == chan->block) {
+		*ret_state |= RMT_ENCODING_MEM_FULL;
+	}
+}
+
+static size_t mock_copy_encode(
+	rmt_encoder_t *encoder, rmt_channel_handle_t tx_channel, const void *primary_data,
+	size_t data_size, rmt_encode_state_t *ret_state) {
+	mock_encoder_t *mock = (mock_encoder_t *)encoder;
+	const rmt_symbol_word_t *symbols = primary_data;
+	const uint32_t n = data_size / sizeof(rmt_symbol_word_t);
+	size_t encoded = 0;
+	while (mock->index < n && mock_put(tx_channel, symbols[mock->index])) {
+		mock->index++;
+		encoded++;
+	}
+	mock_state(mock, tx_channel, n, ret_state);
+	return encoded;
+}
+
+// MSB first, like the bytes encoder lego_encoder_new() makes
+static size_t mock_bytes_encode(
+	rmt_encoder_t *encoder, rmt_channel_handle_t tx_channel, const void *primary_data,
+	size_t data_size, rmt_encode_state_t *ret_state) {
+	mock_encoder_t *mock = (mock_encoder_t *)encoder;
+	const uint8_t *bytes = primary_data;
+	const uint32_t n = data_size * 8;
+	size_t encoded = 0;
+	while (mock->index < n) {
+		const uint8_t bit = (bytes[mock->index / 8] >> (7 - mock->index % 8)) & 1;
+		if (!mock_put(tx_channel, bit_symbols[bit])) {
+			break;
+		}
+		mock->index++;
+		encoded++;
+	}
+	mock_state(mock, tx_channel, n, ret_state);
+	return encoded;
+}
+
+static esp_err_t mock_reset(rmt_encoder_t *encoder) {
+	((mock_encoder_t *)encoder)->index = 0;
+	return ESP_OK;
+}
+
+static esp_err_t mock_del(rmt_encoder_t *encoder) {
+	return ESP_OK;
+}
+
+static mock_encoder_t mock_copy = {
+	.base = {.encode = mock_copy_encode, .reset = mock_reset, .del = mock_del},
+};
+static mock_encoder_t mock_bytes = {
+	.base = {.encode = mock_bytes_encode, .reset = mock_reset, .del = mock_del},
+};
+
+static void encoder_init(
+	lego_encoder_t *enc, enum lego_encoder_mode mode, bool retransmit_windows) {
+	const lego_encoder_config_t config = {
+		.mode = mode,
+		.timing.min_gap_us = IR_TX_MIN_GAP_US,
+		.timing.retransmit_windows = retransmit_windows,
+	};
+	memset(enc, 0, sizeof(*enc));
+	mock_reset(&mock_copy.base);
+	mock_reset(&mock_bytes.base);
+	lego_encoder_init(enc, &config, &mock_copy.base, &mock_bytes.base);
+}
+
+// What rmt_transmit() and the TX interrupt do with the encoder: call it
+// until it completes, emptying the memory every time it is full
+static bool transmit(
+	lego_encoder_t *enc, struct rmt_channel_t *chan, const lego_packet_t *pkts, uint32_t n) {
+	chan->mem_off = 0;
+	for (uint32_t calls = 0; calls <= MAX_SYMBOLS; calls++) {
+		rmt_encode_state_t state = RMT_ENCODING_RESET;
+		enc->base.encode(&enc->base, chan, pkts, n * sizeof(lego_packet_t), &state);
+		if (state & RMT_ENCODING_COMPLETE) {
+			return true;
+		}
+		if (!(state & RMT_ENCODING_MEM_FULL)) {
+			return false;
+		}
+		chan->mem_off = 0;
+	}
+	return false;
+}
+
+// The symbols `pkts` have to come out as, from the timing model and the
+// frame builder instead of the encoder
+static uint32_t
+reference(bool retransmit_windows, const lego_packet_t *pkts, uint32_t n, rmt_symbol_word_t *out) {
+	const lego_timing_config_t config = {
+		.min_gap_us = IR_TX_MIN_GAP_US,
+		.retransmit_windows = retransmit_windows,
+	};
+	lego_timing_t timing;
+	lego_timing_init(&timing, &config);
+	uint32_t nout = 0;
+	for (uint32_t i = 0; i < n; i++) {
+		nout += lego_frame_gap(lego_timing_schedule(&timing, &pkts[i]), &out[nout]);
+		const lego_packet_t prepared = lego_packet_prepare(pkts[i]);
+		lego_frame_build(&prepared, &out[nout]);
+		nout += LEGO_FRAME_SYMBOLS;
+	}
+	return nout;
+}
+
+static bool symbol_is(rmt_symbol_word_t symbol, uint32_t space) {
+	return symbol.level0 == 1 && symbol.duration0 == LEGO_MARK_TICKS && symbol.level1 == 0 &&
+		   symbol.duration1 == space;
+}
+
+// The word of the first frame after the gap, false if the symbols are not a
+// frame
+static bool decode_frame(const rmt_symbol_word_t *air, uint32_t nair, uint16_t *raw) {
+	uint32_t i = 0;
+	while (i < nair && air[i].level0 == 0 && air[i].level1 == 0) {
+		i++;
+	}
+	if (nair - i != LEGO_FRAME_SYMBOLS || !symbol_is(air[i], LEGO_START_SPACE_TICKS) ||
+		!symbol_is(air[i + LEGO_FRAME_SYMBOLS - 1], LEGO_END_SPACE_TICKS)) {
+		return false;
+	}
+	*raw = 0;
+	for (uint32_t bit = 0; bit < 16; bit++) {
+		const rmt_symbol_word_t symbol = air[i + 1 + bit];
+		if (!symbol_is(symbol, LEGO_BIT0_SPACE_TICKS) &&
+			!symbol_is(symbol, LEGO_BIT1_SPACE_TICKS)) {
+			return false;
+		}
+		// First on the air is the most significant bit
+		*raw = *raw << 1 | symbol_is(symbol, LEGO_BIT1_SPACE_TICKS);
+	}
+	return true;
+}
+
+static const char *mode_names[] = {
+	[LEGO_ENCODER_MODE_BYTES] = "bytes",
+	[LEGO_ENCODER_MODE_TABLE] = "table",
+};
+
+// Combo direct with the mode left 0 as older clients send it, then single
+// output and combo PWM at a few speeds
+static uint32_t all_packets(lego_packet_t *pkts) {
+	uint32_t n = 0;
+	for (uint8_t ch = 0; ch < 4; ch++) {
+		for (uint8_t key = 0; key < 16; key++) {
+			pkts[n++] = (lego_packet_t){.channel = ch, .key = key};
+		}
+		for (int8_t speed = -LEGO_PWM_STEPS; speed <= LEGO_PWM_STEPS; speed += 7) {
+			pkts[n++] = lego_packet_pwm(ch, speed > 0, lego_pwm_step(speed), ch & 1);
+			pkts[n++] = lego_packet_combo_pwm(ch, lego_pwm_step(speed), LEGO_PWM_BRAKE);
+		}
+	}
+	return n;
+}
+
+static bool is_single_key(const lego_packet_t *pkt) {
+	return lego_packet_is_combo_direct(pkt) &&
+		   (pkt->key == LEGO_LB || pkt->key == LEGO_LF || pkt->key == LEGO_RF ||
+			pkt->key == LEGO_RB);
+}
+
+static uint32_t check_frames(enum lego_encoder_mode mode) {
+	static lego_packet_t pkts[4 * 16 + 4 * 6];
+	static rmt_symbol_word_t air[MAX_SYMBOLS], want[MAX_SYMBOLS];
+	const uint32_t npkts = all_packets(pkts);
+	uint32_t failures = 0;
+	for (uint32_t i = 0; i < npkts; i++) {
+		lego_encoder_t enc;
+		encoder_init(&enc, mode, false);
+		struct rmt_channel_t chan = {.block = MAX_SYMBOLS, .air = air, .max = MAX_SYMBOLS};
+		uint16_t raw = 0;
+		if (!transmit(&enc, &chan, &pkts[i], 1) || !decode_frame(air, chan.nair, &raw)) {
+			printf("FAIL %s: no frame for %04x\n", mode_names[mode], lego_packet_raw(&pkts[i]));
+			failures++;
+			continue;
+		}
+		const uint8_t checksum = 0xf ^ (raw >> 12) ^ ((raw >> 8) & 0xf) ^ ((raw >> 4) & 0xf);
+		const lego_packet_t prepared = lego_packet_prepare(pkts[i]);
+		const uint32_t nwant = reference(false, &pkts[i], 1, want);
+		const char *fail = NULL;
+		if ((raw & 0xf) != checksum) {
+			fail = "checksum";
+		} else if (
+			lego_packet_is_combo_direct(&pkts[i]) && (raw >> 15) != is_single_key(&pkts[i])) {
+			fail = "single key toggle bit";
+		} else if (raw != lego_packet_raw(&prepared)) {
+			fail = "bit order";
+		} else if (chan.nair != nwant || memcmp(air, want, nwant * sizeof(air[0])) != 0) {
+			fail = "symbols";
+		}
+		if (fail != NULL) {
+			printf(
+				"FAIL %s: %s of %04x, sent %04x\n", mode_names[mode], fail,
+				lego_packet_raw(&prepared), raw);
+			failures++;
+		}
+	}
+	printf(
+		"%s: %s mode, %u frames decoded back\n", failures == 0 ? "ok" : "FAIL", mode_names[mode],
+		npkts);
+	return failures;
+}
+
+static uint64_t rng_state = 1;
+
+static uint32_t rng_next(void) {
+	rng_state ^= rng_state << 13;
+	rng_state ^= rng_state >> 7;
+	rng_state ^= rng_state << 17;
+	return rng_state >> 32;
+}
+
+// Runs of the same packet, so the retransmit windows put gaps of several
+// symbols in between
+static uint32_t mixed_sequence(lego_packet_t *seq) {
+	static lego_packet_t pkts[4 * 16 + 4 * 6];
+	const uint32_t npkts = all_packets(pkts);
+	uint32_t n = 0;
+	while (n < MAX_PACKETS) {
+		const lego_packet_t pkt = pkts[rng_next() % npkts];
+		for (uint32_t run = 1 + rng_next() % 5; run > 0 && n < MAX_PACKETS; run--) {
+			seq[n++] = pkt;
+		}
+	}
+	return n;
+}
+
+static uint32_t check_resume(enum lego_encoder_mode mode) {
+	static lego_packet_t seq[MAX_PACKETS];
+	static rmt_symbol_word_t air[MAX_SYMBOLS], want[MAX_SYMBOLS];
+	const uint32_t nseq = mixed_sequence(seq);
+	const uint32_t nwant = reference(true, seq, nseq, want);
+	uint32_t failures = 0;
+	for (uint32_t block = 1; block <= 64; block++) {
+		lego_encoder_t enc;
+		encoder_init(&enc, mode, true);
+		struct rmt_channel_t chan = {.block = block, .air = air, .max = MAX_SYMBOLS};
+		bool done = true;
+		for (uint32_t i = 0; i < nseq && done; i += IR_TX_BATCH_PACKETS) {
+			const uint32_t n = nseq - i < IR_TX_BATCH_PACKETS ? nseq - i : IR_TX_BATCH_PACKETS;
+			done = transmit(&enc, &chan, &seq[i], n);
+		}
+		uint32_t diff = 0;
+		while (diff < chan.nair && diff < nwant && air[diff].val == want[diff].val) {
+			diff++;
+		}
+		if (!done || chan.nair != nwant || diff != nwant) {
+			printf(
+				"FAIL %s: %u symbol memory, %u of %u symbols, first difference at %u\n",
+				mode_names[mode], block, chan.nair, nwant, diff);
+			failures++;
+		}
+	}
+	printf(
+		"%s: %s mode, %u packets resumed at every memory size\n", failures == 0 ? "ok" : "FAIL",
+		mode_names[mode], nseq);
+	return failures;
+}
+
+static double now_s(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static void bench(enum lego_encoder_mode mode, uint32_t npackets, uint32_t block) {
+	static lego_packet_t seq[MAX_PACKETS];
+	const uint32_t nseq = mixed_sequence(seq);
+	lego_encoder_t enc;
+	encoder_init(&enc, mode, true);
+	// Symbols are counted, not kept
+	struct rmt_channel_t chan = {.block = block};
+	uint32_t sent = 0;
+	const double start = now_s();
+	while (sent < npackets) {
+		const uint32_t i = sent % (nseq - IR_TX_BATCH_PACKETS + 1);
+		transmit(&enc, &chan, &seq[i], IR_TX_BATCH_PACKETS);
+		sent += IR_TX_BATCH_PACKETS;
+	}
+	const double elapsed = now_s() - start;
+	printf(
+		"%s: %6.1f ns/packet, %5.1f ns/packet in encode, %u symbol memory\n", mode_names[mode],
+		elapsed * 1e9 / sent, (double)enc.encode_cycles / enc.encoded_packets, block);
+}
+
+int main(int argc, char **argv) {
+	uint32_t npackets = 1000000;
+	uint32_t block = 64;
+	int opt;
+	while ((opt = getopt(argc, argv, "n:b:")) != -1) {
+		switch (opt) {
+		case 'n':
+			npackets = strtoul(optarg, NULL, 0);
+			break;
+		case 'b':
+			block = strtoul(optarg, NULL, 0);
+			break;
+		default:
+			fprintf(stderr, "usage: %s [-n packets] [-b memory symbols]\n", argv[0]);
+			return 2;
+		}
+	}
+	if (block == 0) {
+		fprintf(stderr, "-b must be at least 1\n");
+		return 2;
+	}
+
+	uint32_t failures = 0;
+	failures += check_frames(LEGO_ENCODER_MODE_BYTES);
+	failures += check_frames(LEGO_ENCODER_MODE_TABLE);
+	failures += check_resume(LEGO_ENCODER_MODE_BYTES);
+	failures += check_resume(LEGO_ENCODER_MODE_TABLE);
+	if (npackets > 0) {
+		bench(LEGO_ENCODER_MODE_BYTES, npackets, block);
+		bench(LEGO_ENCODER_MODE_TABLE, npackets, block);
+	}
+	return failures == 0 ? 0 : 1;
+}
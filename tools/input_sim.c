@@ -0,0 +1,146 @@
+// Host test of lego_input.c against bouncing buttons. Build and run from
+// the repo root:
+//
+//	gcc -std=gnu11 -O2 -Imain -o input_sim tools/input_sim.c main/lego_input.c
+//	./input_sim
+//
+// Every pin gets its own sequence of presses with a few ms of contact bounce
+// on both edges, plus glitches shorter than the debounce time. Time runs in
+// 50 us steps, edges go to lego_input_edge() as the ISR would, and the scan
+// runs every INPUT_SCAN_MS like the firmware's. Checks that each press and
+// release comes out once, stamped with its first bounce, that glitches don't
+// and that long presses are reported once.
+
+#include <stdio.h>
+
+#include "lego_input.h"
+
+// Same values as defs.h, which needs ESP-IDF
+#define INPUT_SCAN_MS 5
+#define INPUT_DEBOUNCE_MS 20
+#define INPUT_LONG_PRESS_MS 800
+
+#define SIM_STEP_US 50
+#define BOUNCE_US 4000
+#define NPRESSES 20
+
+static uint64_t rng_state = 1;
+
+static uint32_t rng_next(void) {
+	rng_state ^= rng_state << 13;
+	rng_state ^= rng_state >> 7;
+	rng_state ^= rng_state << 17;
+	return rng_state >> 32;
+}
+
+typedef struct {
+	// Clean level changes, pressed from down_us[k] to up_us[k]
+	uint32_t down_us[NPRESSES];
+	uint32_t up_us[NPRESSES];
+	uint32_t glitch_us[NPRESSES];
+	bool level;
+	// What came out of the scan
+	uint32_t presses, releases, longs;
+	uint32_t failures;
+} pin_model_t;
+
+static pin_model_t pins[LEGO_INPUT_MAX];
+
+// Pressed, with bounce after each clean change and a 1-3 ms glitch while
+// released
+static bool pin_level(const pin_model_t *pin, uint32_t t) {
+	for (uint32_t k = 0; k < NPRESSES; k++) {
+		if (t >= pin->down_us[k] && t < pin->up_us[k]) {
+			if (t - pin->down_us[k] < BOUNCE_US) {
+				return (t - pin->down_us[k]) / (300 + k * 50) % 3 != 1;
+			}
+			return true;
+		}
+		if (t >= pin->up_us[k] && t - pin->up_us[k] < BOUNCE_US) {
+			return (t - pin->up_us[k]) / (300 + k * 50) % 3 == 1;
+		}
+		if (t >= pin->glitch_us[k] && t - pin->glitch_us[k] < 1000 + k % 3 * 1000) {
+			return true;
+		}
+	}
+	return false;
+}
+
+int main(void) {
+	static lego_input_t in;
+	lego_input_init(&in, LEGO_INPUT_MAX, INPUT_SCAN_MS, INPUT_DEBOUNCE_MS, INPUT_LONG_PRESS_MS);
+	uint32_t end_us = 0;
+	for (uint8_t i = 0; i < LEGO_INPUT_MAX; i++) {
+		// Changes land on a step, so the first edge is right at them
+		uint32_t t = (10000 + rng_next() % 50000) / SIM_STEP_US * SIM_STEP_US;
+		for (uint32_t k = 0; k < NPRESSES; k++) {
+			pins[i].down_us[k] = t;
+			// Every fourth press is long
+			const uint32_t held_us =
+				(k % 4 == 3 ? 900000 + rng_next() % 100000 : 40000 + rng_next() % 200000) /
+				SIM_STEP_US * SIM_STEP_US;
+			pins[i].up_us[k] = t + held_us;
+			pins[i].glitch_us[k] = pins[i].up_us[k] + BOUNCE_US + 10000 + rng_next() % 10000;
+			// Far enough from the glitch for its stamp to be dropped
+			t = (pins[i].glitch_us[k] + 30000 + rng_next() % 100000) / SIM_STEP_US * SIM_STEP_US;
+		}
+		end_us = t > end_us ? t : end_us;
+	}
+
+	uint32_t edges = 0;
+	for (uint32_t t = 0; t < end_us + 100000; t += SIM_STEP_US) {
+		uint32_t pressed = 0;
+		for (uint8_t i = 0; i < LEGO_INPUT_MAX; i++) {
+			const bool level = pin_level(&pins[i], t);
+			if (level != pins[i].level) {
+				pins[i].level = level;
+				lego_input_edge(&in, i, t);
+				edges++;
+			}
+			pressed |= (uint32_t)level << i;
+		}
+		if (t % (INPUT_SCAN_MS * 1000) != 0) {
+			continue;
+		}
+		lego_input_event_t events[2 * LEGO_INPUT_MAX];
+		const uint32_t n = lego_input_scan(&in, pressed, t, events, 2 * LEGO_INPUT_MAX);
+		for (uint32_t e = 0; e < n; e++) {
+			pin_model_t *pin = &pins[events[e].input];
+			if (events[e].kind == LEGO_INPUT_PRESS) {
+				const uint32_t k = pin->presses++;
+				if (k >= NPRESSES || events[e].stamp_us != (pin->down_us[k] | 1)) {
+					printf(
+						"FAIL pin %u press %u at %u\n", events[e].input, k, events[e].stamp_us);
+					pin->failures++;
+				}
+			} else if (events[e].kind == LEGO_INPUT_RELEASE) {
+				const uint32_t k = pin->releases++;
+				if (k >= NPRESSES || events[e].stamp_us != (pin->up_us[k] | 1)) {
+					printf(
+						"FAIL pin %u release %u at %u\n", events[e].input, k,
+						events[e].stamp_us);
+					pin->failures++;
+				}
+			} else {
+				pin->longs++;
+			}
+		}
+	}
+
+	uint32_t failures = 0;
+	for (uint8_t i = 0; i < LEGO_INPUT_MAX; i++) {
+		const pin_model_t *pin = &pins[i];
+		if (pin->presses != NPRESSES || pin->releases != NPRESSES ||
+			pin->longs != NPRESSES / 4) {
+			printf(
+				"FAIL pin %u: %u presses, %u releases, %u long presses\n", i, pin->presses,
+				pin->releases, pin->longs);
+			failures++;
+		}
+		failures += pin->failures;
+	}
+	printf(
+		"%s: %u pins, %u edges into %u presses each\n", failures == 0 ? "ok" : "FAIL",
+		LEGO_INPUT_MAX, edges, NPRESSES);
+	return failures == 0 ? 0 : 1;
+}
@@ -0,0 +1,368 @@
+// Host replay and noise injection harness for lego_decoder.c, for tuning the
+// LEGO_DECODER_* thresholds without hardware. Build and run from the repo
+// root:
+//
+//	gcc -std=gnu11 -O2 -Imain -o ir_replay tools/ir_replay.c main/lego_decoder.c
+//		main/lego_frame.c main/lego_timing.c
+//	./ir_replay -n 20000 -j 40 -b 4 -d 0.001 -a 50
+//
+// Every run first checks the captures from the original remote, then sends
+// random frames through the impairments below and reports how many came out
+// of the decoder. With -r, a recorded trace of "mark space" pairs in us (one
+// pair per line, a zero space ends a receive) is decoded instead.
+
+#include <getopt.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "lego_decoder.h"
+
+// Same values as defs.h, which needs ESP-IDF
+#define IR_RX_BUFFER_SYMBOLS 64
+#define IR_RX_IDLE_US 1500
+
+// One carrier period at 38 kHz
+#define CARRIER_PERIOD_US 26
+
+// Channel 1-4 captures, also listed in ir.h
+static const struct {
+	uint8_t channel;
+	uint8_t key;
+	uint16_t raw;
+} captures[] = {
+	{0, LEGO_LF, 0x8124}, {0, LEGO_LB, 0x8117}, {0, LEGO_RF, 0x8142},
+	{0, LEGO_RB, 0x818e}, {0, LEGO_LF | LEGO_RF, 0x0168}, {0, LEGO_LB | LEGO_RB, 0x0197},
+	{0, LEGO_LF | LEGO_RB, 0x01a4}, {0, LEGO_LB | LEGO_RF, 0x015b}, {0, 0, 0x010e},
+	{1, LEGO_LF, 0x9125}, {1, LEGO_LB, 0x9116}, {1, LEGO_RF, 0x9143},
+	{1, LEGO_RB, 0x918f}, {1, LEGO_LF | LEGO_RF, 0x1169}, {1, LEGO_LB | LEGO_RB, 0x1196},
+	{1, LEGO_LF | LEGO_RB, 0x11a5}, {1, LEGO_LB | LEGO_RF, 0x115a}, {1, 0, 0x110f},
+	{2, LEGO_LF, 0xa126}, {2, LEGO_LB, 0xa115}, {2, LEGO_RF, 0xa140},
+	{2, LEGO_RB, 0xa18c}, {2, LEGO_LF | LEGO_RF, 0x216a}, {2, LEGO_LB | LEGO_RB, 0x2195},
+	{2, LEGO_LF | LEGO_RB, 0x21a6}, {2, LEGO_LB | LEGO_RF, 0x2159}, {2, 0, 0x210c},
+	{3, LEGO_LF, 0xb127}, {3, LEGO_LB, 0xb114}, {3, LEGO_RF, 0xb141},
+	{3, LEGO_RB, 0xb18d}, {3, LEGO_LF | LEGO_RF, 0x316b}, {3, LEGO_LB | LEGO_RB, 0x3194},
+	{3, LEGO_LF | LEGO_RB, 0x31a7}, {3, LEGO_LB | LEGO_RF, 0x3158}, {3, 0, 0x310d},
+};
+
+typedef struct {
+	// Edge jitter, uniform in +-jitter_us
+	uint32_t jitter_us;
+	// Receiver output staying on for up to this many extra carrier periods
+	uint32_t bleed_periods;
+	// Chance of a mark not being seen at all
+	double drop_prob;
+	// Short ambient light pulses per second of trace
+	double glitch_rate;
+	// Idle time after every frame
+	uint32_t gap_us;
+} impairments_t;
+
+// Receiver output as alternating mark and space durations, starting with a
+// mark
+typedef struct {
+	uint32_t *durations;
+	size_t len;
+	size_t cap;
+} trace_t;
+
+typedef struct {
+	lego_decoder_t dec;
+	lego_rx_packet_t *out;
+	uint32_t out_len;
+	uint32_t out_cap;
+	double cpu_s;
+} replay_t;
+
+static uint64_t rng_state = 1;
+
+static uint32_t rng_next(void) {
+	rng_state ^= rng_state << 13;
+	rng_state ^= rng_state >> 7;
+	rng_state ^= rng_state << 17;
+	return rng_state >> 32;
+}
+
+static double rng_uniform(void) {
+	return rng_next() / 4294967296.0;
+}
+
+static void trace_push(trace_t *trace, uint32_t duration) {
+	if (trace->len == trace->cap) {
+		trace->cap = trace->cap ? trace->cap * 2 : 1024;
+		trace->durations = realloc(trace->durations, trace->cap * sizeof(uint32_t));
+		if (trace->durations == NULL) {
+			abort();
+		}
+	}
+	trace->durations[trace->len++] = duration;
+}
+
+// Appends a level, merging it into the previous duration when the level did
+// not change
+static void trace_append(trace_t *trace, bool mark, uint32_t duration) {
+	if (duration == 0) {
+		return;
+	}
+	const bool last_mark = trace->len % 2 == 1;
+	if (trace->len > 0 && last_mark == mark) {
+		trace->durations[trace->len - 1] += duration;
+	} else if (trace->len == 0 && !mark) {
+		// Empty mark to keep the trace starting with one
+		trace_push(trace, 0);
+		trace_push(trace, duration);
+	} else {
+		trace_push(trace, duration);
+	}
+}
+
+// Returns the air time of the frame and its gap
+static int64_t trace_add_frame(trace_t *trace, uint16_t raw, const impairments_t *imp) {
+	const lego_packet_t pkt = lego_packet_from_raw(raw);
+	rmt_symbol_word_t frame[LEGO_FRAME_SYMBOLS];
+	lego_frame_build(&pkt, frame);
+	int64_t total_us = 0;
+
+	for (size_t i = 0; i < LEGO_FRAME_SYMBOLS; i++) {
+		int32_t mark = frame[i].duration0;
+		int32_t space = frame[i].duration1;
+		if (i == LEGO_FRAME_SYMBOLS - 1) {
+			space += imp->gap_us;
+		}
+		if (imp->bleed_periods) {
+			const int32_t bleed = (rng_next() % (imp->bleed_periods + 1)) * CARRIER_PERIOD_US;
+			mark += bleed;
+			space -= bleed;
+		}
+		if (imp->jitter_us) {
+			const int32_t jitter =
+				(int32_t)(rng_next() % (2 * imp->jitter_us + 1)) - (int32_t)imp->jitter_us;
+			mark += jitter;
+			space -= jitter;
+		}
+		if (mark < 1) {
+			mark = 1;
+		}
+		if (space < 1) {
+			space = 1;
+		}
+		total_us += mark + space;
+		if (imp->drop_prob > 0 && rng_uniform() < imp->drop_prob) {
+			trace_append(trace, false, mark + space);
+			continue;
+		}
+		trace_append(trace, true, mark);
+
+		// Ambient light pulses land in the space
+		const double glitches = imp->glitch_rate * space / 1e6;
+		if (glitches > 0 && rng_uniform() < glitches && space > 120) {
+			const uint32_t width = 2 + rng_next() % 40;
+			const uint32_t at = 10 + rng_next() % (space - width - 20);
+			trace_append(trace, false, at);
+			trace_append(trace, true, width);
+			trace_append(trace, false, space - at - width);
+		} else {
+			trace_append(trace, false, space);
+		}
+	}
+	return total_us;
+}
+
+static void replay_emit(replay_t *rp, const rmt_symbol_word_t *symbols, size_t n, int64_t end_us) {
+	const clock_t start = clock();
+	rp->out_len += lego_decoder_feed(
+		&rp->dec, symbols, n, end_us, rp->out + rp->out_len, rp->out_cap - rp->out_len);
+	rp->cpu_s += (double)(clock() - start) / CLOCKS_PER_SEC;
+}
+
+// Cuts the trace into receives the way the RMT peripheral does: a space
+// longer than IR_RX_IDLE_US or a full buffer ends one.
+static void replay_trace(replay_t *rp, const trace_t *trace) {
+	rmt_symbol_word_t buf[IR_RX_BUFFER_SYMBOLS];
+	size_t n = 0;
+	int64_t now_us = 0;
+	for (size_t i = 0; i < trace->len; i += 2) {
+		const uint32_t mark = trace->durations[i];
+		const uint32_t space = i + 1 < trace->len ? trace->durations[i + 1] : 0;
+		const bool idle = space == 0 || space > IR_RX_IDLE_US;
+		buf[n++] = (rmt_symbol_word_t){
+			.level0 = 1,
+			.duration0 = mark > 0x7fff ? 0x7fff : mark,
+			.level1 = 0,
+			.duration1 = idle ? 0 : space,
+		};
+		now_us += mark;
+		if (idle || n == IR_RX_BUFFER_SYMBOLS) {
+			replay_emit(rp, buf, n, idle ? now_us : now_us + space);
+			n = 0;
+		}
+		now_us += space;
+	}
+	if (n) {
+		replay_emit(rp, buf, n, now_us);
+	}
+}
+
+static bool check_captures(void) {
+	bool ok = true;
+	for (size_t i = 0; i < sizeof(captures) / sizeof(captures[0]); i++) {
+		const lego_packet_t built = lego_packet_prepare(
+			(lego_packet_t){.channel = captures[i].channel, .key = captures[i].key});
+		if (lego_packet_raw(&built) != captures[i].raw) {
+			printf("capture 0x%04x: built as 0x%04x\n", captures[i].raw, lego_packet_raw(&built));
+			ok = false;
+		}
+
+		const impairments_t clean = {.gap_us = 16000};
+		trace_t trace = {0};
+		lego_rx_packet_t out[2];
+		replay_t rp = {.out = out, .out_cap = 2};
+		lego_decoder_init(&rp.dec);
+		trace_add_frame(&trace, captures[i].raw, &clean);
+		replay_trace(&rp, &trace);
+		if (rp.out_len != 1 || lego_packet_raw(&out[0].packet) != captures[i].raw) {
+			printf("capture 0x%04x: not decoded\n", captures[i].raw);
+			ok = false;
+		}
+		free(trace.durations);
+	}
+	printf("captures: %s\n", ok ? "ok" : "FAILED");
+	return ok;
+}
+
+static int replay_file(const char *path) {
+	FILE *f = fopen(path, "r");
+	if (f == NULL) {
+		perror(path);
+		return 1;
+	}
+	trace_t trace = {0};
+	unsigned long mark, space;
+	while (fscanf(f, "%lu %lu", &mark, &space) == 2) {
+		trace_append(&trace, true, mark);
+		// Keep receive boundaries from the recording
+		trace_append(&trace, false, space ? space : IR_RX_IDLE_US + 1);
+	}
+	fclose(f);
+
+	static lego_rx_packet_t out[1 << 16];
+	replay_t rp = {.out = out, .out_cap = sizeof(out) / sizeof(out[0])};
+	lego_decoder_init(&rp.dec);
+	replay_trace(&rp, &trace);
+	for (uint32_t i = 0; i < rp.out_len; i++) {
+		printf(
+			"%10lld us 0x%04x\n", (long long)out[i].timestamp_us, lego_packet_raw(&out[i].packet));
+	}
+	printf(
+		"frames=%u bad_checksum=%u bad_symbols=%u\n", rp.dec.frames, rp.dec.bad_checksum,
+		rp.dec.bad_symbols);
+	free(trace.durations);
+	return 0;
+}
+
+static void usage(const char *argv0) {
+	fprintf(
+		stderr,
+		"usage: %s [-n frames] [-j jitter_us] [-b bleed_periods] [-d drop_prob]\n"
+		"          [-a glitches_per_s] [-g gap_us] [-s seed] [-r trace_file]\n",
+		argv0);
+	exit(2);
+}
+
+int main(int argc, char **argv) {
+	uint32_t frames = 10000;
+	impairments_t imp = {.gap_us = 2000};
+	const char *trace_file = NULL;
+	int opt;
+	while ((opt = getopt(argc, argv, "n:j:b:d:a:g:s:r:")) != -1) {
+		switch (opt) {
+		case 'n':
+			frames = strtoul(optarg, NULL, 0);
+			break;
+		case 'j':
+			imp.jitter_us = strtoul(optarg, NULL, 0);
+			break;
+		case 'b':
+			imp.bleed_periods = strtoul(optarg, NULL, 0);
+			break;
+		case 'd':
+			imp.drop_prob = strtod(optarg, NULL);
+			break;
+		case 'a':
+			imp.glitch_rate = strtod(optarg, NULL);
+			break;
+		case 'g':
+			imp.gap_us = strtoul(optarg, NULL, 0);
+			break;
+		case 's':
+			rng_state = strtoull(optarg, NULL, 0) | 1;
+			break;
+		case 'r':
+			trace_file = optarg;
+			break;
+		default:
+			usage(argv[0]);
+		}
+	}
+
+	if (!check_captures()) {
+		return 1;
+	}
+	if (trace_file) {
+		return replay_file(trace_file);
+	}
+
+	// Random words with a valid checksum, covering every mode
+	uint16_t *sent = malloc(frames * sizeof(uint16_t));
+	int64_t *sent_us = malloc(frames * sizeof(int64_t));
+	lego_rx_packet_t *out = malloc((frames + 1) * sizeof(lego_rx_packet_t));
+	if (sent == NULL || sent_us == NULL || out == NULL) {
+		return 1;
+	}
+	trace_t trace = {0};
+	int64_t now_us = 0;
+	for (uint32_t i = 0; i < frames; i++) {
+		lego_packet_t pkt = lego_packet_from_raw(rng_next() & 0xfff0);
+		pkt.checksum = get_packet_checksum(&pkt);
+		sent[i] = lego_packet_raw(&pkt);
+		sent_us[i] = now_us;
+		now_us += trace_add_frame(&trace, sent[i], &imp);
+	}
+
+	replay_t rp = {.out = out, .out_cap = frames + 1};
+	lego_decoder_init(&rp.dec);
+	replay_trace(&rp, &trace);
+
+	// Match decoded packets to sent frames by start time
+	uint32_t good = 0, wrong = 0;
+	uint32_t k = 0;
+	for (uint32_t i = 0; i < rp.out_len; i++) {
+		while (k + 1 < frames && sent_us[k + 1] <= out[i].timestamp_us + LEGO_DECODER_MARK_MAX_US) {
+			k++;
+		}
+		if (lego_packet_raw(&out[i].packet) == sent[k]) {
+			good++;
+		} else {
+			wrong++;
+		}
+	}
+
+	const double air_s = now_us / 1e6;
+	const uint32_t attempts = rp.dec.frames + rp.dec.bad_checksum + rp.dec.bad_symbols;
+	printf("sent:           %u frames in %.2f s of air time\n", frames, air_s);
+	printf("decoded:        %u (%.2f %%)\n", good, 100.0 * good / frames);
+	printf("wrong packet:   %u\n", wrong);
+	printf(
+		"bad checksum:   %u (%.2f %% of decode attempts)\n", rp.dec.bad_checksum,
+		attempts ? 100.0 * rp.dec.bad_checksum / attempts : 0.0);
+	printf("bad symbols:    %u\n", rp.dec.bad_symbols);
+	printf("throughput:     %.1f frames/s on air\n", good / air_s);
+	printf(
+		"decoder:        %.0f frames/s of CPU time\n", rp.cpu_s > 0 ? rp.out_len / rp.cpu_s : 0.0);
+
+	free(trace.durations);
+	free(sent);
+	free(sent_us);
+	free(out);
+	return 0;
+}
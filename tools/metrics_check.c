@@ -0,0 +1,181 @@
+// Host test of the latency histograms in lego_metrics.c. Build and run from
+// the repo root:
+//
+//	gcc -std=gnu11 -O2 -Imain -o metrics_check tools/metrics_check.c main/lego_metrics.c
+//	./metrics_check
+//
+// Checks every value up to 2^20 and powers of two up to 2^31 for the bin
+// math: a percentile is never below the value it stands for, exact below 8
+// and off by at most 1/8 above, up to 2^24 us where the overflow bin starts.
+// Then compares percentiles of random samples spread over 1 us to 33 s
+// against the exact ones from the sorted samples, and runs
+// lego_metrics_rotate() on a fake clock.
+
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "lego_metrics.h"
+
+#define NSAMPLES 20000
+
+static uint32_t failures = 0;
+
+static uint64_t rng_state = 1;
+
+static uint32_t rng_next(void) {
+	rng_state ^= rng_state << 13;
+	rng_state ^= rng_state >> 7;
+	rng_state ^= rng_state << 17;
+	return rng_state >> 32;
+}
+
+// Within the bin resolution of `exact`, or the max for the overflow bin
+static bool close_enough(uint32_t got, uint32_t exact, uint32_t max) {
+	if (exact >= 1u << LEGO_HIST_MAX_BITS) {
+		return got == max;
+	}
+	return got >= exact && got - exact <= exact / LEGO_HIST_SUB_BINS;
+}
+
+// The percentile of a lone value below a far larger one is the upper bound of
+// its bin
+static uint32_t bin_upper(uint32_t value) {
+	static lego_hist_t hist;
+	memset(&hist, 0, sizeof(hist));
+	lego_hist_record(&hist, value);
+	lego_hist_record(&hist, UINT32_MAX);
+	return lego_hist_percentile(&hist, 500);
+}
+
+static void check_bins(void) {
+	uint32_t prev = 0;
+	for (uint32_t value = 0; value <= 1 << 20; value++) {
+		const uint32_t upper = bin_upper(value);
+		if (!close_enough(upper, value, UINT32_MAX) || (value < 8 && upper != value) ||
+			upper < prev) {
+			printf("FAIL bin of %u: upper bound %u\n", value, upper);
+			failures++;
+		}
+		// A bin's upper bound is in that bin
+		if (bin_upper(upper) != upper) {
+			printf("FAIL bin of %u: upper bound %u is in another bin\n", value, upper);
+			failures++;
+		}
+		prev = upper;
+	}
+	// Each side of every power of two, up to the overflow bin
+	for (uint32_t bit = 20; bit < 32; bit++) {
+		for (uint32_t value = (1u << bit) - 1; value <= 1u << bit; value++) {
+			const uint32_t upper = bin_upper(value);
+			if (!close_enough(upper, value, UINT32_MAX)) {
+				printf("FAIL bin of %u: upper bound %u\n", value, upper);
+				failures++;
+			}
+		}
+	}
+}
+
+static int compare_u32(const void *a, const void *b) {
+	const uint32_t x = *(const uint32_t *)a, y = *(const uint32_t *)b;
+	return x < y ? -1 : x > y;
+}
+
+static void check_percentiles(void) {
+	static uint32_t samples[NSAMPLES];
+	static const uint32_t permilles[] = {0, 1, 100, 500, 900, 990, 999, 1000};
+	for (uint32_t round = 0; round < 20; round++) {
+		lego_hist_t hist = {0};
+		// Few samples in some rounds, where the rounding of the rank shows
+		const uint32_t n = round % 4 == 0 ? 1 + round : NSAMPLES;
+		for (uint32_t i = 0; i < n; i++) {
+			// Log-uniform from 1 us to 2^25 us
+			const uint32_t bits = rng_next() % 25;
+			samples[i] = (1u << bits) + rng_next() % (1u << bits);
+			lego_hist_record(&hist, samples[i]);
+		}
+		qsort(samples, n, sizeof(samples[0]), compare_u32);
+		if (hist.total != n || hist.max != samples[n - 1]) {
+			printf("FAIL round %u: %u samples, max %u\n", round, hist.total, hist.max);
+			failures++;
+		}
+		for (uint32_t i = 0; i < sizeof(permilles) / sizeof(permilles[0]); i++) {
+			// The sample at rank ceil(n * p / 1000), the first for p = 0
+			const uint64_t rank = ((uint64_t)n * permilles[i] + 999) / 1000;
+			const uint32_t exact = samples[rank > 0 ? rank - 1 : 0];
+			const uint32_t got = lego_hist_percentile(&hist, permilles[i]);
+			if (!close_enough(got, exact, hist.max)) {
+				printf(
+					"FAIL round %u, %u samples: p%u.%u %u, exact %u\n", round, n,
+					permilles[i] / 10, permilles[i] % 10, got, exact);
+				failures++;
+			}
+		}
+		lego_hist_summary_t summary;
+		lego_hist_summarize(&hist, &summary);
+		if (summary.total != n || summary.p50 != lego_hist_percentile(&hist, 500) ||
+			summary.p95 != lego_hist_percentile(&hist, 950) ||
+			summary.p99 != lego_hist_percentile(&hist, 990) || summary.max != hist.max) {
+			printf("FAIL round %u: summary differs from the percentiles\n", round);
+			failures++;
+		}
+	}
+	const lego_hist_t empty = {0};
+	if (lego_hist_percentile(&empty, 500) != 0) {
+		printf("FAIL percentile of an empty histogram\n");
+		failures++;
+	}
+}
+
+static uint32_t fake_us = 0;
+
+static uint32_t fake_clock(void) {
+	return fake_us;
+}
+
+static void check_rotate(void) {
+	static lego_metrics_t metrics;
+	fake_us = 0xfffff000;
+	lego_metrics_init(&metrics, fake_clock);
+	lego_metrics_record(&metrics, LEGO_STAGE_AIR, 100);
+	lego_metrics_record(&metrics, LEGO_STAGE_QUEUE, 7);
+	// Across the wrap of the 32-bit clock
+	fake_us += 999;
+	if (lego_metrics_rotate(&metrics, 1000) != NULL) {
+		printf("FAIL rotate: window over early\n");
+		failures++;
+	}
+	fake_us += 1;
+	const lego_hist_t *hist = lego_metrics_rotate(&metrics, 1000);
+	if (hist == NULL || hist[LEGO_STAGE_AIR].total != 1 || hist[LEGO_STAGE_QUEUE].max != 7 ||
+		hist[LEGO_STAGE_PAD].total != 0) {
+		printf("FAIL rotate: first window\n");
+		failures++;
+	}
+	lego_metrics_record(&metrics, LEGO_STAGE_AIR, 200);
+	fake_us += 1000;
+	hist = lego_metrics_rotate(&metrics, 1000);
+	if (hist == NULL || hist[LEGO_STAGE_AIR].total != 1 || hist[LEGO_STAGE_AIR].max != 200 ||
+		hist[LEGO_STAGE_QUEUE].total != 0) {
+		printf("FAIL rotate: second window\n");
+		failures++;
+	}
+	// The set handed out first was cleared before it was recorded into again
+	fake_us += 1000;
+	hist = lego_metrics_rotate(&metrics, 1000);
+	if (hist == NULL || hist[LEGO_STAGE_AIR].total != 0) {
+		printf("FAIL rotate: third window not empty\n");
+		failures++;
+	}
+}
+
+int main(void) {
+	check_bins();
+	check_percentiles();
+	check_rotate();
+	printf(
+		"%s: histogram bins, percentiles within 1/%u and window rotation\n",
+		failures == 0 ? "ok" : "FAIL", LEGO_HIST_SUB_BINS);
+	return failures == 0 ? 0 : 1;
+}
@@ -0,0 +1,168 @@
+// Host test of lego_nes.c against mocked SPI transfers, and of the
+// lego_map.c tables the reads go through. Build and run from the repo root:
+//
+//	gcc -std=gnu11 -O2 -Imain -o nes_sim tools/nes_sim.c main/lego_nes.c main/lego_map.c
+//	./nes_sim
+//
+// The mock clocks a model of the pad's 4021 shift registers bit by bit the
+// way the SPI peripheral does in mode 0: MOSI (the latch) is set up before
+// the rising edge, MISO is sampled on it, and the pad shifts on it while the
+// latch is low. Every button combination of both pads is read back, then an
+// NES pad on an SNES read, an SNES pad on an NES read and an unplugged pad.
+// Last the default mapping, a chord and rejected loads.
+
+#include <stdio.h>
+#include <string.h>
+
+#include "lego_map.h"
+#include "lego_nes.h"
+
+typedef struct {
+	// Button inputs, low when pressed, 16 for SNES with the last 4 tied high
+	uint16_t inputs;
+	uint8_t nbits;
+	uint16_t shift;
+	// Nothing on the line, the pull-up reads high
+	bool unplugged;
+} pad_t;
+
+static pad_t pad_new(enum lego_nes_pad kind, uint16_t pressed) {
+	const pad_t pad = {
+		.inputs = ~pressed | (kind == LEGO_NES_PAD_SNES ? 0xf000 : 0),
+		.nbits = lego_nes_bits(kind),
+	};
+	return pad;
+}
+
+// spi_device_transmit()
+static void spi_transfer(pad_t *pad, const uint8_t *tx, uint8_t *rx, uint32_t len) {
+	memset(rx, 0, len);
+	for (uint32_t i = 0; i < len * 8; i++) {
+		const bool latch = (tx[i / 8] >> (7 - i % 8)) & 1;
+		if (latch) {
+			// Parallel load, the clock is ignored meanwhile
+			pad->shift = pad->inputs;
+		}
+		const bool miso = pad->unplugged || (pad->shift & 1);
+		rx[i / 8] |= miso << (7 - i % 8);
+		if (!latch) {
+			// The serial input of the last register is grounded
+			pad->shift >>= 1;
+			pad->shift &= (1 << pad->nbits) - 1;
+		}
+	}
+}
+
+static bool read_pad(pad_t *pad, enum lego_nes_pad kind, uint16_t *buttons) {
+	uint8_t tx[LEGO_NES_MAX_BYTES], rx[LEGO_NES_MAX_BYTES];
+	const uint32_t len = lego_nes_frame(kind, tx);
+	if (len > LEGO_NES_MAX_BYTES) {
+		return false;
+	}
+	spi_transfer(pad, tx, rx, len);
+	return lego_nes_decode(kind, rx, buttons);
+}
+
+int main(void) {
+	uint32_t failures = 0;
+
+	for (uint32_t pressed = 0; pressed < 256; pressed++) {
+		pad_t pad = pad_new(LEGO_NES_PAD_NES, pressed);
+		uint16_t buttons = 0xffff;
+		if (!read_pad(&pad, LEGO_NES_PAD_NES, &buttons) || buttons != pressed) {
+			printf("FAIL nes %02x read as %04x\n", pressed, buttons);
+			failures++;
+		}
+	}
+	printf("%s: NES, 256 combinations\n", failures == 0 ? "ok" : "FAIL");
+
+	const uint32_t before_snes = failures;
+	for (uint32_t pressed = 0; pressed < 4096; pressed++) {
+		pad_t pad = pad_new(LEGO_NES_PAD_SNES, pressed);
+		uint16_t buttons = 0xffff;
+		if (!read_pad(&pad, LEGO_NES_PAD_SNES, &buttons) || buttons != pressed) {
+			printf("FAIL snes %03x read as %04x\n", pressed, buttons);
+			failures++;
+		}
+	}
+	printf("%s: SNES, 4096 combinations\n", failures == before_snes ? "ok" : "FAIL");
+
+	const uint32_t before_mixed = failures;
+	uint16_t buttons = 0;
+	pad_t pad = pad_new(LEGO_NES_PAD_NES, LEGO_NES_A | LEGO_NES_RIGHT);
+	if (read_pad(&pad, LEGO_NES_PAD_SNES, &buttons)) {
+		printf("FAIL NES pad accepted by an SNES read as %04x\n", buttons);
+		failures++;
+	}
+	// The first 8 buttons line up, the rest are never clocked
+	pad = pad_new(LEGO_NES_PAD_SNES, LEGO_SNES_B | LEGO_SNES_UP | LEGO_SNES_A);
+	if (!read_pad(&pad, LEGO_NES_PAD_NES, &buttons) || buttons != (LEGO_SNES_B | LEGO_SNES_UP)) {
+		printf("FAIL SNES pad on an NES read as %04x\n", buttons);
+		failures++;
+	}
+	for (uint32_t kind = LEGO_NES_PAD_NES; kind <= LEGO_NES_PAD_SNES; kind++) {
+		pad = pad_new(kind, 0);
+		pad.unplugged = true;
+		if (!read_pad(&pad, kind, &buttons) || buttons != 0) {
+			printf("FAIL unplugged pad read as %04x\n", buttons);
+			failures++;
+		}
+	}
+	printf("%s: mismatched and unplugged pads\n", failures == before_mixed ? "ok" : "FAIL");
+
+	const uint32_t before_map = failures;
+	lego_map_t map;
+	lego_map_init(&map, 1);
+	const struct {
+		uint16_t buttons;
+		uint16_t keys;
+	} defaults[] = {
+		{0, 0},
+		{LEGO_NES_UP, (LEGO_LF | LEGO_RF) << 4},
+		{LEGO_NES_DOWN | LEGO_NES_A, (LEGO_LB | LEGO_RB) << 4},
+		{LEGO_NES_LEFT, LEGO_RF << 4},
+		// Up drives both outputs first
+		{LEGO_NES_UP | LEGO_NES_RIGHT, (LEGO_LF | LEGO_RF) << 4},
+	};
+	for (uint32_t i = 0; i < sizeof(defaults) / sizeof(defaults[0]); i++) {
+		const uint16_t keys = lego_map_apply(&map, defaults[i].buttons);
+		if (keys != defaults[i].keys) {
+			printf("FAIL default map %04x to %04x\n", defaults[i].buttons, keys);
+			failures++;
+		}
+	}
+	// A + B spins channel 0, A alone reverses its output A, B drives channel 3
+	const uint8_t rules[] = {
+		LEGO_NES_A | LEGO_NES_B, 0, 0, LEGO_LF | LEGO_RB,
+		LEGO_NES_A,              0, 0, LEGO_LB,
+		LEGO_NES_B,              0, 3, LEGO_LF,
+	};
+	if (!lego_map_load(&map, rules, sizeof(rules)) || map.nrules != 3) {
+		printf("FAIL load\n");
+		failures++;
+	}
+	if (lego_map_apply(&map, LEGO_NES_A | LEGO_NES_B) != (LEGO_LF | LEGO_RB | LEGO_LF << 12) ||
+		lego_map_apply(&map, LEGO_NES_A) != LEGO_LB ||
+		lego_map_apply(&map, LEGO_NES_B) != LEGO_LF << 12) {
+		printf("FAIL loaded map\n");
+		failures++;
+	}
+	const uint8_t bad[][LEGO_MAP_RULE_BYTES] = {
+		{0, 0, 0, LEGO_LF},
+		{LEGO_NES_A, 0, 4, LEGO_LF},
+		{LEGO_NES_A, 0, 0, LEGO_LF | LEGO_LB},
+		{LEGO_NES_A, 0, 0, 0x10},
+	};
+	for (uint32_t i = 0; i < sizeof(bad) / sizeof(bad[0]); i++) {
+		if (lego_map_load(&map, bad[i], sizeof(bad[i])) || map.nrules != 3) {
+			printf("FAIL bad rule %u accepted\n", i);
+			failures++;
+		}
+	}
+	if (lego_map_load(&map, rules, sizeof(rules) - 1)) {
+		printf("FAIL truncated rule accepted\n");
+		failures++;
+	}
+	printf("%s: pad mapping\n", failures == before_map ? "ok" : "FAIL");
+	return failures == 0 ? 0 : 1;
+}
@@ -0,0 +1,253 @@
+// Host simulation of the MQTT outage mode: lego_link.c reconnecting and
+// lego_outbox.c buffering, against a broker stand-in that is killed and
+// restarted. Build and run from the repo root:
+//
+//	gcc -std=gnu11 -O2 -Imain -o outage_sim tools/outage_sim.c main/lego_link.c main/lego_outbox.c
+//	./outage_sim -k 5000 -u 35000 -t 120000
+//
+// Runs in simulated milliseconds with the publishers of the firmware: an
+// ack per batch, queue space after it, metrics and telemetry every 10 s.
+// Checks that acks arrive in order without duplicates, that only the ones
+// the outbox had to drop are missing, and reports how long after the
+// restart the link was back. -k and -u can be repeated for several outages.
+
+#include <getopt.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "lego_link.h"
+#include "lego_outbox.h"
+
+#define MAX_OUTAGES 8
+// Connection refused while the broker is down, CONNACK while it is up
+#define REFUSE_MS 5
+#define CONNECT_MS 30
+#define ACK_PERIOD_MS 1000
+#define ACK_BYTES 80
+#define REPORT_PERIOD_MS 10000
+#define METRICS_BYTES 400
+#define TELEMETRY_BYTES 1500
+
+static struct {
+	uint32_t kill_ms[MAX_OUTAGES];
+	uint32_t restart_ms[MAX_OUTAGES];
+	uint32_t noutages;
+	// Until a keepalive notices, messages to a dead broker vanish
+	uint32_t detect_ms;
+} plan;
+
+static struct {
+	bool running;
+	uint32_t last_ack;
+	uint32_t acks;
+	uint32_t out_of_order;
+	uint32_t telemetry;
+	uint32_t metrics;
+} broker = {.running = true};
+
+static struct {
+	lego_link_t link;
+	lego_outbox_t outbox;
+	bool connected;
+	bool online;
+	// When a pending attempt or an unnoticed drop resolves, 0 if none
+	uint32_t attempt_done_ms;
+	uint32_t drop_seen_ms;
+	uint32_t lost_in_flight;
+} client;
+
+static bool broker_running_at(uint32_t now_ms) {
+	for (uint32_t i = 0; i < plan.noutages; i++) {
+		if (now_ms >= plan.kill_ms[i] && now_ms < plan.restart_ms[i]) {
+			return false;
+		}
+	}
+	return true;
+}
+
+static void broker_receive(const char *topic, const uint8_t *payload, uint16_t len) {
+	if (strcmp(topic, "esp/1/lego/cmd/ack") == 0) {
+		uint32_t seq = 0;
+		memcpy(&seq, payload, sizeof(seq));
+		if (seq <= broker.last_ack) {
+			broker.out_of_order++;
+		}
+		broker.last_ack = seq;
+		broker.acks++;
+	} else if (strcmp(topic, "esp/1/telemetry") == 0) {
+		broker.telemetry++;
+	} else if (strcmp(topic, "esp/1/metrics") == 0) {
+		broker.metrics++;
+	}
+}
+
+// esp_mqtt_client_publish(): fails once the client knows it is disconnected
+static bool client_send(const char *topic, const void *payload, uint16_t len) {
+	if (!client.connected) {
+		return false;
+	}
+	if (broker.running) {
+		broker_receive(topic, payload, len);
+	} else if (strcmp(topic, "esp/1/lego/cmd/ack") == 0) {
+		client.lost_in_flight++;
+	}
+	return true;
+}
+
+// mqtt_publish() in networking.h
+static void publish(const char *topic, const void *payload, uint16_t len, bool coalesce) {
+	if (client.online && client_send(topic, payload, len)) {
+		return;
+	}
+	lego_outbox_push(&client.outbox, topic, payload, len, coalesce);
+}
+
+// mqtt_flush_outbox()
+static void flush(void) {
+	lego_outbox_msg_t msg;
+	while (lego_outbox_peek(&client.outbox, &msg)) {
+		if (!client_send(msg.topic, msg.payload, msg.len)) {
+			return;
+		}
+		lego_outbox_pop(&client.outbox);
+	}
+	client.online = true;
+}
+
+static void publishers(uint32_t now_ms) {
+	static uint32_t seq;
+	static uint8_t report[TELEMETRY_BYTES];
+	if (now_ms % ACK_PERIOD_MS == 0) {
+		seq++;
+		memcpy(report, &seq, sizeof(seq));
+		publish("esp/1/lego/cmd/ack", report, ACK_BYTES, false);
+		publish("esp/1/lego/cmd/space", report, 64, true);
+	}
+	if (now_ms % REPORT_PERIOD_MS == 0) {
+		publish("esp/1/metrics", report, METRICS_BYTES, false);
+		publish("esp/1/telemetry", report, TELEMETRY_BYTES, true);
+	}
+}
+
+static uint32_t parse_ms(const char *arg, const char *what) {
+	char *end = NULL;
+	const unsigned long value = strtoul(arg, &end, 0);
+	if (*end != '\0') {
+		fprintf(stderr, "Bad %s %s\n", what, arg);
+		exit(1);
+	}
+	return value;
+}
+
+int main(int argc, char **argv) {
+	uint32_t duration_ms = 120000;
+	uint32_t nkill = 0, nrestart = 0;
+	int opt;
+	while ((opt = getopt(argc, argv, "k:u:d:t:")) != -1) {
+		switch (opt) {
+		case 'k':
+			if (nkill < MAX_OUTAGES) {
+				plan.kill_ms[nkill++] = parse_ms(optarg, "kill time");
+			}
+			break;
+		case 'u':
+			if (nrestart < MAX_OUTAGES) {
+				plan.restart_ms[nrestart++] = parse_ms(optarg, "restart time");
+			}
+			break;
+		case 'd':
+			plan.detect_ms = parse_ms(optarg, "detection delay");
+			break;
+		case 't':
+			duration_ms = parse_ms(optarg, "duration");
+			break;
+		default:
+			fprintf(
+				stderr, "Usage: %s [-k kill_ms -u restart_ms]... [-d detect_ms] [-t ms]\n",
+				argv[0]);
+			return 1;
+		}
+	}
+	if (nkill == 0) {
+		plan.kill_ms[nkill++] = 5000;
+		plan.restart_ms[nrestart++] = 35000;
+	}
+	if (nkill != nrestart) {
+		fprintf(stderr, "Every -k needs a -u\n");
+		return 1;
+	}
+	plan.noutages = nkill;
+
+	const lego_link_config_t config = {.min_ms = 500, .max_ms = 30000, .connect_timeout_ms = 20000};
+	lego_link_init(&client.link, &config, 12345);
+	lego_outbox_init(&client.outbox);
+	client.connected = client.online = true;
+
+	uint32_t restarted_ms = 0, worst_recovery_ms = 0, max_held = 0;
+	for (uint32_t now_ms = 1; now_ms <= duration_ms; now_ms++) {
+		const bool running = broker_running_at(now_ms);
+		if (broker.running && !running && client.connected) {
+			client.drop_seen_ms = now_ms + plan.detect_ms;
+		} else if (!broker.running && running) {
+			restarted_ms = now_ms;
+		}
+		broker.running = running;
+
+		// MQTT_EVENT_DISCONNECTED, from a drop or a failed attempt
+		bool down = false, up = false;
+		if (client.drop_seen_ms != 0 && now_ms >= client.drop_seen_ms) {
+			client.drop_seen_ms = 0;
+			down = true;
+		}
+		if (client.attempt_done_ms != 0 && now_ms >= client.attempt_done_ms) {
+			client.attempt_done_ms = 0;
+			if (broker.running) {
+				up = true;
+			} else {
+				down = true;
+			}
+		}
+		if (down) {
+			client.connected = client.online = false;
+			lego_link_down(&client.link, now_ms);
+		}
+		if (up) {
+			client.connected = true;
+			lego_link_up(&client.link, now_ms);
+			if (restarted_ms != 0 && now_ms - restarted_ms > worst_recovery_ms) {
+				worst_recovery_ms = now_ms - restarted_ms;
+			}
+			restarted_ms = 0;
+			flush();
+		}
+
+		uint32_t wait_ms = 0;
+		if (lego_link_poll(&client.link, now_ms, &wait_ms)) {
+			client.attempt_done_ms = now_ms + (broker.running ? CONNECT_MS : REFUSE_MS);
+		}
+		publishers(now_ms);
+		if (client.outbox.live > max_held) {
+			max_held = client.outbox.live;
+		}
+	}
+
+	const uint32_t sent = duration_ms / ACK_PERIOD_MS;
+	const uint32_t missing = sent - broker.acks;
+	printf("%u outage(s), %u ms run, detection after %u ms\n", plan.noutages, duration_ms,
+		   plan.detect_ms);
+	printf("acks:      %u sent, %u received, %u out of order\n", sent, broker.acks,
+		   broker.out_of_order);
+	printf("           %u lost before the drop was noticed\n", client.lost_in_flight);
+	printf("outbox:    %u held at most, %u dropped, %u coalesced, %u left\n", max_held,
+		   client.outbox.dropped, client.outbox.coalesced, client.outbox.live);
+	printf("reports:   %u telemetry, %u metrics\n", broker.telemetry, broker.metrics);
+	printf("reconnect: %u outage(s), worst %u ms after the restart\n", client.link.outages,
+		   worst_recovery_ms);
+
+	// Every missing ack is accounted for by the outbox or the undetected drop
+	const bool ok = broker.out_of_order == 0 && client.outbox.live == 0 && client.online &&
+					missing <= client.outbox.dropped + client.lost_in_flight;
+	printf("%s\n", ok ? "ok" : "FAIL");
+	return ok ? 0 : 1;
+}
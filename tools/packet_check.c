@@ -0,0 +1,182 @@
+// Host test of the words lego_packet.h builds against the Power Functions RC
+// protocol. Build and run from the repo root:
+//
+//	gcc -std=gnu11 -O2 -Imain -o packet_check tools/packet_check.c
+//	./packet_check
+//
+// Expected words are put together nibble by nibble from the spec, not from
+// lego_packet_t: T E C C | a M M M | D D D D | L L L L, with the LRC
+// 0xf ^ nibble 1 ^ nibble 2 ^ nibble 3. Covers every combo direct key mask,
+// single output and combo PWM at every speed of the spec's step table,
+// lego_pwm_step() for negative steps and clamping, where the toggle, escape,
+// address and mode bits land, a few words assembled by hand and the byte
+// order on the air.
+
+#include <stdio.h>
+
+#include "lego_packet.h"
+
+static uint32_t failures = 0;
+
+static uint16_t spec_word(uint8_t n1, uint8_t n2, uint8_t n3) {
+	const uint8_t lrc = 0xf ^ n1 ^ n2 ^ n3;
+	return n1 << 12 | n2 << 8 | n3 << 4 | lrc;
+}
+
+static void expect(const char *what, uint32_t arg, const lego_packet_t *pkt, uint16_t want) {
+	const uint16_t got = lego_packet_raw(pkt);
+	if (got != want) {
+		printf("FAIL %s %u: %04x, spec %04x\n", what, arg, got, want);
+		failures++;
+	}
+}
+
+// PWM speed nibble for -7..7, brake included, from the spec's table
+static const struct {
+	int8_t speed;
+	uint8_t nibble;
+} pwm_steps[] = {
+	{0, 0x0},	{1, 0x1},  {2, 0x2},  {3, 0x3},	 {4, 0x4},	{5, 0x5},  {6, 0x6}, {7, 0x7},
+	{-7, 0x9}, {-6, 0xa}, {-5, 0xb}, {-4, 0xc}, {-3, 0xd}, {-2, 0xe}, {-1, 0xf},
+};
+#define NSTEPS (sizeof(pwm_steps) / sizeof(pwm_steps[0]))
+
+static void check_pwm_step(void) {
+	for (uint32_t i = 0; i < NSTEPS; i++) {
+		const uint8_t got = lego_pwm_step(pwm_steps[i].speed);
+		if (got != pwm_steps[i].nibble) {
+			printf(
+				"FAIL lego_pwm_step(%d): %x, spec %x\n", pwm_steps[i].speed, got,
+				pwm_steps[i].nibble);
+			failures++;
+		}
+	}
+	// Clamped to the last step, never wrapping into brake or float
+	const int8_t clamped[][2] = {{8, 0x7}, {100, 0x7}, {-8, 0x9}, {-128, 0x9}};
+	for (uint32_t i = 0; i < sizeof(clamped) / sizeof(clamped[0]); i++) {
+		const uint8_t got = lego_pwm_step(clamped[i][0]);
+		if (got != (uint8_t)clamped[i][1]) {
+			printf("FAIL lego_pwm_step(%d): %x, spec %x\n", clamped[i][0], got, clamped[i][1]);
+			failures++;
+		}
+	}
+}
+
+// Mode 001, toggle set for a single output on, which is what the remote
+// sends for one key. The zero mode of older clients comes out the same.
+static void check_combo_direct(void) {
+	for (uint8_t ch = 0; ch < 4; ch++) {
+		for (uint8_t key = 0; key < 16; key++) {
+			const bool single = key == LEGO_LB || key == LEGO_LF || key == LEGO_RF ||
+								key == LEGO_RB;
+			const uint16_t want = spec_word(single << 3 | ch, 0x1, key);
+			const lego_packet_t old =
+				lego_packet_prepare((lego_packet_t){.channel = ch, .key = key});
+			expect("combo direct", ch << 4 | key, &old, want);
+			const lego_packet_t pkt = lego_packet_prepare(
+				(lego_packet_t){.channel = ch, .mode = LEGO_MODE_COMBO_DIRECT, .key = key});
+			expect("combo direct", ch << 4 | key, &pkt, want);
+		}
+		const lego_packet_t stop = lego_packet_prepare(LEGO_STOP_PACKET(ch));
+		expect("stop on channel", ch, &stop, spec_word(ch, 0x1, 0x0));
+	}
+}
+
+// Escape 0, mode 100 for output A and 101 for B, toggle as given
+static void check_single_pwm(void) {
+	for (uint8_t ch = 0; ch < 4; ch++) {
+		for (uint32_t i = 0; i < NSTEPS; i++) {
+			const uint8_t step = lego_pwm_step(pwm_steps[i].speed);
+			for (uint8_t out = 0; out < 2; out++) {
+				for (uint8_t toggle = 0; toggle < 2; toggle++) {
+					const lego_packet_t pkt = lego_packet_pwm(ch, out, step, toggle);
+					expect(
+						"single output PWM", ch << 8 | i << 2 | out << 1 | toggle, &pkt,
+						spec_word(toggle << 3 | ch, 0x4 | out, pwm_steps[i].nibble));
+				}
+			}
+		}
+		const lego_packet_t brake = lego_packet_pwm(ch, true, LEGO_PWM_BRAKE, false);
+		expect("single output PWM brake", ch, &brake, spec_word(ch, 0x5, 0x8));
+	}
+}
+
+// Escape 1, address 0, output B speed in nibble 2 and A in nibble 3
+static void check_combo_pwm(void) {
+	for (uint8_t ch = 0; ch < 4; ch++) {
+		for (uint32_t a = 0; a < NSTEPS; a++) {
+			for (uint32_t b = 0; b < NSTEPS; b++) {
+				const lego_packet_t pkt = lego_packet_combo_pwm(
+					ch, lego_pwm_step(pwm_steps[a].speed), lego_pwm_step(pwm_steps[b].speed));
+				expect(
+					"combo PWM", ch << 8 | a << 4 | b, &pkt,
+					spec_word(0x4 | ch, pwm_steps[b].nibble, pwm_steps[a].nibble));
+			}
+		}
+		const lego_packet_t brake = lego_packet_combo_pwm(ch, LEGO_PWM_BRAKE, LEGO_PWM_FLOAT);
+		expect("combo PWM brake A", ch, &brake, spec_word(0x4 | ch, 0x0, 0x8));
+	}
+}
+
+// Each named field on its own, everything else 0
+static void check_fields(void) {
+	const struct {
+		const char *name;
+		lego_packet_t pkt;
+		uint16_t bit;
+	} fields[] = {
+		{"toggle", {.toggle = true}, 1 << 15},
+		{"escape", {.escape = true}, 1 << 14},
+		{"channel", {.channel = 3}, 3 << 12},
+		{"address", {.address = true}, 1 << 11},
+		{"mode", {.mode = LEGO_MODE_CSTID_B}, 7 << 8},
+		{"key", {.key = 0xf}, 0xf << 4},
+		{"checksum", {.checksum = 0xf}, 0xf},
+	};
+	for (uint32_t i = 0; i < sizeof(fields) / sizeof(fields[0]); i++) {
+		expect(fields[i].name, 0, &fields[i].pkt, fields[i].bit);
+	}
+	if (sizeof(lego_packet_t) != 2) {
+		printf("FAIL lego_packet_t is %zu bytes\n", sizeof(lego_packet_t));
+		failures++;
+	}
+}
+
+// Words assembled by hand, in case spec_word() and the struct agree on
+// something wrong
+static void check_literals(void) {
+	const lego_packet_t stop = lego_packet_prepare(LEGO_STOP_PACKET(0));
+	expect("stop, channel 1", 0, &stop, 0x010e);
+	const lego_packet_t lf = lego_packet_prepare((lego_packet_t){.channel = 3, .key = LEGO_LF});
+	expect("LF alone, channel 4", 0, &lf, 0xb127);
+	const lego_packet_t pwm = lego_packet_pwm(0, false, lego_pwm_step(1), false);
+	expect("A forward 1, channel 1", 0, &pwm, 0x041a);
+	const lego_packet_t combo = lego_packet_combo_pwm(1, lego_pwm_step(7), lego_pwm_step(-1));
+	expect("A forward 7 B backward 1, channel 2", 0, &combo, 0x5f72);
+}
+
+// Nibble 1 first on the air, through an MSB-first bytes encoder
+static void check_wire(void) {
+	const lego_packet_t pkt = lego_packet_combo_pwm(1, lego_pwm_step(7), lego_pwm_step(-1));
+	const uint16_t wire = lego_packet_wire(&pkt);
+	uint8_t bytes[2];
+	memcpy(bytes, &wire, sizeof(bytes));
+	if (bytes[0] != 0x5f || bytes[1] != 0x72) {
+		printf("FAIL wire order: %02x %02x, spec 5f 72\n", bytes[0], bytes[1]);
+		failures++;
+	}
+}
+
+int main(void) {
+	check_pwm_step();
+	check_combo_direct();
+	check_single_pwm();
+	check_combo_pwm();
+	check_fields();
+	check_literals();
+	check_wire();
+	printf(
+		"%s: combo direct, single output and combo PWM words match the spec\n",
+		failures == 0 ? "ok" : "FAIL");
+	return failures == 0 ? 0 : 1;
+}
@@ -0,0 +1,237 @@
+// Host plant simulation for tuning lego_pid.c, the HC-SR04 distance
+// controller. Build and run from the repo root:
+//
+//	gcc -std=gnu11 -O2 -Imain -o pid_sim tools/pid_sim.c main/lego_pid.c main/lego_range.c -lm
+//	./pid_sim -p 0.07 -i 0.01 -d 0.004
+//	./pid_sim -w
+//
+// A PF vehicle facing a wall runs in simulated 100 us steps: a first-order
+// motor that doesn't move below PLANT_MIN_STEP, a harder stop on brake, and
+// the IR latency before a new step takes effect. The sensor pings as soon as
+// the previous echo is in, with noise and stray echoes, through the same
+// lego_range filter as the firmware. Every scenario starts at rest and
+// reports settling time to within SETTLE_MM, overshoot and how many steps the
+// controller sent. -w sweeps the gains and prints the best few by mean
+// settling time, the long runs are bound by top speed whatever the gains.
+
+#include <getopt.h>
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "lego_pid.h"
+#include "lego_range.h"
+
+// Same values as RANGE_* in defs.h, which needs ESP-IDF
+#define RANGE_SETPOINT_MM 300
+#define RANGE_PID_KP 0.07
+#define RANGE_PID_KI 0.01
+#define RANGE_PID_KD 0.004
+#define RANGE_PID_DEADBAND_MM 5
+#define RANGE_PID_HYSTERESIS 0.2
+#define RANGE_PID_MAX_STEP 7
+
+#define SIM_STEP_US 100
+#define SIM_US 8000000
+#define SETTLE_MM 20
+
+// Speed at step 7 and the time constants of the drive train
+#define PLANT_VMAX_MM_S 500.0
+#define PLANT_MIN_STEP 2
+#define PLANT_TAU_S 0.2
+#define PLANT_BRAKE_TAU_S 0.04
+// Pipeline, frame and repeat before the receiver acts on a new step
+#define PLANT_IR_LATENCY_US 25000
+// From the trigger to the echo going high
+#define SENSOR_BURST_US 500
+// Task wakeup and restart of the next ping
+#define SENSOR_OVERHEAD_US 1000
+#define SENSOR_NOISE_MM 2.0
+#define SENSOR_STRAY_RATE 0.03
+
+static uint64_t rng_state = 1;
+
+static uint32_t rng_next(void) {
+	rng_state ^= rng_state << 13;
+	rng_state ^= rng_state >> 7;
+	rng_state ^= rng_state << 17;
+	return rng_state >> 32;
+}
+
+static double rng_uniform(void) {
+	return rng_next() / 4294967296.0;
+}
+
+typedef struct {
+	double kp, ki, kd;
+} gains_t;
+
+typedef struct {
+	uint32_t settle_us;
+	double overshoot_mm;
+	uint32_t changes;
+} result_t;
+
+static int32_t to_fixed(double gain) {
+	return (int32_t)lround(gain * (1 << LEGO_PID_SHIFT));
+}
+
+static result_t run(const gains_t *gains, double start_mm, uint32_t seed) {
+	const lego_pid_config_t cfg = {
+		.setpoint_mm = RANGE_SETPOINT_MM,
+		.kp = to_fixed(gains->kp),
+		.ki = to_fixed(gains->ki),
+		.kd = to_fixed(gains->kd),
+		.deadband_mm = RANGE_PID_DEADBAND_MM,
+		.hysteresis = to_fixed(RANGE_PID_HYSTERESIS),
+		.max_step = RANGE_PID_MAX_STEP,
+	};
+	lego_pid_t pid;
+	lego_pid_init(&pid, &cfg);
+	lego_range_filter_t filter;
+	lego_range_filter_init(&filter);
+	rng_state = seed;
+
+	double x = start_mm, v = 0;
+	int8_t sent = 0, applied = 0;
+	uint32_t sent_us = 0, next_sample_us = 0;
+	result_t res = {0};
+	for (uint32_t t = 0; t < SIM_US; t += SIM_STEP_US) {
+		if (applied != sent && t - sent_us >= PLANT_IR_LATENCY_US) {
+			applied = sent;
+		}
+		const int8_t mag = applied >= 0 ? applied : -applied;
+		const double target =
+			mag < PLANT_MIN_STEP ? 0 : (applied > 0 ? 1 : -1) * PLANT_VMAX_MM_S * mag / 7;
+		const double tau = applied == 0 ? PLANT_BRAKE_TAU_S : PLANT_TAU_S;
+		v += (target - v) * SIM_STEP_US / 1e6 / tau;
+		x -= v * SIM_STEP_US / 1e6;
+
+		if (t >= next_sample_us) {
+			double reading = x + (rng_uniform() * 2 - 1) * SENSOR_NOISE_MM;
+			if (rng_uniform() < SENSOR_STRAY_RATE) {
+				reading = 50 + rng_uniform() * 3000;
+			}
+			const uint32_t mm = reading < 0 ? 0 : (uint32_t)reading;
+			next_sample_us = t + SENSOR_BURST_US + mm * 58 / 10 + SENSOR_OVERHEAD_US;
+			const int8_t step = lego_pid_update(&pid, lego_range_filter(&filter, mm), t);
+			if (step != sent) {
+				sent = step;
+				sent_us = t;
+				res.changes++;
+			}
+		}
+
+		const double error = x - RANGE_SETPOINT_MM;
+		if (fabs(error) > SETTLE_MM) {
+			res.settle_us = t + SIM_STEP_US;
+		}
+		// Past the setpoint, on the other side from the start
+		const double past = start_mm > RANGE_SETPOINT_MM ? -error : error;
+		if (past > res.overshoot_mm) {
+			res.overshoot_mm = past;
+		}
+	}
+	return res;
+}
+
+static const double starts[] = {1000, 2000, 80, 450};
+#define NSTARTS (sizeof(starts) / sizeof(starts[0]))
+
+#define NSEEDS 3
+
+// Mean settling over all scenarios and seeds, with the worst overshoot and
+// step count
+static uint32_t score(const gains_t *gains, double *overshoot, uint32_t *changes) {
+	uint64_t sum = 0;
+	*overshoot = 0;
+	*changes = 0;
+	for (uint32_t i = 0; i < NSTARTS; i++) {
+		for (uint32_t seed = 1; seed <= NSEEDS; seed++) {
+			const result_t res = run(gains, starts[i], seed * 7919);
+			sum += res.settle_us;
+			*overshoot = res.overshoot_mm > *overshoot ? res.overshoot_mm : *overshoot;
+			*changes = res.changes > *changes ? res.changes : *changes;
+		}
+	}
+	return sum / (NSTARTS * NSEEDS);
+}
+
+static void sweep(void) {
+	enum { NBEST = 5 };
+	struct {
+		gains_t gains;
+		uint32_t settle_us;
+		double overshoot_mm;
+		uint32_t changes;
+	} best[NBEST];
+	uint32_t nbest = 0;
+	for (double kp = 0.005; kp <= 0.25; kp *= 1.25) {
+		for (double ki = 0; ki <= 0.02; ki += 0.0025) {
+			for (double kd = 0; kd <= 0.02; kd += 0.002) {
+				const gains_t gains = {kp, ki, kd};
+				double overshoot = 0;
+				uint32_t changes = 0;
+				const uint32_t settle_us = score(&gains, &overshoot, &changes);
+				// Bumping into the wall or chattering doesn't count as settled
+				if (overshoot > SETTLE_MM * 2 || changes > 40) {
+					continue;
+				}
+				uint32_t i = nbest < NBEST ? nbest++ : NBEST;
+				for (; i > 0 && best[i - 1].settle_us > settle_us; i--) {
+					if (i < NBEST) {
+						best[i] = best[i - 1];
+					}
+				}
+				if (i < NBEST) {
+					best[i].gains = gains;
+					best[i].settle_us = settle_us;
+					best[i].overshoot_mm = overshoot;
+					best[i].changes = changes;
+				}
+			}
+		}
+	}
+	for (uint32_t i = 0; i < nbest; i++) {
+		printf(
+			"-p %.4f -i %.4f -d %.4f: settles in %4u ms, overshoot %3.0f mm, %2u steps\n",
+			best[i].gains.kp, best[i].gains.ki, best[i].gains.kd, best[i].settle_us / 1000,
+			best[i].overshoot_mm, best[i].changes);
+	}
+}
+
+int main(int argc, char **argv) {
+	gains_t gains = {RANGE_PID_KP, RANGE_PID_KI, RANGE_PID_KD};
+	int opt;
+	while ((opt = getopt(argc, argv, "p:i:d:w")) != -1) {
+		switch (opt) {
+		case 'p':
+			gains.kp = atof(optarg);
+			break;
+		case 'i':
+			gains.ki = atof(optarg);
+			break;
+		case 'd':
+			gains.kd = atof(optarg);
+			break;
+		case 'w':
+			sweep();
+			return 0;
+		default:
+			fprintf(stderr, "usage: %s [-p kp] [-i ki] [-d kd] [-w]\n", argv[0]);
+			return 2;
+		}
+	}
+
+	bool settled = true;
+	for (uint32_t i = 0; i < NSTARTS; i++) {
+		const result_t res = run(&gains, starts[i], 7919);
+		const bool ok = res.settle_us < SIM_US;
+		settled &= ok;
+		printf(
+			"%s: %4.0f -> %u mm, settles in %4u ms, overshoot %3.0f mm, %2u steps\n",
+			ok ? "ok" : "FAIL", starts[i], RANGE_SETPOINT_MM, res.settle_us / 1000,
+			res.overshoot_mm, res.changes);
+	}
+	return settled ? 0 : 1;
+}
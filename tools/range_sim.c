@@ -0,0 +1,97 @@
+// Host test of lego_range.c. Build and run from the repo root:
+//
+//	gcc -std=gnu11 -O2 -Imain -o range_sim tools/range_sim.c main/lego_range.c
+//	./range_sim
+//
+// Checks the fixed-point conversion against the float formula it replaced at
+// the capture clocks the ESP32 can run, the ring across wraparound and when
+// full, and that the filter ignores single spikes and settles on a step.
+
+#include <stdio.h>
+
+#include "lego_range.h"
+
+int main(void) {
+	uint32_t failures = 0;
+
+	static const uint32_t clocks[] = {1000000, 40000000, 80000000, 160000000};
+	for (uint32_t c = 0; c < sizeof(clocks) / sizeof(clocks[0]); c++) {
+		const uint32_t scale = lego_range_scale(clocks[c]);
+		// Up to the ~38 ms of a missing echo
+		for (uint32_t us = 0; us <= 38000; us += 7) {
+			const uint32_t ticks = (uint64_t)us * clocks[c] / 1000000;
+			const uint32_t want = (uint32_t)((float)(ticks / (clocks[c] / 1e6)) / 5.8);
+			const uint32_t got = lego_range_mm(ticks, scale);
+			if (got + 1 < want || got > want + 1) {
+				printf("FAIL %lu Hz, %lu us: %lu mm, want %lu\n", (unsigned long)clocks[c],
+					   (unsigned long)us, (unsigned long)got, (unsigned long)want);
+				failures++;
+				break;
+			}
+		}
+	}
+	printf("%s: fixed-point conversion within 1 mm\n", failures == 0 ? "ok" : "FAIL");
+
+	const uint32_t before_ring = failures;
+	static lego_range_ring_t ring;
+	lego_range_ring_init(&ring);
+	lego_range_sample_t sample;
+	for (uint32_t i = 0; i < 3 * LEGO_RANGE_RING_SIZE; i++) {
+		lego_range_push(&ring, i, i * 10);
+		if (!lego_range_pop(&ring, &sample) || sample.stamp_us != i || sample.mm != i * 10) {
+			printf("FAIL ring sample %lu\n", (unsigned long)i);
+			failures++;
+		}
+	}
+	for (uint32_t i = 0; i < LEGO_RANGE_RING_SIZE + 3; i++) {
+		lego_range_push(&ring, i, i);
+	}
+	uint32_t n = 0;
+	while (lego_range_pop(&ring, &sample)) {
+		if (sample.stamp_us != n) {
+			printf("FAIL full ring returned %lu at %lu\n", (unsigned long)sample.stamp_us,
+				   (unsigned long)n);
+			failures++;
+		}
+		n++;
+	}
+	if (n != LEGO_RANGE_RING_SIZE || atomic_load(&ring.dropped) != 3) {
+		printf("FAIL full ring kept %lu, dropped %lu\n", (unsigned long)n,
+			   (unsigned long)atomic_load(&ring.dropped));
+		failures++;
+	}
+	printf("%s: sample ring\n", failures == before_ring ? "ok" : "FAIL");
+
+	const uint32_t before_filter = failures;
+	lego_range_filter_t filter;
+	lego_range_filter_init(&filter);
+	if (lego_range_filter(&filter, 300) != 300) {
+		printf("FAIL first sample\n");
+		failures++;
+	}
+	for (uint32_t i = 0; i < 10; i++) {
+		// Every fourth sample is a stray echo
+		const uint32_t mm = lego_range_filter(&filter, i % 4 == 3 ? 3500 : 300);
+		if (mm != 300) {
+			printf("FAIL spike leaked through as %lu\n", (unsigned long)mm);
+			failures++;
+		}
+	}
+	uint32_t mm = 0;
+	uint32_t settled = 0;
+	for (uint32_t i = 1; i <= 30 && settled == 0; i++) {
+		mm = lego_range_filter(&filter, 600);
+		if (mm >= 598) {
+			settled = i;
+		}
+	}
+	if (settled == 0 || settled > LEGO_RANGE_MEDIAN + 20) {
+		printf("FAIL step to 600 mm at %lu after %lu samples\n", (unsigned long)mm,
+			   (unsigned long)settled);
+		failures++;
+	}
+	printf(
+		"%s: filter, step settled after %lu samples\n", failures == before_filter ? "ok" : "FAIL",
+		(unsigned long)settled);
+	return failures == 0 ? 0 : 1;
+}
@@ -0,0 +1,198 @@
+// Host benchmark for lego_router.c against the strncmp/sscanf chain it
+// replaced in esp_mqtt_event_callback(). Build and run from the repo root:
+//
+//	gcc -std=gnu11 -O2 -Imain -o router_bench tools/router_bench.c main/lego_router.c
+//	./router_bench -r 28 -n 1000000
+//
+// Registers the firmware's routes plus filler ones up to -r, checks that
+// prefixes and extra levels no longer match and that overlapping patterns
+// fall back to "+", then times dispatch of a mix of matching and unknown
+// topics both ways.
+
+#include <getopt.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "lego_router.h"
+
+static const char *firmware_routes[] = {
+	"esp/1/lego/cmd/append", "esp/1/lego/cmd/batch", "esp/1/lego/cmd/append/+",
+	"esp/1/lego/cmd/batch/+", "esp/1/lego/cmd/flush", "esp/1/lego/button",
+	"esp/1/gpio/+/set/+",
+};
+#define NFIRMWARE (sizeof(firmware_routes) / sizeof(firmware_routes[0]))
+
+static const char *topics[] = {
+	"esp/1/lego/button",		  "esp/1/lego/cmd/batch/1234", "esp/1/lego/cmd/append",
+	"esp/1/gpio/4/set/1",		  "esp/1/lego/cmd/flush",	   "esp/1/bench/flood",
+	"esp/1/sensor/17/threshold", "esp/2/lego/button",
+};
+#define NTOPICS (sizeof(topics) / sizeof(topics[0]))
+
+static uint32_t hits[LEGO_ROUTER_MAX_ROUTES];
+static lego_route_args_t last_args;
+
+static void count_route(void *msg, const lego_route_args_t *args, void *ctx) {
+	hits[(uintptr_t)ctx]++;
+	last_args = *args;
+}
+
+static double now_s(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+// The old dispatch: every literal topic in turn, bounded by the incoming
+// length, then sscanf() for the patterns
+static int chain_dispatch(char patterns[][48], uint32_t n, const char *topic, uint32_t topic_len) {
+	char buf[64] = {0};
+	memcpy(buf, topic, topic_len < sizeof(buf) ? topic_len : sizeof(buf) - 1);
+	unsigned long a = 0, b = 0;
+	for (uint32_t i = 0; i < n; i++) {
+		if (strchr(patterns[i], '+') == NULL && strncmp(topic, patterns[i], topic_len) == 0) {
+			return i;
+		}
+	}
+	if (sscanf(buf, "esp/1/lego/cmd/append/%lu", &a) == 1 ||
+		sscanf(buf, "esp/1/lego/cmd/batch/%lu", &a) == 1 ||
+		sscanf(buf, "esp/1/gpio/%lu/set/%lu", &a, &b) == 2) {
+		return n;
+	}
+	return -1;
+}
+
+static bool expect(lego_router_t *router, const char *topic, int route) {
+	memset(hits, 0, sizeof(hits));
+	const bool matched = lego_router_dispatch(router, topic, strlen(topic), NULL);
+	const bool ok = route < 0 ? !matched : matched && hits[route] == 1;
+	if (!ok) {
+		printf("FAIL %s\n", topic);
+	}
+	return ok;
+}
+
+// `args` are the levels "+" should have taken, separated by spaces
+static bool expect_args(lego_router_t *router, const char *topic, int route, const char *args) {
+	if (!expect(router, topic, route)) {
+		return false;
+	}
+	char got[64] = {0};
+	int len = 0;
+	for (uint8_t i = 0; i < last_args.n; i++) {
+		len += snprintf(
+			got + len, sizeof(got) - len, "%s%.*s", i > 0 ? " " : "", last_args.len[i],
+			last_args.arg[i]);
+	}
+	if (strcmp(got, args) != 0) {
+		printf("FAIL %s: arguments \"%s\", expected \"%s\"\n", topic, got, args);
+		return false;
+	}
+	return true;
+}
+
+// Patterns sharing levels, where the first exact match leads nowhere
+static bool check_overlaps(void) {
+	static const char *patterns[] = {"a/+/x", "a/b/y", "+/b/c", "a/b/+/z", "a/+/+/z"};
+	static lego_router_t router;
+	lego_router_init(&router);
+	for (uint32_t i = 0; i < sizeof(patterns) / sizeof(patterns[0]); i++) {
+		if (!lego_router_add(&router, patterns[i], 0, count_route, (void *)(uintptr_t)i)) {
+			printf("FAIL can't add %s\n", patterns[i]);
+			return false;
+		}
+	}
+	bool ok = true;
+	ok &= expect_args(&router, "a/b/x", 0, "b");
+	ok &= expect_args(&router, "a/c/x", 0, "c");
+	ok &= expect_args(&router, "a/b/y", 1, "");
+	// Back up to the root, with the "b" taken on the way dropped
+	ok &= expect_args(&router, "a/b/c", 2, "a");
+	ok &= expect_args(&router, "q/b/c", 2, "q");
+	// The exact level furthest to the left wins
+	ok &= expect_args(&router, "a/b/q/z", 3, "q");
+	ok &= expect_args(&router, "a/c/q/z", 4, "c q");
+	ok &= expect(&router, "a/b/q", -1);
+	ok &= expect(&router, "a/b/z", -1);
+	ok &= expect(&router, "a/b/q/y", -1);
+	return ok;
+}
+
+int main(int argc, char **argv) {
+	uint32_t nroutes = 28;
+	uint32_t iterations = 1000000;
+	int opt;
+	while ((opt = getopt(argc, argv, "r:n:")) != -1) {
+		switch (opt) {
+		case 'r':
+			nroutes = strtoul(optarg, NULL, 0);
+			break;
+		case 'n':
+			iterations = strtoul(optarg, NULL, 0);
+			break;
+		default:
+			fprintf(stderr, "Usage: %s [-r routes] [-n iterations]\n", argv[0]);
+			return 1;
+		}
+	}
+	if (nroutes < NFIRMWARE || nroutes > LEGO_ROUTER_MAX_ROUTES) {
+		fprintf(stderr, "-r must be %zu..%d\n", NFIRMWARE, LEGO_ROUTER_MAX_ROUTES);
+		return 1;
+	}
+
+	static lego_router_t router;
+	static char patterns[LEGO_ROUTER_MAX_ROUTES][48];
+	lego_router_init(&router);
+	for (uint32_t i = 0; i < nroutes; i++) {
+		if (i < NFIRMWARE) {
+			strcpy(patterns[i], firmware_routes[i]);
+		} else {
+			snprintf(patterns[i], sizeof(patterns[i]), "esp/1/dev%u/state/set", i);
+		}
+		if (!lego_router_add(&router, patterns[i], 0, count_route, (void *)(uintptr_t)i)) {
+			fprintf(stderr, "Can't add %s\n", patterns[i]);
+			return 1;
+		}
+	}
+
+	bool ok = lego_router_add(&router, patterns[0], 0, count_route, NULL) == false;
+	ok &= expect(&router, "esp/1/lego/cmd/append", 0);
+	ok &= expect(&router, "esp/1/lego/cmd/append/7", 2);
+	ok &= expect(&router, "esp/1/gpio/4/set/1", 6);
+	// Matched the old chain through the strncmp() bound
+	ok &= expect(&router, "esp/1/lego/cmd", -1);
+	ok &= expect(&router, "esp/1/lego", -1);
+	ok &= expect(&router, "esp/1/lego/cmd/append/7/8", -1);
+	ok &= expect(&router, "esp/1/gpio/4/set", -1);
+	ok &= expect(&router, "", -1);
+	printf("%s: prefixes and extra levels\n", ok ? "ok" : "FAIL");
+	const bool overlaps_ok = check_overlaps();
+	printf("%s: overlapping patterns fall back to \"+\"\n", overlaps_ok ? "ok" : "FAIL");
+	ok &= overlaps_ok;
+	printf(
+		"old chain takes \"esp/1/lego\" for %s\n",
+		patterns[chain_dispatch(patterns, nroutes, "esp/1/lego", 10)]);
+
+	uint32_t lens[NTOPICS];
+	for (uint32_t i = 0; i < NTOPICS; i++) {
+		lens[i] = strlen(topics[i]);
+	}
+	volatile int sink = 0;
+	double start = now_s();
+	for (uint32_t i = 0; i < iterations; i++) {
+		sink += lego_router_dispatch(&router, topics[i % NTOPICS], lens[i % NTOPICS], NULL);
+	}
+	const double router_ns = (now_s() - start) * 1e9 / iterations;
+	start = now_s();
+	for (uint32_t i = 0; i < iterations; i++) {
+		sink += chain_dispatch(patterns, nroutes, topics[i % NTOPICS], lens[i % NTOPICS]);
+	}
+	const double chain_ns = (now_s() - start) * 1e9 / iterations;
+
+	printf("%u routes, %u messages\n", nroutes, iterations);
+	printf("router: %8.1f ns/message\n", router_ns);
+	printf("chain:  %8.1f ns/message\n", chain_ns);
+	return ok ? 0 : 1;
+}
@@ -0,0 +1,420 @@
+// Host simulation of lego_sched.c, the four channel queues interleaved onto
+// the IR LED. Build and run from the repo root:
+//
+//	gcc -std=gnu11 -O2 -Imain -o sched_sim tools/sched_sim.c main/lego_sched.c main/lego_timing.c
+//	./sched_sim
+//
+// The controller loop and the RMT pipeline run in simulated 100 us steps:
+// batches are staged while fewer than IR_TX_PIPELINE_DEPTH are in flight,
+// and a second lego_timing stands in for the encoder's, synced at the start
+// of every transaction like lego_encoder.c, to put the frames on the air.
+// Drive packets and holds are sent around the scheduler like lego_tx_send()
+// and lego_tx_hold() do. Checks that:
+// - with every channel backlogged, no channel waits for more than 3 frames
+//   of the others once its PF retransmit window is open
+// - a packet on an otherwise idle channel is on the air after at most the
+//   frames already in the pipeline plus 4
+// - the scheduler's model of the air clock predicts the end of each of its
+//   transactions exactly, around drive packets, holds and idle time. -u shows
+//   what it gets wrong without the accounting and resync in ir.h.
+// - repeats are told apart by the word on the air, and gaps over
+//   LEGO_TIMING_GAP_MAX_US are counted as clamped
+
+#include <getopt.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "lego_sched.h"
+
+// Same values as defs.h, which needs ESP-IDF
+#define IR_TX_BATCH_PACKETS 8
+#define IR_TX_PIPELINE_DEPTH 4
+#define IR_TX_MIN_GAP_US 2000
+#define RANGE_DRIVE_REPEAT 2
+
+#define SIM_STEP_US 100
+#define MAX_FRAMES 65536
+// Longest frame and the gap after it
+#define SLOT_US (LEGO_TIMING_TM_US + IR_TX_MIN_GAP_US)
+
+static uint64_t rng_state = 1;
+
+static uint32_t rng_next(void) {
+	rng_state ^= rng_state << 13;
+	rng_state ^= rng_state >> 7;
+	rng_state ^= rng_state << 17;
+	return rng_state >> 32;
+}
+
+typedef struct {
+	uint8_t channel;
+	bool bypass;
+	uint64_t start_us;
+	// Window opening, 0 if none, and when the packet was pushed
+	uint64_t earliest_us;
+	uint64_t pushed_us;
+} frame_t;
+
+static struct {
+	lego_sched_t sched;
+	// The encoder's timing
+	lego_timing_t air;
+	// Account and resync as ir.h does
+	bool resync;
+	uint64_t now_us;
+	// End of the last transaction on the air
+	uint64_t air_free_us;
+	uint64_t tx_end_us[IR_TX_PIPELINE_DEPTH];
+	uint32_t submitted, completed;
+	// Transactions of the scheduler whose end the model got wrong, and by
+	// how much at most
+	uint32_t drifted;
+	uint64_t drift_max_us;
+	// Push time of every queued packet, per channel in queue order
+	uint64_t pushed_us[4][LEGO_RING_SIZE];
+	uint32_t push_head[4], push_tail[4];
+	frame_t frames[MAX_FRAMES];
+	uint32_t nframes;
+} sim;
+
+static const lego_timing_config_t timing_config = {
+	.min_gap_us = IR_TX_MIN_GAP_US,
+	.retransmit_windows = true,
+};
+
+static void sim_init(bool resync) {
+	lego_sched_init(&sim.sched, &timing_config);
+	lego_timing_init(&sim.air, &timing_config);
+	sim.resync = resync;
+	sim.now_us = 0;
+	sim.air_free_us = 0;
+	sim.submitted = sim.completed = 0;
+	sim.drifted = 0;
+	sim.drift_max_us = 0;
+	for (uint8_t ch = 0; ch < 4; ch++) {
+		sim.push_head[ch] = sim.push_tail[ch] = 0;
+	}
+	sim.nframes = 0;
+}
+
+static uint32_t sim_inflight(void) {
+	while (sim.completed < sim.submitted &&
+		   sim.tx_end_us[sim.completed % IR_TX_PIPELINE_DEPTH] <= sim.now_us) {
+		sim.completed++;
+	}
+	return sim.submitted - sim.completed;
+}
+
+static bool sim_push(const lego_packet_t *pkt) {
+	const lego_step_t step = {.packet = *pkt, .repeat = 1};
+	const uint8_t ch = pkt->channel;
+	if (lego_sched_push(&sim.sched, &step, 1, (uint32_t)sim.now_us | 1) == 0) {
+		return false;
+	}
+	sim.pushed_us[ch][sim.push_head[ch]++ % LEGO_RING_SIZE] = sim.now_us;
+	return true;
+}
+
+// The encoder picks a transaction up once the LED is free, see
+// lego_encoder_encode(). `model_end_us` is the end the scheduler expects, 0
+// for packets sent around it.
+static void sim_air(const lego_packet_t *pkts, uint32_t n, bool bypass, uint64_t model_end_us) {
+	lego_timing_sync(&sim.air, sim.now_us > sim.air_free_us ? sim.now_us : sim.air_free_us);
+	for (uint32_t i = 0; i < n; i++) {
+		const uint8_t ch = pkts[i].channel;
+		frame_t *frame = &sim.frames[sim.nframes++ % MAX_FRAMES];
+		frame->channel = ch;
+		frame->bypass = bypass;
+		frame->earliest_us = lego_timing_earliest_us(&sim.air, &pkts[i]);
+		lego_timing_schedule(&sim.air, &pkts[i]);
+		frame->start_us = sim.air.last_start_us[ch];
+		frame->pushed_us =
+			bypass ? frame->start_us : sim.pushed_us[ch][sim.push_tail[ch]++ % LEGO_RING_SIZE];
+	}
+	sim.air_free_us = sim.air.now_us;
+	if (!bypass && model_end_us != sim.air.now_us) {
+		const uint64_t drift = model_end_us > sim.air.now_us ? model_end_us - sim.air.now_us
+															 : sim.air.now_us - model_end_us;
+		sim.drift_max_us = drift > sim.drift_max_us ? drift : sim.drift_max_us;
+		sim.drifted++;
+	}
+}
+
+static void sim_submit(const lego_packet_t *pkts, uint32_t n, bool bypass, uint64_t model_end_us) {
+	sim_air(pkts, n, bypass, model_end_us);
+	sim.tx_end_us[sim.submitted++ % IR_TX_PIPELINE_DEPTH] = sim.air_free_us;
+}
+
+static void sim_resync(void) {
+	if (sim.resync && sim_inflight() == 0) {
+		lego_sched_resync(&sim.sched, &sim.air, sim.now_us);
+	}
+}
+
+// The controller loop topping up the pipeline
+static void sim_control(void) {
+	sim_resync();
+	while (sim_inflight() < IR_TX_PIPELINE_DEPTH) {
+		lego_packet_t pkts[IR_TX_BATCH_PACKETS];
+		uint32_t ingest_us = 0;
+		const uint32_t n = lego_sched_fill(&sim.sched, pkts, IR_TX_BATCH_PACKETS, &ingest_us);
+		if (n == 0) {
+			break;
+		}
+		sim_submit(pkts, n, false, sim.sched.model.now_us);
+	}
+}
+
+// lego_tx_send(), called with room in the pipeline
+static void sim_send(const lego_packet_t *pkts, uint32_t n) {
+	if (sim.resync) {
+		sim_resync();
+		lego_sched_account(&sim.sched, pkts, n);
+	}
+	sim_submit(pkts, n, true, 0);
+}
+
+// lego_tx_hold() on `ch` for `hold_us`, then its release
+static void sim_hold(uint8_t ch, uint32_t hold_us) {
+	const lego_packet_t held = {.channel = ch, .key = LEGO_LF | LEGO_RF};
+	// rmt_tx_wait_all_done()
+	if (sim.air_free_us > sim.now_us) {
+		sim.now_us = sim.air_free_us;
+	}
+	if (sim.resync) {
+		sim_resync();
+		lego_sched_account(&sim.sched, &held, 1);
+	}
+	// Encoded once, looped by the hardware and cut by rmt_disable()
+	sim_air(&held, 1, true, 0);
+	sim.now_us += hold_us;
+	sim.air_free_us = sim.now_us;
+	const lego_packet_t stops[2] = {LEGO_STOP_PACKET(ch), LEGO_STOP_PACKET(ch)};
+	sim_send(stops, 2);
+}
+
+static void sim_drain(void) {
+	while (lego_sched_pending(&sim.sched) > 0 || sim_inflight() > 0) {
+		sim_control();
+		sim.now_us += SIM_STEP_US;
+	}
+}
+
+// Frames of other channels between the later of the previous frame of the
+// same channel and the opening of its window, and the frame itself
+static uint32_t sim_worst_wait(void) {
+	uint32_t worst = 0;
+	for (uint32_t i = 0; i < sim.nframes; i++) {
+		const frame_t *frame = &sim.frames[i];
+		uint32_t others = 0;
+		for (uint32_t j = i; j-- > 0;) {
+			if (sim.frames[j].channel == frame->channel) {
+				break;
+			}
+			if (sim.frames[j].start_us < frame->earliest_us) {
+				break;
+			}
+			others++;
+		}
+		worst = others > worst ? others : worst;
+	}
+	return worst;
+}
+
+static uint32_t check_drift(const char *name) {
+	if (sim.drifted == 0) {
+		return 0;
+	}
+	printf(
+		"FAIL %s: model off for %u transactions, by up to %lu us\n", name, sim.drifted,
+		(unsigned long)sim.drift_max_us);
+	return 1;
+}
+
+// Frames per second of each channel, from its first frame to its last
+static void print_rates(const char *name) {
+	printf("%s:", name);
+	for (uint8_t ch = 0; ch < 4; ch++) {
+		uint32_t n = 0;
+		uint64_t first_us = 0, last_us = 0;
+		for (uint32_t i = 0; i < sim.nframes; i++) {
+			const frame_t *frame = &sim.frames[i];
+			if (frame->bypass || frame->channel != ch) {
+				continue;
+			}
+			first_us = n++ == 0 ? frame->start_us : first_us;
+			last_us = frame->start_us;
+		}
+		printf(" ch%u %5.1f/s", ch + 1, n > 1 ? (n - 1) * 1e6 / (last_us - first_us) : 0);
+	}
+	printf("\n");
+}
+
+// Every channel backlogged with frames that keep changing, so no window
+// applies, then with the same frame over and over, so they all do
+static uint32_t check_backlog(bool repeated) {
+	const char *name = repeated ? "backlog, repeated frames" : "backlog, changing frames";
+	sim_init(true);
+	for (uint32_t i = 0; i < 200; i++) {
+		for (uint8_t ch = 0; ch < 4; ch++) {
+			const lego_packet_t pkt = {
+				.channel = ch, .key = repeated ? LEGO_LF : (i & 1 ? LEGO_LF : LEGO_LB)};
+			sim_push(&pkt);
+		}
+	}
+	sim_drain();
+	const uint32_t worst = sim_worst_wait();
+	print_rates(name);
+	uint32_t failures = check_drift(name);
+	if (worst > 3) {
+		printf("FAIL %s: a ready channel waited %u frames\n", name, worst);
+		failures++;
+	}
+	printf(
+		"%s: %s, %u frames, a ready channel waits at most %u\n", failures == 0 ? "ok" : "FAIL",
+		name, sim.nframes, worst);
+	return failures;
+}
+
+// Channel 1 flooded, the others with a packet every 100 to 400 ms
+static uint32_t check_latency(void) {
+	const char *name = "latency";
+	const uint64_t bound_us = (IR_TX_PIPELINE_DEPTH * IR_TX_BATCH_PACKETS + 4) * SLOT_US;
+	sim_init(true);
+	uint64_t next_us[4] = {0};
+	uint8_t key[4] = {LEGO_LF, LEGO_LF, LEGO_LF, LEGO_LF};
+	for (sim.now_us = 0; sim.now_us < 20000000; sim.now_us += SIM_STEP_US) {
+		while (lego_ring_count(&sim.sched.queues[0]) < LEGO_RING_SIZE / 2) {
+			key[0] ^= LEGO_LF ^ LEGO_LB;
+			sim_push(&(lego_packet_t){.channel = 0, .key = key[0]});
+		}
+		for (uint8_t ch = 1; ch < 4; ch++) {
+			if (sim.now_us >= next_us[ch]) {
+				key[ch] ^= LEGO_LF ^ LEGO_LB;
+				sim_push(&(lego_packet_t){.channel = ch, .key = key[ch]});
+				next_us[ch] = sim.now_us + 100000 + rng_next() % 300000;
+			}
+		}
+		sim_control();
+	}
+	uint64_t worst_us[4] = {0};
+	for (uint32_t i = 0; i < sim.nframes; i++) {
+		const frame_t *frame = &sim.frames[i];
+		const uint64_t latency_us = frame->start_us - frame->pushed_us;
+		if (latency_us > worst_us[frame->channel]) {
+			worst_us[frame->channel] = latency_us;
+		}
+	}
+	print_rates(name);
+	uint32_t failures = check_drift(name);
+	for (uint8_t ch = 1; ch < 4; ch++) {
+		if (worst_us[ch] > bound_us) {
+			printf(
+				"FAIL %s: ch%u waited %lu ms, over %lu ms\n", name, ch + 1,
+				(unsigned long)(worst_us[ch] / 1000), (unsigned long)(bound_us / 1000));
+			failures++;
+		}
+	}
+	printf(
+		"%s: %s, sparse channels on the air within %lu/%lu/%lu ms, bound %lu ms\n",
+		failures == 0 ? "ok" : "FAIL", name, (unsigned long)(worst_us[1] / 1000),
+		(unsigned long)(worst_us[2] / 1000), (unsigned long)(worst_us[3] / 1000),
+		(unsigned long)(bound_us / 1000));
+	return failures;
+}
+
+// Random traffic with runs of repeats, drive packets every 300 ms, idle
+// stretches and a hold in the middle
+static uint32_t check_model(bool resync) {
+	const char *name = resync ? "model" : "model without resync";
+	sim_init(resync);
+	uint64_t next_push_us = 0, next_drive_us = 0;
+	bool held = false, drive_pending = false;
+	while (sim.now_us < 10000000) {
+		if (sim.now_us >= next_push_us) {
+			const lego_packet_t pkt = {.channel = rng_next() % 4, .key = rng_next() % 16};
+			for (uint32_t run = 1 + rng_next() % 4; run > 0; run--) {
+				sim_push(&pkt);
+			}
+			// Bursts, then a second or so of nothing now and then
+			next_push_us = sim.now_us + (rng_next() % 8 == 0 ? 1000000 : 20000);
+		}
+		if (sim.now_us >= next_drive_us) {
+			drive_pending = true;
+			next_drive_us = sim.now_us + 300000;
+		}
+		if (!held && sim.now_us >= 3000000) {
+			held = true;
+			sim_hold(rng_next() % 4, 1500000);
+		}
+		if (drive_pending && sim_inflight() < IR_TX_PIPELINE_DEPTH) {
+			lego_packet_t pkts[2 * RANGE_DRIVE_REPEAT];
+			for (uint32_t i = 0; i < RANGE_DRIVE_REPEAT; i++) {
+				pkts[2 * i] = lego_packet_pwm(2, false, 3, i & 1);
+				pkts[2 * i + 1] = lego_packet_pwm(2, true, 3, i & 1);
+			}
+			sim_send(pkts, 2 * RANGE_DRIVE_REPEAT);
+			drive_pending = false;
+		}
+		sim_control();
+		sim.now_us += SIM_STEP_US;
+	}
+	if (!resync) {
+		printf(
+			"info: %s, off for %u of %u transactions, by up to %lu ms\n", name, sim.drifted,
+			sim.submitted, (unsigned long)(sim.drift_max_us / 1000));
+		return 0;
+	}
+	const uint32_t failures = check_drift(name);
+	printf(
+		"%s: %s, %u transactions ended where the scheduler expected\n",
+		failures == 0 ? "ok" : "FAIL", name, sim.submitted);
+	return failures;
+}
+
+static uint32_t check_timing(void) {
+	uint32_t failures = 0;
+	lego_timing_t timing;
+	lego_timing_init(&timing, &timing_config);
+	// Mode 0 from an older client and a stale checksum, the same word on the
+	// air as a prepared stop packet
+	const lego_packet_t stop = lego_packet_prepare(LEGO_STOP_PACKET(1));
+	const lego_packet_t raw_stop = {.channel = 1, .checksum = 0x5};
+	lego_timing_schedule(&timing, &stop);
+	if (lego_timing_earliest_us(&timing, &raw_stop) == 0) {
+		printf("FAIL timing: an unprepared repeat skips the retransmit window\n");
+		failures++;
+	}
+	const lego_timing_config_t long_gap = {.min_gap_us = LEGO_TIMING_GAP_MAX_US + 1};
+	lego_timing_init(&timing, &long_gap);
+	if (lego_timing_schedule(&timing, &stop) != LEGO_TIMING_GAP_MAX_US || timing.clamped != 1) {
+		printf("FAIL timing: long gap not clamped and counted\n");
+		failures++;
+	}
+	printf("%s: timing, repeats by air word and clamped gaps\n", failures == 0 ? "ok" : "FAIL");
+	return failures;
+}
+
+int main(int argc, char **argv) {
+	bool show_unsynced = false;
+	int opt;
+	while ((opt = getopt(argc, argv, "u")) != -1) {
+		switch (opt) {
+		case 'u':
+			show_unsynced = true;
+			break;
+		default:
+			fprintf(stderr, "usage: %s [-u]\n", argv[0]);
+			return 2;
+		}
+	}
+	uint32_t failures = check_timing();
+	failures += check_backlog(false);
+	failures += check_backlog(true);
+	failures += check_latency();
+	failures += check_model(true);
+	if (show_unsynced) {
+		check_model(false);
+	}
+	return failures == 0 ? 0 : 1;
+}
@@ -0,0 +1,101 @@
+// Turns the binary records from esp/1/trace back into log lines. Build and
+// run from the repo root:
+//
+//	gcc -std=gnu11 -O2 -Imain -o trace_decode tools/trace_decode.c
+//	mosquitto_sub -h 192.168.0.110 -t esp/1/trace -N > trace.bin
+//	./trace_decode trace.bin
+//
+// Reads stdin without a file. Every line is the esp_timer time in us, the
+// core, the event and its payload. Records missing from the sequence are
+// reported where they went missing.
+
+#include <inttypes.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "lego_packet.h"
+#include "lego_trace.h"
+
+#define LEGO_TRACE_NAME(id, name, is_packet) [LEGO_TRACE_##id] = name,
+static const char *event_names[] = {LEGO_TRACE_EVENTS(LEGO_TRACE_NAME)};
+#undef LEGO_TRACE_NAME
+
+#define LEGO_TRACE_IS_PACKET(id, name, is_packet) [LEGO_TRACE_##id] = is_packet,
+static const bool event_is_packet[] = {LEGO_TRACE_EVENTS(LEGO_TRACE_IS_PACKET)};
+#undef LEGO_TRACE_IS_PACKET
+
+static void print_record(const lego_trace_header_t *header, const lego_trace_record_t *record) {
+	// Cycles are counted per core, each core has its own reference point.
+	// Records are at most one drain period old, well within the 32-bit wrap.
+	int64_t us = 0;
+	if (record->core < header->cores && record->core < 2 && header->cpu_mhz > 0) {
+		const uint32_t age = header->sync[record->core].cycles - record->cycles;
+		us = header->sync[record->core].us - age / header->cpu_mhz;
+	}
+	printf("%12" PRId64 " core%u ", us, record->core);
+	if (record->event >= LEGO_TRACE_EVENT_COUNT) {
+		printf("event%-9u 0x%04x\n", record->event, record->payload);
+		return;
+	}
+	printf("%-14s", event_names[record->event]);
+	if (record->event == LEGO_TRACE_TX_HOLD) {
+		printf("0x%04x\n", record->payload);
+		return;
+	}
+	if (!event_is_packet[record->event]) {
+		printf("%u\n", record->payload);
+		return;
+	}
+	// TX packets are traced before lego_packet_prepare(), toggle and
+	// checksum are not final there
+	const lego_packet_t pkt = lego_packet_from_raw(record->payload);
+	char keys[5] = {0};
+	for (int i = 0; i < 4; i++) {
+		keys[i] = pkt.key & (1 << (3 - i)) ? '1' : '0';
+	}
+	printf(
+		"0x%04x toggle=%d escape=%d channel=%u mode=%u keys=%s\n", record->payload, pkt.toggle,
+		pkt.escape, pkt.channel + 1, pkt.mode, keys);
+}
+
+int main(int argc, char **argv) {
+	FILE *in = stdin;
+	if (argc > 1) {
+		in = fopen(argv[1], "rb");
+		if (in == NULL) {
+			perror(argv[1]);
+			return 1;
+		}
+	}
+
+	lego_trace_header_t header;
+	static lego_trace_record_t records[UINT16_MAX];
+	uint32_t next_seq = 0;
+	uint32_t messages = 0, total = 0, missing = 0;
+	while (fread(&header, sizeof(header), 1, in) == 1) {
+		if (header.magic != LEGO_TRACE_MAGIC || header.version != LEGO_TRACE_VERSION) {
+			fprintf(stderr, "Not a trace message at message %" PRIu32 "\n", messages);
+			return 1;
+		}
+		if (fread(records, sizeof(records[0]), header.count, in) != header.count) {
+			fprintf(stderr, "Message %" PRIu32 " is truncated\n", messages);
+			return 1;
+		}
+		messages++;
+		for (uint32_t i = 0; i < header.count; i++) {
+			const lego_trace_record_t *record = &records[i];
+			if (next_seq != 0 && record->seq != next_seq) {
+				printf("-- %" PRIu32 " records lost --\n", record->seq - next_seq);
+				missing += record->seq - next_seq;
+			}
+			next_seq = record->seq + 1;
+			print_record(&header, record);
+			total++;
+		}
+	}
+	fprintf(
+		stderr, "%" PRIu32 " messages, %" PRIu32 " records, %" PRIu32 " missing\n", messages,
+		total, missing);
+	return 0;
+}